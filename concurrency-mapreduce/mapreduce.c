@@ -0,0 +1,884 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "mapreduce.h"
+
+//
+// How it works:
+//
+// - Mappers are a pool of num_mappers threads, each taking the next
+//   piece of work off a shared counter until there are none left. The
+//   work is sorted largest first, so that a big file is not started
+//   last, with everyone else waiting on it; with a ChunkMapper, big
+//   files are also cut into chunks (at newlines), so that none of them
+//   takes much longer than the rest.
+//
+// - MR_Emit() copies the key and value (back to back, as "key\0value\0")
+//   into the calling thread's arena: large blocks that are carved up by
+//   bumping a pointer and are all freed at once at the end, so there is
+//   no malloc()/free() per pair. A record (two pointers into the arena)
+//   then goes into the thread's own buffer for the key's partition.
+//   Only when that buffer fills up (or the mapper is done) is it
+//   merged into the partition's array, under the partition's lock; so
+//   mappers take a lock once per EMIT_BUFFER pairs rather than per pair.
+//   Setting MR_STATS in the environment prints how fast pairs were
+//   emitted and how long merging took, on stderr.
+//
+// - With a combiner, pairs are first staged: their strings go into a
+//   separate staging arena, and the buffers are COMBINE_BUFFER records
+//   each, as the more pairs are seen together, the more of them share
+//   a key. When any buffer fills up, every buffer is sorted and each run
+//   of equal keys is combined down to one pair, which is copied into a
+//   fresh staging arena, so that the old one, holding everything
+//   combined away, can be freed. Buffers still more than half full are
+//   then merged into their partitions (copying the strings into the
+//   arena for good); the rest stay behind.
+//
+// - With a memory budget, pairs are staged the same way (without a
+//   combiner, all the buffers are merged whenever one fills up), but
+//   are copied into an arena of the partition's own when merged. Once
+//   a partition holds more than its share of the budget, its records
+//   and arena are taken out of it, sorted, and written to a run file
+//   in spill_dir, and the memory is freed.
+//
+// - Once all mappers are done, each of the num_reducers threads sorts
+//   its own partition (partition i belongs to reducer i), all in
+//   parallel, and walks it calling Reduce() once per run of equal keys.
+//   The getter is a cursor over that run: each call is one step, and no
+//   searching is done. A partition that was spilled is instead read
+//   back with a k-way merge of its run files and what was left in
+//   memory (first merging runs MERGE_WAYS at a time into bigger ones,
+//   if there are more than that, to bound open files and buffers).
+//   The getter then hands out the values of the current key from each
+//   source that has it, in turn.
+//
+
+#define ARENA_BLOCK (1 << 20)
+#define EMIT_BUFFER (512)
+#define COMBINE_BUFFER (8192)
+#define MERGE_WAYS (64)
+#define SPILL_BUFFER (1 << 16)
+
+typedef struct __block_t {
+    struct __block_t *next;
+    char data[];
+} block_t;
+
+typedef struct {
+    block_t *blocks;
+    char *next;                 // free space in the current block...
+    size_t left;                // ...and how much of it
+    size_t used;                // bytes handed out
+} arena_t;
+
+typedef struct {
+    char *key;
+    char *value;
+} record_t;
+
+// everything a thread calling MR_Emit() has to itself
+typedef struct __emitter_t {
+    arena_t arena;
+    arena_t staging;            // when staged: for the buffered pairs
+    record_t *buffers;          // buffer_size records per partition...
+    int *buffered;              // ...of which this many are in use
+    unsigned long emits;
+    unsigned long merges;
+    unsigned long long merge_ns;
+    struct __emitter_t *all_next; // on the list of all emitters
+} emitter_t;
+
+//
+// Spilled data is read back through sources: a run file, or the sorted
+// records still in memory. A run file holds groups, in key order, of
+// "key\0", a native uint32_t count, then that many "value\0".
+//
+typedef struct {
+    FILE *f;                    // a run file, or...
+    record_t *records;          // ...records in memory
+    size_t next, count;
+    char *key;                  // the current group's key...
+    uint32_t left;              // ...and how many of its values are left
+    char *line;                 // (getdelim() buffers)
+    size_t line_room;
+    char *value;
+    size_t value_room;
+} source_t;
+
+typedef struct {
+    source_t **heap;            // sources with groups left, by key
+    int heap_size;
+    source_t **active;          // the sources of the current key...
+    int num_active;
+    int cur;                    // ...and the one values are coming from
+} merge_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    record_t *records;
+    size_t count, room;
+    arena_t arena;              // with a budget: the records' strings
+    char **runs;                // run files spilled so far
+    int num_runs, runs_room;
+    size_t next;                // getter: the next value to hand out...
+    size_t end;                 // ...and the end of the current key's run
+    merge_t *merge;             // ...or, once spilled, where they come from
+} partition_t;
+
+static partition_t *partitions;
+static int num_partitions;
+static Partitioner partitioner;
+static Combiner combiner;
+static int buffer_size;         // EMIT_BUFFER, or COMBINE_BUFFER with a combiner
+static int staged;              // with a combiner or a budget
+static Reducer reducer;
+
+static size_t partition_budget; // 0 for none
+static char *spill_dir;
+static unsigned long spill_runs, spill_bytes;
+
+typedef struct {
+    char *file;
+    long offset;
+    long length;
+} work_t;
+
+static Mapper mapper;
+static ChunkMapper chunk_mapper;
+static work_t *work;
+static int num_work;
+static int work_room;
+static int next_work = 0;
+
+static __thread emitter_t *me = NULL;
+static __thread record_t *combine_next, *combine_end;
+static emitter_t *emitters = NULL;
+static pthread_mutex_t emitters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    assert(p != NULL);
+    return p;
+}
+
+static void thread_create(pthread_t *thread, void *(*start)(void *), void *arg) {
+    int rc = pthread_create(thread, NULL, start, arg);
+    assert(rc == 0);
+}
+
+static void thread_join(pthread_t thread) {
+    int rc = pthread_join(thread, NULL);
+    assert(rc == 0);
+}
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//
+// Arenas
+//
+
+static char *arena_alloc(arena_t *a, size_t size) {
+    if (size > a->left) {
+	// big allocations get a block of their own, so that the rest of
+	// the current block is not wasted
+	size_t block_size = size > ARENA_BLOCK / 4 ? size : ARENA_BLOCK;
+	block_t *b = xmalloc(sizeof(block_t) + block_size);
+	b->next = a->blocks;
+	a->blocks = b;
+	if (block_size != ARENA_BLOCK) {
+	    a->used += size;
+	    return b->data;
+	}
+	a->next = b->data;
+	a->left = block_size;
+    }
+    char *p = a->next;
+    a->next += size;
+    a->left -= size;
+    a->used += size;
+    return p;
+}
+
+static void arena_free(arena_t *a) {
+    while (a->blocks) {
+	block_t *b = a->blocks;
+	a->blocks = b->next;
+	free(b);
+    }
+    a->next = NULL;
+    a->left = 0;
+    a->used = 0;
+}
+
+// copies a pair into a, filling in r
+static void arena_store(arena_t *a, record_t *r, char *key, char *value) {
+    size_t key_len = strlen(key) + 1, value_len = strlen(value) + 1;
+    char *copy = arena_alloc(a, key_len + value_len);
+    memcpy(copy, key, key_len);
+    memcpy(copy + key_len, value, value_len);
+    r->key = copy;
+    r->value = copy + key_len;
+}
+
+static int record_compare(const void *a, const void *b) {
+    return strcmp(((record_t *) a)->key, ((record_t *) b)->key);
+}
+
+//
+// Spilling
+//
+
+static FILE *spill_create(char **name) {
+    size_t len = strlen(spill_dir) + sizeof("/mr-spill-XXXXXX");
+    *name = xmalloc(len);
+    snprintf(*name, len, "%s/mr-spill-XXXXXX", spill_dir);
+    int fd = mkstemp(*name);
+    if (fd < 0) {
+	perror(*name);
+	exit(1);
+    }
+    FILE *f = fdopen(fd, "w");
+    assert(f != NULL);
+    setvbuf(f, NULL, _IOFBF, SPILL_BUFFER);
+    return f;
+}
+
+static void spill_group(FILE *f, char *key, uint32_t count) {
+    fwrite(key, 1, strlen(key) + 1, f);
+    fwrite(&count, sizeof(count), 1, f);
+}
+
+static void spill_value(FILE *f, char *value) {
+    fwrite(value, 1, strlen(value) + 1, f);
+}
+
+static void spill_close(FILE *f, char *name) {
+    long size = ftell(f);
+    if (ferror(f) || fclose(f) != 0) {
+	fprintf(stderr, "%s: write failed\n", name);
+	exit(1);
+    }
+    __atomic_fetch_add(&spill_bytes, size, __ATOMIC_RELAXED);
+}
+
+static void partition_add_run(partition_t *p, char *name) {
+    if (p->num_runs == p->runs_room) {
+	p->runs_room = p->runs_room ? 2 * p->runs_room : 16;
+	p->runs = realloc(p->runs, p->runs_room * sizeof(char *));
+	assert(p->runs != NULL);
+    }
+    p->runs[p->num_runs++] = name;
+}
+
+// sorts records (whose strings are in a) into a new run of partition
+// n, and frees them
+static void spill_write(int n, record_t *records, size_t count, arena_t *a) {
+    qsort(records, count, sizeof(record_t), record_compare);
+    char *name;
+    FILE *f = spill_create(&name);
+    size_t i = 0;
+    while (i < count) {
+	size_t j = i + 1;
+	while (j < count && strcmp(records[j].key, records[i].key) == 0)
+	    j++;
+	spill_group(f, records[i].key, j - i);
+	for (; i < j; i++)
+	    spill_value(f, records[i].value);
+    }
+    spill_close(f, name);
+    free(records);
+    arena_free(a);
+    __atomic_fetch_add(&spill_runs, 1, __ATOMIC_RELAXED);
+
+    partition_t *p = &partitions[n];
+    pthread_mutex_lock(&p->lock);
+    partition_add_run(p, name);
+    pthread_mutex_unlock(&p->lock);
+}
+
+//
+// Emitting
+//
+
+static emitter_t *emitter_get() {
+    if (me == NULL) {
+	me = xmalloc(sizeof(emitter_t));
+	memset(me, 0, sizeof(emitter_t));
+	me->buffers = xmalloc(num_partitions * buffer_size * sizeof(record_t));
+	me->buffered = xmalloc(num_partitions * sizeof(int));
+	memset(me->buffered, 0, num_partitions * sizeof(int));
+	pthread_mutex_lock(&emitters_lock);
+	me->all_next = emitters;
+	emitters = me;
+	pthread_mutex_unlock(&emitters_lock);
+    }
+    return me;
+}
+
+// moves what e has buffered for partition n into the partition
+static void emitter_merge(emitter_t *e, int n) {
+    int count = e->buffered[n];
+    if (count == 0)
+	return;
+    unsigned long long start = now_ns();
+    record_t *buffer = e->buffers + n * buffer_size;
+    partition_t *p = &partitions[n];
+    int i;
+    // staged pairs don't last; these have to
+    if (staged && !partition_budget)
+	for (i = 0; i < count; i++)
+	    arena_store(&e->arena, &buffer[i], buffer[i].key, buffer[i].value);
+    pthread_mutex_lock(&p->lock);
+    if (partition_budget)
+	for (i = 0; i < count; i++)
+	    arena_store(&p->arena, &buffer[i], buffer[i].key, buffer[i].value);
+    if (p->count + count > p->room) {
+	while (p->count + count > p->room)
+	    p->room = p->room ? 2 * p->room : 4 * EMIT_BUFFER;
+	p->records = realloc(p->records, p->room * sizeof(record_t));
+	assert(p->records != NULL);
+    }
+    memcpy(p->records + p->count, buffer, count * sizeof(record_t));
+    p->count += count;
+    record_t *full = NULL;
+    size_t full_count = 0;
+    arena_t full_arena;
+    if (partition_budget && p->arena.used + p->count * sizeof(record_t) > partition_budget) {
+	// take it all away, and let others carry on while it is written
+	full = p->records;
+	full_count = p->count;
+	full_arena = p->arena;
+	p->records = NULL;
+	p->count = p->room = 0;
+	memset(&p->arena, 0, sizeof(arena_t));
+    }
+    pthread_mutex_unlock(&p->lock);
+    e->buffered[n] = 0;
+    e->merges++;
+    e->merge_ns += now_ns() - start;
+    if (full)
+	spill_write(n, full, full_count, &full_arena);
+}
+
+static char *combine_get_next(char *key, int partition_number) {
+    if (combine_next == combine_end)
+	return NULL;
+    return (combine_next++)->value;
+}
+
+// sorts a buffer and combines its runs of equal keys, storing what is
+// left into a (the combiner may reuse its buffer on the next call);
+// returns how many records are left
+static int combine(record_t *buffer, int count, int partition_number, arena_t *a) {
+    qsort(buffer, count, sizeof(record_t), record_compare);
+    int i = 0, out = 0;
+    while (i < count) {
+	int j = i + 1;
+	while (j < count && strcmp(buffer[j].key, buffer[i].key) == 0)
+	    j++;
+	char *value = buffer[i].value;
+	if (j - i > 1) {
+	    combine_next = buffer + i;
+	    combine_end = buffer + j;
+	    value = combiner(buffer[i].key, combine_get_next, partition_number);
+	}
+	arena_store(a, &buffer[out++], buffer[i].key, value);
+	i = j;
+    }
+    return out;
+}
+
+//
+// Combines all of e's buffers, merges the ones that did not shrink
+// much, and moves what is left into a fresh staging arena. With final
+// set, everything is merged.
+//
+static void emitter_compact(emitter_t *e, int final) {
+    arena_t fresh = { NULL, NULL, 0 };
+    int n;
+    for (n = 0; n < num_partitions; n++) {
+	if (e->buffered[n] == 0)
+	    continue;
+	e->buffered[n] = combine(e->buffers + n * buffer_size, e->buffered[n], n, &fresh);
+	if (final || e->buffered[n] > buffer_size / 2)
+	    emitter_merge(e, n);
+    }
+    arena_free(&e->staging);
+    e->staging = fresh;
+}
+
+static void emitter_merge_all(emitter_t *e) {
+    int n;
+    if (combiner)
+	emitter_compact(e, 1);
+    for (n = 0; n < num_partitions; n++)
+	emitter_merge(e, n);
+    arena_free(&e->staging);
+}
+
+void MR_Emit(char *key, char *value) {
+    emitter_t *e = emitter_get();
+    unsigned long n = partitioner(key, num_partitions);
+    assert(n < (unsigned long) num_partitions);
+    record_t *r = &e->buffers[n * buffer_size + e->buffered[n]];
+    arena_store(staged ? &e->staging : &e->arena, r, key, value);
+    e->emits++;
+    if (++e->buffered[n] < buffer_size)
+	return;
+    if (combiner)
+	emitter_compact(e, 0);
+    else if (staged)
+	emitter_merge_all(e);
+    else
+	emitter_merge(e, n);
+}
+
+unsigned long MR_DefaultHashPartition(char *key, int num_partitions) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *key++) != '\0')
+	hash = hash * 33 + c;
+    return hash % num_partitions;
+}
+
+//
+// Scheduling the map work
+//
+
+// where the chunk that would start at offset really starts: just after
+// the first newline at or after offset - 1
+static long chunk_start(int fd, long offset, long size) {
+    char buf[4096];
+    long at = offset - 1;
+    while (at < size) {
+	ssize_t rc = pread(fd, buf, sizeof(buf), at);
+	if (rc <= 0)
+	    return size;
+	char *nl = memchr(buf, '\n', rc);
+	if (nl)
+	    return at + (nl - buf) + 1;
+	at += rc;
+    }
+    return size;
+}
+
+static void work_add(char *file, long offset, long length) {
+    if (num_work == work_room) {
+	work_room *= 2;
+	work = realloc(work, work_room * sizeof(work_t));
+	assert(work != NULL);
+    }
+    work[num_work].file = file;
+    work[num_work].offset = offset;
+    work[num_work].length = length;
+    num_work++;
+}
+
+static int work_compare(const void *a, const void *b) {
+    long la = ((work_t *) a)->length, lb = ((work_t *) b)->length;
+    return la < lb ? 1 : la > lb ? -1 : 0;
+}
+
+static void work_plan(char **files, int num_files, long chunk_size) {
+    int i;
+    work_room = num_files + 1;
+    work = xmalloc(work_room * sizeof(work_t));
+    num_work = 0;
+    next_work = 0;
+    for (i = 0; i < num_files; i++) {
+	struct stat sbuf;
+	// the mapper gets to deal with files that are not there
+	long size = stat(files[i], &sbuf) == 0 ? sbuf.st_size : 0;
+	int fd = -1;
+	if (chunk_mapper && chunk_size > 0 && size > chunk_size)
+	    fd = open(files[i], O_RDONLY);
+	if (fd < 0) {
+	    work_add(files[i], 0, size);
+	    continue;
+	}
+	long start = 0;
+	while (start < size) {
+	    long end = start + chunk_size < size ? chunk_start(fd, start + chunk_size, size) : size;
+	    work_add(files[i], start, end - start);
+	    start = end;
+	}
+	close(fd);
+    }
+    qsort(work, num_work, sizeof(work_t), work_compare);
+}
+
+static void *map_thread(void *arg) {
+    while (1) {
+	int i = __atomic_fetch_add(&next_work, 1, __ATOMIC_RELAXED);
+	if (i >= num_work)
+	    break;
+	if (chunk_mapper)
+	    chunk_mapper(work[i].file, work[i].offset, work[i].length);
+	else
+	    mapper(work[i].file);
+    }
+    if (me)
+	emitter_merge_all(me);
+    return NULL;
+}
+
+static void print_stats(unsigned long long map_ns) {
+    unsigned long emits = 0, merges = 0;
+    unsigned long long merge_ns = 0;
+    int threads = 0;
+    emitter_t *e;
+    for (e = emitters; e; e = e->all_next) {
+	emits += e->emits;
+	merges += e->merges;
+	merge_ns += e->merge_ns;
+	threads++;
+    }
+    fprintf(stderr, "MR_STATS map: %.3f s, %lu pairs from %d threads, %.0f pairs/s\n",
+	    map_ns / 1e9, emits, threads, map_ns ? emits / (map_ns / 1e9) : 0.0);
+    fprintf(stderr, "MR_STATS merge: %lu merges, %.3f s total (%.1f%% of mapper time), %.0f ns each\n",
+	    merges, merge_ns / 1e9,
+	    map_ns && threads ? 100.0 * merge_ns / ((double) map_ns * threads) : 0.0,
+	    merges ? (double) merge_ns / merges : 0.0);
+    if (partition_budget)
+	fprintf(stderr, "MR_STATS spill: %lu runs, %lu bytes\n", spill_runs, spill_bytes);
+}
+
+//
+// Merging spilled runs
+//
+
+static void source_open(source_t *s, char *name) {
+    memset(s, 0, sizeof(source_t));
+    s->f = fopen(name, "r");
+    if (s->f == NULL) {
+	perror(name);
+	exit(1);
+    }
+    setvbuf(s->f, NULL, _IOFBF, SPILL_BUFFER);
+}
+
+static void source_memory(source_t *s, record_t *records, size_t count) {
+    memset(s, 0, sizeof(source_t));
+    s->records = records;
+    s->count = count;
+}
+
+static void source_close(source_t *s) {
+    if (s->f)
+	fclose(s->f);
+    free(s->line);
+    free(s->value);
+}
+
+// moves on to the next group; 0 at the end
+static int source_group(source_t *s) {
+    if (s->f == NULL) {
+	if (s->next == s->count)
+	    return 0;
+	size_t end = s->next + 1;
+	while (end < s->count && strcmp(s->records[end].key, s->records[s->next].key) == 0)
+	    end++;
+	s->key = s->records[s->next].key;
+	s->left = end - s->next;
+	return 1;
+    }
+    if (getdelim(&s->line, &s->line_room, '\0', s->f) <= 0)
+	return 0;
+    s->key = s->line;
+    size_t rc = fread(&s->left, sizeof(s->left), 1, s->f);
+    assert(rc == 1);
+    return 1;
+}
+
+static char *source_value(source_t *s) {
+    if (s->left == 0)
+	return NULL;
+    s->left--;
+    if (s->f == NULL)
+	return s->records[s->next++].value;
+    ssize_t rc = getdelim(&s->value, &s->value_room, '\0', s->f);
+    assert(rc > 0);
+    return s->value;
+}
+
+static int source_less(source_t *a, source_t *b) {
+    return strcmp(a->key, b->key) < 0;
+}
+
+static void heap_push(merge_t *m, source_t *s) {
+    int i = m->heap_size++;
+    while (i > 0 && source_less(s, m->heap[(i - 1) / 2])) {
+	m->heap[i] = m->heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    m->heap[i] = s;
+}
+
+static source_t *heap_pop(merge_t *m) {
+    source_t *top = m->heap[0], *last = m->heap[--m->heap_size];
+    int i = 0;
+    while (1) {
+	int child = 2 * i + 1;
+	if (child >= m->heap_size)
+	    break;
+	if (child + 1 < m->heap_size && source_less(m->heap[child + 1], m->heap[child]))
+	    child++;
+	if (!source_less(m->heap[child], last))
+	    break;
+	m->heap[i] = m->heap[child];
+	i = child;
+    }
+    m->heap[i] = last;
+    return top;
+}
+
+static void merge_start(merge_t *m, source_t *sources, int n) {
+    m->heap = xmalloc(n * sizeof(source_t *));
+    m->active = xmalloc(n * sizeof(source_t *));
+    m->heap_size = m->num_active = m->cur = 0;
+    int i;
+    for (i = 0; i < n; i++)
+	if (source_group(&sources[i]))
+	    heap_push(m, &sources[i]);
+}
+
+static void merge_end(merge_t *m) {
+    free(m->heap);
+    free(m->active);
+}
+
+// the next key (in order) from any source, or NULL when all are done;
+// values not taken of the previous one are skipped
+static char *merge_key(merge_t *m) {
+    int i;
+    for (i = 0; i < m->num_active; i++) {
+	source_t *s = m->active[i];
+	while (source_value(s) != NULL)
+	    ;
+	if (source_group(s))
+	    heap_push(m, s);
+    }
+    m->num_active = m->cur = 0;
+    if (m->heap_size == 0)
+	return NULL;
+    m->active[m->num_active++] = heap_pop(m);
+    while (m->heap_size > 0 && strcmp(m->heap[0]->key, m->active[0]->key) == 0)
+	m->active[m->num_active++] = heap_pop(m);
+    return m->active[0]->key;
+}
+
+// how many values the current key has left
+static uint32_t merge_left(merge_t *m) {
+    uint32_t left = 0;
+    int i;
+    for (i = m->cur; i < m->num_active; i++)
+	left += m->active[i]->left;
+    return left;
+}
+
+static char *merge_value(merge_t *m) {
+    while (m->cur < m->num_active) {
+	char *value = source_value(m->active[m->cur]);
+	if (value)
+	    return value;
+	m->cur++;
+    }
+    return NULL;
+}
+
+static void runs_open(partition_t *p, int n, source_t *sources) {
+    int i;
+    for (i = 0; i < n; i++)
+	source_open(&sources[i], p->runs[i]);
+}
+
+static void runs_remove(partition_t *p, int n, source_t *sources) {
+    int i;
+    for (i = 0; i < n; i++) {
+	source_close(&sources[i]);
+	unlink(p->runs[i]);
+	free(p->runs[i]);
+    }
+    p->num_runs -= n;
+    memmove(p->runs, p->runs + n, p->num_runs * sizeof(char *));
+}
+
+// merges the first MERGE_WAYS runs of p into one, put at the end
+static void merge_pass(partition_t *p) {
+    source_t sources[MERGE_WAYS];
+    merge_t m;
+    runs_open(p, MERGE_WAYS, sources);
+    merge_start(&m, sources, MERGE_WAYS);
+    char *name, *key, *value;
+    FILE *f = spill_create(&name);
+    while ((key = merge_key(&m)) != NULL) {
+	spill_group(f, key, merge_left(&m));
+	while ((value = merge_value(&m)) != NULL)
+	    spill_value(f, value);
+    }
+    spill_close(f, name);
+    merge_end(&m);
+    runs_remove(p, MERGE_WAYS, sources);
+    partition_add_run(p, name);
+}
+
+static char *merge_get_next(char *key, int partition_number) {
+    return merge_value(partitions[partition_number].merge);
+}
+
+// reduces p's runs together with its (sorted) records
+static void reduce_spilled(partition_t *p, int partition_number) {
+    while (p->num_runs > MERGE_WAYS)
+	merge_pass(p);
+    int n = p->num_runs;
+    source_t *sources = xmalloc((n + 1) * sizeof(source_t));
+    runs_open(p, n, sources);
+    source_memory(&sources[n], p->records, p->count);
+    merge_t m;
+    merge_start(&m, sources, n + 1);
+    p->merge = &m;
+    char *key;
+    while ((key = merge_key(&m)) != NULL)
+	reducer(key, merge_get_next, partition_number);
+    merge_end(&m);
+    runs_remove(p, n, sources);
+    free(sources);
+}
+
+//
+// Sorting and reducing
+//
+
+static char *get_next(char *key, int partition_number) {
+    partition_t *p = &partitions[partition_number];
+    if (p->next == p->end)
+	return NULL;
+    return p->records[p->next++].value;
+}
+
+static void *reduce_thread(void *arg) {
+    partition_t *p = &partitions[(long) arg];
+    int partition_number = (long) arg;
+
+    qsort(p->records, p->count, sizeof(record_t), record_compare);
+    if (p->num_runs > 0) {
+	reduce_spilled(p, partition_number);
+	return NULL;
+    }
+
+    size_t start = 0;
+    while (start < p->count) {
+	char *key = p->records[start].key;
+	size_t end = start + 1;
+	while (end < p->count && strcmp(p->records[end].key, key) == 0)
+	    end++;
+	p->next = start;
+	p->end = end;
+	reducer(key, get_next, partition_number);
+	// (whether or not Reduce() went through all the values)
+	start = end;
+    }
+    return NULL;
+}
+
+void MR_Run(int argc, char *argv[],
+	    Mapper map, int num_mappers,
+	    Reducer reduce, int num_reducers,
+	    Partitioner partition) {
+    MR_Config config = { 0 };
+    config.map = map;
+    config.num_mappers = num_mappers;
+    config.reduce = reduce;
+    config.num_reducers = num_reducers;
+    config.partition = partition;
+    MR_RunConfig(argc, argv, &config);
+}
+
+void MR_RunConfig(int argc, char *argv[], MR_Config *config) {
+    int num_mappers = config->num_mappers, num_reducers = config->num_reducers;
+    assert(num_mappers > 0 && num_reducers > 0);
+    mapper = config->map;
+    chunk_mapper = config->map_chunk;
+    assert(mapper != NULL || chunk_mapper != NULL);
+    combiner = config->combine;
+    buffer_size = combiner ? COMBINE_BUFFER : EMIT_BUFFER;
+    staged = combiner || config->memory_budget > 0;
+    reducer = config->reduce;
+    partitioner = config->partition ? config->partition : MR_DefaultHashPartition;
+    work_plan(argv + 1, argc - 1, config->chunk_size);
+
+    num_partitions = num_reducers;
+    // the mappers' staging buffers come out of the budget first (but
+    // what is left is never less than a byte per partition, which would
+    // read as no budget at all)
+    partition_budget = 0;
+    if (config->memory_budget > 0) {
+	size_t staging = (size_t) num_mappers * num_partitions * buffer_size * sizeof(record_t);
+	size_t budget = config->memory_budget;
+	budget = budget > staging ? budget - staging : 0;
+	partition_budget = budget / num_partitions;
+	if (partition_budget == 0)
+	    partition_budget = 1;
+    }
+    spill_dir = config->spill_dir;
+    if (spill_dir == NULL)
+	spill_dir = getenv("TMPDIR");
+    if (spill_dir == NULL)
+	spill_dir = "/tmp";
+    spill_runs = spill_bytes = 0;
+    partitions = xmalloc(num_partitions * sizeof(partition_t));
+    memset(partitions, 0, num_partitions * sizeof(partition_t));
+    int i;
+    for (i = 0; i < num_partitions; i++)
+	pthread_mutex_init(&partitions[i].lock, NULL);
+
+    pthread_t *threads = xmalloc((num_mappers > num_reducers ? num_mappers : num_reducers) * sizeof(pthread_t));
+    unsigned long long start = now_ns();
+    for (i = 0; i < num_mappers; i++)
+	thread_create(&threads[i], map_thread, NULL);
+    for (i = 0; i < num_mappers; i++)
+	thread_join(threads[i]);
+    // in case Map() handed MR_Emit() to some other thread (such as this one)
+    emitter_t *e;
+    for (e = emitters; e; e = e->all_next)
+	emitter_merge_all(e);
+    if (getenv("MR_STATS"))
+	print_stats(now_ns() - start);
+
+    for (i = 0; i < num_reducers; i++)
+	thread_create(&threads[i], reduce_thread, (void *) (long) i);
+    for (i = 0; i < num_reducers; i++)
+	thread_join(threads[i]);
+
+    for (i = 0; i < num_partitions; i++) {
+	pthread_mutex_destroy(&partitions[i].lock);
+	free(partitions[i].records);
+	arena_free(&partitions[i].arena);
+	free(partitions[i].runs);
+    }
+    free(partitions);
+    free(threads);
+    free(work);
+    while (emitters) {
+	e = emitters;
+	emitters = e->all_next;
+	arena_free(&e->arena);
+	arena_free(&e->staging);
+	free(e->buffers);
+	free(e->buffered);
+	free(e);
+    }
+    me = NULL;
+}
@@ -7,6 +7,44 @@ typedef void (*Mapper)(char *file_name);
 typedef void (*Reducer)(char *key, Getter get_func, int partition_number);
 typedef unsigned long (*Partitioner)(char *key, int num_partitions);
 
+// Optional: maps part of a file, the length bytes from offset on. Parts
+// start at the beginning of a line and end just after a newline (or at
+// the end of the file), so no line is ever split between two of them.
+typedef void (*ChunkMapper)(char *file_name, long offset, long length);
+
+// Optional: folds several values a mapper emitted for the same key into
+// one, before they are handed on to the reducers (e.g., "1", "1", "1"
+// into "3"). It is called like a Reducer, but returns the combined
+// value, which is copied before the next call. It runs on the mapper
+// threads, several at once, so a buffer it returns the value in must be
+// one per thread (e.g., __thread) or per call, not shared. It must give
+// the same result however the values are grouped, since a key can be
+// combined any number of times, or not at all.
+typedef char *(*Combiner)(char *key, Getter get_func, int partition_number);
+
+// Everything about a run; fields not needed can be left zero. Given
+// map_chunk (instead of map), files larger than chunk_size bytes are
+// split into parts of about that size, mapped independently; other
+// files are mapped in one piece. Given a memory_budget (in bytes), the
+// pairs emitted are kept to roughly that much memory, by writing
+// sorted runs of them to files in spill_dir (by default $TMPDIR, or
+// /tmp), which are merged back in as they are reduced. What each mapper
+// sets aside to stage pairs in (a buffer of records per reducer) comes
+// out of the budget too; the strings of the pairs sitting in those
+// buffers, and the buffers used to merge runs back in, are not counted.
+typedef struct {
+    Mapper map;
+    int num_mappers;
+    ChunkMapper map_chunk;
+    long chunk_size;
+    Combiner combine;
+    Reducer reduce;
+    int num_reducers;
+    Partitioner partition;
+    long memory_budget;
+    char *spill_dir;
+} MR_Config;
+
 // External functions: these are what you must define
 void MR_Emit(char *key, char *value);
 
@@ -17,4 +55,6 @@ void MR_Run(int argc, char *argv[],
 	    Reducer reduce, int num_reducers, 
 	    Partitioner partition);
 
+void MR_RunConfig(int argc, char *argv[], MR_Config *config);
+
 #endif // __mapreduce_h__
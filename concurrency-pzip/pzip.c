@@ -0,0 +1,258 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+
+//
+// How it works:
+//
+// - Every input file is mmap()ed, and together they are treated as one
+//   stream (as with wzip, a run can go on from one file into the next).
+//   The files are cut into chunks of CHUNK_SIZE bytes, which a pool of
+//   threads (one per processor, or PZIP_THREADS) compress, each taking
+//   the next chunk off a shared counter, so a slow thread simply ends
+//   up doing fewer of them.
+//
+// - A chunk is encoded on its own, as if nothing came before or after
+//   it. The main thread writes the chunks out in order, stitching them
+//   together: the last run of each chunk is held back, and if the next
+//   chunk begins with the same character, the two runs are merged. So
+//   the output is exactly what compressing the whole stream in one go
+//   (as wzip does) gives.
+//
+// - Finished chunks wait in a reorder window of WINDOW_PER_THREAD slots
+//   per thread until their turn to be written. A thread does not start
+//   a chunk that would not fit in the window, which bounds the memory
+//   used however far ahead of the writer the threads get.
+//
+
+#define CHUNK_SIZE (1 << 20)
+#define WINDOW_PER_THREAD (4)
+#define RUN_SIZE (5)            // 4-byte count, then the character
+
+typedef struct {
+    char *data;
+    size_t len;
+} chunk_t;
+
+typedef struct {
+    char *out;                  // room for the worst case, RUN_SIZE per byte...
+    size_t len;                 // ...and how much of it was used
+    int ready;
+} slot_t;
+
+static chunk_t *chunks;
+static size_t num_chunks;
+static size_t next_chunk = 0;   // the next one to compress...
+static size_t next_write = 0;   // ...and to write
+
+static slot_t *window;
+static int window_size;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t written = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compressed = PTHREAD_COND_INITIALIZER;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+	fprintf(stderr, "pzip: out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+//
+// Compressing a chunk
+//
+
+static char *put_run(char *out, uint32_t count, char c) {
+    memcpy(out, &count, sizeof(count));
+    out[sizeof(count)] = c;
+    return out + RUN_SIZE;
+}
+
+// where the run of c starting at p (< end) ends
+static char *run_end(char *p, char *end, char c) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // a word at a time: the first byte that differs is the lowest set one
+    uint64_t pattern = 0x0101010101010101ULL * (unsigned char) c;
+    while (end - p >= 8) {
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	uint64_t diff = w ^ pattern;
+	if (diff)
+	    return p + __builtin_ctzll(diff) / 8;
+	p += 8;
+    }
+#endif
+    while (p < end && *p == c)
+	p++;
+    return p;
+}
+
+static size_t compress(char *in, size_t len, char *out) {
+    char *p = in, *end = in + len, *o = out;
+    while (p < end) {
+	char c = *p;
+	char *stop = run_end(p + 1, end, c);
+	// (a chunk is far smaller than 4G, so a count always fits)
+	o = put_run(o, stop - p, c);
+	p = stop;
+    }
+    return o - out;
+}
+
+static void *zip_thread(void *arg) {
+    while (1) {
+	pthread_mutex_lock(&lock);
+	size_t k = next_chunk;
+	if (k == num_chunks) {
+	    pthread_mutex_unlock(&lock);
+	    return NULL;
+	}
+	next_chunk++;
+	while (k >= next_write + window_size)
+	    pthread_cond_wait(&written, &lock);
+	pthread_mutex_unlock(&lock);
+
+	slot_t *s = &window[k % window_size];
+	s->len = compress(chunks[k].data, chunks[k].len, s->out);
+
+	pthread_mutex_lock(&lock);
+	s->ready = 1;
+	pthread_cond_signal(&compressed);
+	pthread_mutex_unlock(&lock);
+    }
+}
+
+//
+// Writing, in order
+//
+
+static uint32_t held_count = 0; // the last run so far, not yet written
+static char held_char;
+
+static void write_run(uint32_t count, char c) {
+    char run[RUN_SIZE];
+    put_run(run, count, c);
+    fwrite(run, RUN_SIZE, 1, stdout);
+}
+
+static uint32_t run_count(char *run) {
+    uint32_t count;
+    memcpy(&count, run, sizeof(count));
+    return count;
+}
+
+static void write_chunk(char *out, size_t len) {
+    if (len == 0)
+	return;
+    char *first = out, *last = out + len - RUN_SIZE;
+    if (held_count > 0 && first[sizeof(uint32_t)] == held_char) {
+	held_count += run_count(first);
+	if (first == last)
+	    return;
+	first += RUN_SIZE;
+    }
+    if (held_count > 0)
+	write_run(held_count, held_char);
+    fwrite(first, 1, last - first, stdout);
+    held_count = run_count(last);
+    held_char = last[sizeof(uint32_t)];
+}
+
+static void write_all() {
+    while (next_write < num_chunks) {
+	slot_t *s = &window[next_write % window_size];
+	pthread_mutex_lock(&lock);
+	while (!s->ready)
+	    pthread_cond_wait(&compressed, &lock);
+	pthread_mutex_unlock(&lock);
+
+	write_chunk(s->out, s->len);
+
+	pthread_mutex_lock(&lock);
+	s->ready = 0;
+	next_write++;
+	pthread_cond_broadcast(&written);
+	pthread_mutex_unlock(&lock);
+    }
+    if (held_count > 0)
+	write_run(held_count, held_char);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+	printf("pzip: file1 [file2 ...]\n");
+	exit(1);
+    }
+
+    size_t room = argc;
+    chunks = xmalloc(room * sizeof(chunk_t));
+    num_chunks = 0;
+    int i;
+    for (i = 1; i < argc; i++) {
+	int fd = open(argv[i], O_RDONLY);
+	struct stat sbuf;
+	if (fd < 0 || fstat(fd, &sbuf) < 0) {
+	    printf("pzip: cannot open file\n");
+	    exit(1);
+	}
+	size_t size = sbuf.st_size, offset;
+	if (size == 0) {
+	    close(fd);
+	    continue;
+	}
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+	    printf("pzip: cannot open file\n");
+	    exit(1);
+	}
+	madvise(data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+	close(fd);
+	for (offset = 0; offset < size; offset += CHUNK_SIZE) {
+	    if (num_chunks == room) {
+		room *= 2;
+		chunks = realloc(chunks, room * sizeof(chunk_t));
+		if (chunks == NULL) {
+		    fprintf(stderr, "pzip: out of memory\n");
+		    exit(1);
+		}
+	    }
+	    chunks[num_chunks].data = data + offset;
+	    chunks[num_chunks].len = size - offset < CHUNK_SIZE ? size - offset : CHUNK_SIZE;
+	    num_chunks++;
+	}
+    }
+
+    char *env = getenv("PZIP_THREADS");
+    int num_threads = env ? atoi(env) : get_nprocs();
+    if (num_threads < 1)
+	num_threads = 1;
+    window_size = num_threads * WINDOW_PER_THREAD;
+    window = xmalloc(window_size * sizeof(slot_t));
+    for (i = 0; i < window_size; i++) {
+	window[i].out = xmalloc((size_t) RUN_SIZE * CHUNK_SIZE);
+	window[i].ready = 0;
+    }
+    static char buffer[1 << 20];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    pthread_t *threads = xmalloc(num_threads * sizeof(pthread_t));
+    for (i = 0; i < num_threads; i++)
+	if (pthread_create(&threads[i], NULL, zip_thread, NULL) != 0) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    write_all();
+    for (i = 0; i < num_threads; i++)
+	pthread_join(threads[i], NULL);
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,307 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+
+//
+// How it works:
+//
+// - The input is mmap()ed, and never copied as a whole. What is sorted
+//   is an array of (key, record index) pairs, 8 bytes per 100-byte
+//   record. Keys are the first four bytes of a record, as a (signed,
+//   native-endian) int; flipping the sign bit makes comparing them as
+//   unsigned give the same order, so the radix sort needs no special
+//   case for negative keys.
+//
+// - With T threads (one per processor, or PSORT_THREADS), the input is
+//   cut into T slices. Each thread builds the pairs for its slice and
+//   sorts them with an LSD radix sort, one byte of key per pass
+//   (skipping passes where every key has the same byte), which is
+//   linear and stable.
+//
+// - The sorted slices are then merged, also in parallel: a sample of
+//   keys from every slice gives T - 1 splitters, and each slice is cut
+//   at them by binary search, so thread j merges the j-th piece of
+//   every slice, all of which belong before the pieces of thread j + 1.
+//   As the sizes of the pieces before j are known, so is where in the
+//   output thread j's records go.
+//
+// - Each merging thread gathers its records, in order, from the mapped
+//   input into a large buffer, and pwrite()s the buffer to its place in
+//   the output whenever it fills, so writes are big and sequential.
+//   Once every thread is done, the output is fsync()ed, once.
+//
+
+#define RECORD_SIZE (100)
+#define KEY_SIZE (4)
+#define SAMPLES_PER_SLICE (64)
+#define WRITE_BUFFER (8 << 20)
+
+typedef struct {
+    uint32_t key;               // with the sign bit flipped
+    uint32_t index;             // of the record in the input
+} pair_t;
+
+typedef struct {
+    pair_t *next, *end;
+} run_t;
+
+static char *input;
+static size_t num_records;
+static int output_fd;
+static char *output_name;
+
+static int num_threads;
+static pair_t *pairs, *scratch; // slice t is [start[t], start[t + 1]) of both...
+static pair_t **sorted;         // ...and ends up sorted in one of them
+static size_t *start;
+static uint32_t *splitters;     // num_threads - 1 of them
+static size_t *cuts;            // where slice t's piece j begins: cuts[t * (num_threads + 1) + j]
+
+static pthread_barrier_t barrier;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+	fprintf(stderr, "psort: out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+static void die(char *what) {
+    perror(what);
+    exit(1);
+}
+
+static int key_compare(const void *a, const void *b) {
+    uint32_t x = *(uint32_t *) a, y = *(uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+//
+// Sorting a slice
+//
+
+// sorts n pairs, using tmp as well; returns which of the two they end up in
+static pair_t *radix_sort(pair_t *a, pair_t *tmp, size_t n) {
+    size_t counts[KEY_SIZE][256];
+    memset(counts, 0, sizeof(counts));
+    size_t i;
+    int pass, b;
+    for (i = 0; i < n; i++)
+	for (pass = 0; pass < KEY_SIZE; pass++)
+	    counts[pass][(a[i].key >> (8 * pass)) & 0xff]++;
+
+    for (pass = 0; pass < KEY_SIZE; pass++) {
+	size_t *c = counts[pass];
+	if (n == 0 || c[(a[0].key >> (8 * pass)) & 0xff] == n)
+	    continue;           // all the same: nothing would move
+	size_t sum = 0;
+	for (b = 0; b < 256; b++) {
+	    size_t here = c[b];
+	    c[b] = sum;
+	    sum += here;
+	}
+	for (i = 0; i < n; i++)
+	    tmp[c[(a[i].key >> (8 * pass)) & 0xff]++] = a[i];
+	pair_t *swap = a;
+	a = tmp;
+	tmp = swap;
+    }
+    return a;
+}
+
+static void sort_slice(int t) {
+    pair_t *a = pairs + start[t];
+    size_t n = start[t + 1] - start[t], i;
+    for (i = 0; i < n; i++) {
+	size_t index = start[t] + i;
+	int32_t key;
+	memcpy(&key, input + index * RECORD_SIZE, KEY_SIZE);
+	a[i].key = (uint32_t) key ^ 0x80000000u;
+	a[i].index = index;
+    }
+    sorted[t] = radix_sort(a, scratch + start[t], n);
+}
+
+//
+// Splitting the slices into pieces to merge
+//
+
+static void pick_splitters() {
+    int samples = num_threads * SAMPLES_PER_SLICE, t, i;
+    uint32_t *sample = xmalloc(samples * sizeof(uint32_t));
+    int taken = 0;
+    for (t = 0; t < num_threads; t++) {
+	size_t n = start[t + 1] - start[t];
+	if (n == 0)
+	    continue;
+	for (i = 0; i < SAMPLES_PER_SLICE; i++)
+	    sample[taken++] = sorted[t][(n - 1) * i / (SAMPLES_PER_SLICE - 1)].key;
+    }
+    qsort(sample, taken, sizeof(uint32_t), key_compare);
+    for (i = 1; i < num_threads; i++)
+	splitters[i - 1] = taken ? sample[(size_t) taken * i / num_threads] : 0;
+    free(sample);
+}
+
+// the first of the n pairs in a with a key of at least key
+static size_t lower_bound(pair_t *a, size_t n, uint32_t key) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (a[mid].key < key)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+static void cut_slice(int t) {
+    size_t n = start[t + 1] - start[t];
+    size_t *c = cuts + t * (num_threads + 1);
+    int j;
+    c[0] = 0;
+    for (j = 1; j < num_threads; j++)
+	c[j] = lower_bound(sorted[t], n, splitters[j - 1]);
+    c[num_threads] = n;
+}
+
+//
+// Merging and writing
+//
+
+static void flush(char *buffer, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+	ssize_t rc = pwrite(output_fd, buffer + done, len - done, offset + done);
+	if (rc < 0)
+	    die(output_name);
+	done += rc;
+    }
+}
+
+static void merge_piece(int j) {
+    run_t *runs = xmalloc(num_threads * sizeof(run_t));
+    int num_runs = 0, t;
+    size_t before = 0;
+    for (t = 0; t < num_threads; t++) {
+	size_t *c = cuts + t * (num_threads + 1);
+	before += c[j];
+	if (c[j] < c[j + 1]) {
+	    runs[num_runs].next = sorted[t] + c[j];
+	    runs[num_runs].end = sorted[t] + c[j + 1];
+	    num_runs++;
+	}
+    }
+
+    char *buffer = xmalloc(WRITE_BUFFER);
+    size_t in_buffer = 0, written = 0;
+    while (num_runs > 0) {
+	// few runs (one per thread), so a linear scan beats a heap
+	int min = 0, r;
+	for (r = 1; r < num_runs; r++)
+	    if (runs[r].next->key < runs[min].next->key)
+		min = r;
+	memcpy(buffer + in_buffer, input + (size_t) runs[min].next->index * RECORD_SIZE, RECORD_SIZE);
+	in_buffer += RECORD_SIZE;
+	if (++runs[min].next == runs[min].end)
+	    runs[min] = runs[--num_runs];
+	if (in_buffer + RECORD_SIZE > WRITE_BUFFER) {
+	    flush(buffer, in_buffer, (before + written) * RECORD_SIZE);
+	    written += in_buffer / RECORD_SIZE;
+	    in_buffer = 0;
+	}
+    }
+    flush(buffer, in_buffer, (before + written) * RECORD_SIZE);
+    free(buffer);
+    free(runs);
+}
+
+static void *sort_thread(void *arg) {
+    int t = (long) arg;
+    sort_slice(t);
+    pthread_barrier_wait(&barrier);
+    if (t == 0)
+	pick_splitters();
+    pthread_barrier_wait(&barrier);
+    cut_slice(t);
+    pthread_barrier_wait(&barrier);
+    merge_piece(t);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+	fprintf(stderr, "usage: psort input output\n");
+	exit(1);
+    }
+    output_name = argv[2];
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+	die(argv[1]);
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) < 0)
+	die(argv[1]);
+    if (sbuf.st_size % RECORD_SIZE != 0) {
+	fprintf(stderr, "psort: %s: not a whole number of %d-byte records\n", argv[1], RECORD_SIZE);
+	exit(1);
+    }
+    num_records = sbuf.st_size / RECORD_SIZE;
+    if (num_records > UINT32_MAX) {
+	fprintf(stderr, "psort: %s: too many records\n", argv[1]);
+	exit(1);
+    }
+    if (num_records > 0) {
+	input = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (input == MAP_FAILED)
+	    die(argv[1]);
+	madvise(input, sbuf.st_size, MADV_WILLNEED);
+    }
+
+    output_fd = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0)
+	die(output_name);
+    // so that threads can write their pieces at their places, in any order
+    if (ftruncate(output_fd, sbuf.st_size) < 0)
+	die(output_name);
+
+    char *env = getenv("PSORT_THREADS");
+    num_threads = env ? atoi(env) : get_nprocs();
+    if (num_threads < 1)
+	num_threads = 1;
+    // a slice should be worth a thread
+    if ((size_t) num_threads > num_records / 1024 + 1)
+	num_threads = num_records / 1024 + 1;
+
+    pairs = xmalloc(num_records * sizeof(pair_t));
+    scratch = xmalloc(num_records * sizeof(pair_t));
+    sorted = xmalloc(num_threads * sizeof(pair_t *));
+    start = xmalloc((num_threads + 1) * sizeof(size_t));
+    splitters = xmalloc(num_threads * sizeof(uint32_t));
+    cuts = xmalloc(num_threads * (num_threads + 1) * sizeof(size_t));
+    int t;
+    for (t = 0; t <= num_threads; t++)
+	start[t] = num_records * t / num_threads;
+
+    pthread_barrier_init(&barrier, NULL, num_threads);
+    pthread_t *threads = xmalloc(num_threads * sizeof(pthread_t));
+    for (t = 0; t < num_threads; t++)
+	if (pthread_create(&threads[t], NULL, sort_thread, (void *) (long) t) != 0)
+	    die("pthread_create");
+    for (t = 0; t < num_threads; t++)
+	pthread_join(threads[t], NULL);
+
+    if (fsync(output_fd) < 0 || close(output_fd) < 0)
+	die(output_name);
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include "io_helper.h"
+#include "cache.h"
+
+#define CACHE_BUCKETS (256)     // per shard
+
+typedef struct {
+    pthread_rwlock_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *hand;        // CLOCK hand into the ring of entries
+    long used;                  // bytes of responses held
+    long entries;
+} shard_t;
+
+static shard_t shards[CACHE_SHARDS];
+static long shard_capacity = 0;
+static long max_file_size = 0;
+
+// updated without locks; only ever read for reporting
+static unsigned long hits, misses, evictions;
+
+#define counter_inc(c) __atomic_fetch_add(&(c), 1, __ATOMIC_RELAXED)
+#define counter_read(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+void cache_init(long capacity, long max_file) {
+    shard_capacity = capacity / CACHE_SHARDS;
+    max_file_size = max_file;
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++)
+	assert(pthread_rwlock_init(&shards[i].lock, NULL) == 0);
+}
+
+int cache_wants(off_t size) {
+    return shard_capacity > 0 && size <= max_file_size && size < shard_capacity;
+}
+
+static unsigned long cache_hash(char *path) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *path++) != '\0')
+	hash = hash * 33 + c;
+    return hash;
+}
+
+static shard_t *cache_shard(unsigned long hash) {
+    return &shards[hash % CACHE_SHARDS];
+}
+
+static cache_entry_t **cache_bucket(shard_t *shard, unsigned long hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+static int cache_matches(cache_entry_t *e, struct stat *sbuf) {
+    return e->ino == sbuf->st_ino && e->size == sbuf->st_size &&
+	e->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+	e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec;
+}
+
+void cache_put(cache_entry_t *e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+	free(e->data);
+	free(e->path);
+	free(e);
+    }
+}
+
+cache_entry_t *cache_get(char *path, struct stat *sbuf) {
+    if (shard_capacity == 0)
+	return NULL;
+    unsigned long hash = cache_hash(path);
+    shard_t *shard = cache_shard(hash);
+    cache_entry_t *e;
+
+    assert(pthread_rwlock_rdlock(&shard->lock) == 0);
+    for (e = *cache_bucket(shard, hash); e != NULL; e = e->hash_next)
+	if (strcmp(e->path, path) == 0)
+	    break;
+    if (e && cache_matches(e, sbuf)) {
+	__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+    } else {
+	e = NULL;
+    }
+    assert(pthread_rwlock_unlock(&shard->lock) == 0);
+
+    if (e)
+	counter_inc(hits);
+    else
+	counter_inc(misses);
+    return e;
+}
+
+// the functions below are called with the shard's write lock held
+
+static void cache_unlink(shard_t *shard, unsigned long hash, cache_entry_t *e) {
+    cache_entry_t **pp = cache_bucket(shard, hash);
+    while (*pp != e)
+	pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+
+    if (e->clock_next == e) {
+	shard->hand = NULL;
+    } else {
+	e->clock_prev->clock_next = e->clock_next;
+	e->clock_next->clock_prev = e->clock_prev;
+	if (shard->hand == e)
+	    shard->hand = e->clock_next;
+    }
+    shard->used -= e->len;
+    shard->entries--;
+}
+
+// sweeps the hand around until it finds an entry not used since last time
+static void cache_evict_one(shard_t *shard) {
+    cache_entry_t *e = shard->hand;
+    while (__atomic_exchange_n(&e->referenced, 0, __ATOMIC_RELAXED))
+	e = e->clock_next;
+    cache_unlink(shard, cache_hash(e->path), e);
+    counter_inc(evictions);
+    cache_put(e);
+}
+
+cache_entry_t *cache_insert(char *path, struct stat *sbuf, char *data, int hdr_len, int len) {
+    unsigned long hash = cache_hash(path);
+    shard_t *shard = cache_shard(hash);
+    cache_entry_t *e = malloc_or_die(sizeof(cache_entry_t));
+    e->path = strdup(path);
+    assert(e->path != NULL);
+    e->ino = sbuf->st_ino;
+    e->size = sbuf->st_size;
+    e->mtime = sbuf->st_mtim;
+    e->data = data;
+    e->len = len;
+    e->hdr_len = hdr_len;
+    e->refs = 2; // one for the cache, one for the caller
+    e->referenced = 0;
+
+    assert(pthread_rwlock_wrlock(&shard->lock) == 0);
+    // out with any older version (or a racing insert of the same one)
+    cache_entry_t *old;
+    for (old = *cache_bucket(shard, hash); old != NULL; old = old->hash_next)
+	if (strcmp(old->path, path) == 0)
+	    break;
+    if (old) {
+	cache_unlink(shard, hash, old);
+	cache_put(old);
+    }
+    while (shard->hand && shard->used + len > shard_capacity)
+	cache_evict_one(shard);
+
+    cache_entry_t **bucket = cache_bucket(shard, hash);
+    e->hash_next = *bucket;
+    *bucket = e;
+    // new entries go in just behind the hand, i.e. last in line
+    if (shard->hand == NULL) {
+	e->clock_prev = e->clock_next = e;
+	shard->hand = e;
+    } else {
+	e->clock_next = shard->hand;
+	e->clock_prev = shard->hand->clock_prev;
+	e->clock_prev->clock_next = e;
+	shard->hand->clock_prev = e;
+    }
+    shard->used += len;
+    shard->entries++;
+    assert(pthread_rwlock_unlock(&shard->lock) == 0);
+    return e;
+}
+
+void cache_get_stats(cache_stats_t *stats) {
+    stats->hits = counter_read(hits);
+    stats->misses = counter_read(misses);
+    stats->evictions = counter_read(evictions);
+    stats->entries = 0;
+    stats->bytes = 0;
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+	assert(pthread_rwlock_rdlock(&shards[i].lock) == 0);
+	stats->entries += shards[i].entries;
+	stats->bytes += shards[i].used;
+	assert(pthread_rwlock_unlock(&shards[i].lock) == 0);
+    }
+}
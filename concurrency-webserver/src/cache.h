@@ -0,0 +1,68 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <sys/stat.h>
+
+//
+// The content cache: fully rendered responses (header and body) for
+// small static files, so that a hit is served with a single write and
+// no trip to the file system at all.
+//
+// The cache is split into CACHE_SHARDS shards by a hash of the path,
+// each with its own reader/writer lock and its own share of the space
+// budget. Lookups only take a shard's lock for reading, so workers hit
+// the cache concurrently; the lock is held just long enough to find the
+// entry and take a reference on it, and the response is written out
+// after it is dropped. Eviction within a shard is CLOCK (second
+// chance): hits set a referenced bit, and the hand sweeps past entries
+// that have it set, clearing it, until it finds one to throw out.
+//
+// An entry is only good for the exact file it was made from: lookups
+// pass in the caller's current stat information (from the fd cache, so
+// it is at most FDCACHE_REVALIDATE seconds old), and an entry whose
+// inode, size or mtime differ is a miss.
+//
+
+#define CACHE_SHARDS (16)
+
+typedef struct __cache_entry_t {
+    char *path;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *data;                 // the whole response...
+    int len;                    // ...its length...
+    int hdr_len;                // ...and where the header ends
+    int refs;                   // the cache holds one too, while cached
+    int referenced;             // for CLOCK
+    struct __cache_entry_t *hash_next;
+    struct __cache_entry_t *clock_prev, *clock_next;
+} cache_entry_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    unsigned long bytes;
+} cache_stats_t;
+
+// capacity: total bytes of responses to hold (0: no caching); files
+// larger than max_file bytes are never cached
+void cache_init(long capacity, long max_file);
+
+// whether a file of this size should go in the cache
+int cache_wants(off_t size);
+
+// NULL on a miss; otherwise a referenced entry, to be cache_put()
+cache_entry_t *cache_get(char *path, struct stat *sbuf);
+
+// adds a response (the cache takes over data, which must come from
+// malloc()) and returns a referenced entry for it
+cache_entry_t *cache_insert(char *path, struct stat *sbuf, char *data, int hdr_len, int len);
+
+void cache_put(cache_entry_t *entry);
+
+void cache_get_stats(cache_stats_t *stats);
+
+#endif // __CACHE_H__
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE // for memmem()
+#include "io_helper.h"
+#include "request.h"
+#include "cgi.h"
+
+//
+// Each program has a stack of idle workers. A request pops one (or
+// starts a new one, if fewer than 'workers' are running), talks to it
+// without any lock held, and pushes it back when done. When all of them
+// are busy, requests wait on the program's condition variable.
+//
+
+typedef struct __cgi_worker_t {
+    pid_t pid;
+    int fd;                     // our end of the socket
+    rio_t rio;                  // responses are read through this
+    struct __cgi_worker_t *next;
+} cgi_worker_t;
+
+typedef struct __cgi_program_t {
+    char *path;
+    int running;                // workers started and not yet reaped
+    cgi_worker_t *idle;
+    pthread_mutex_t lock;
+    pthread_cond_t idle_cv;
+    struct __cgi_program_t *next;
+} cgi_program_t;
+
+static int workers = 0;
+static cgi_program_t *programs = NULL;
+static pthread_mutex_t programs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cgi_init(int num_workers) {
+    workers = num_workers;
+}
+
+int cgi_enabled() {
+    return workers > 0;
+}
+
+static cgi_program_t *cgi_program(char *path) {
+    pthread_mutex_lock_or_die(&programs_lock);
+    cgi_program_t *prog;
+    for (prog = programs; prog; prog = prog->next)
+	if (strcmp(prog->path, path) == 0)
+	    break;
+    if (prog == NULL) {
+	prog = malloc_or_die(sizeof(cgi_program_t));
+	prog->path = strdup(path);
+	prog->running = 0;
+	prog->idle = NULL;
+	pthread_mutex_init(&prog->lock, NULL);
+	pthread_cond_init(&prog->idle_cv, NULL);
+	prog->next = programs;
+	programs = prog;
+    }
+    pthread_mutex_unlock_or_die(&programs_lock);
+    return prog;
+}
+
+static cgi_worker_t *cgi_spawn(cgi_program_t *prog) {
+    int sv[2];
+    // our end must not leak into other children
+    socketpair_or_die(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+
+    pid_t pid = fork_or_die();
+    if (pid == 0) {                                  // child
+	char *argv[] = { NULL };
+	dup2_or_die(sv[1], STDIN_FILENO);            // requests come in here
+	// a long-lived worker must not hold other connections open
+	int fd;
+	for (fd = STDERR_FILENO + 1; fd < getdtablesize(); fd++)
+	    close(fd);
+	setenv_or_die("CGI_PERSISTENT", "1", 1);
+	extern char **environ;                       // defined by libc
+	execve_or_die(prog->path, argv, environ);
+    }
+    close_or_die(sv[1]);
+
+    cgi_worker_t *w = malloc_or_die(sizeof(cgi_worker_t));
+    w->pid = pid;
+    w->fd = sv[0];
+    rio_init(&w->rio, sv[0]);
+    return w;
+}
+
+static void cgi_reap(cgi_worker_t *w) {
+    close_or_die(w->fd);
+    kill(w->pid, SIGKILL);
+    waitpid_or_die(w->pid, NULL, 0);
+    free(w);
+}
+
+//
+// An idle worker has nothing to say; if its socket is readable, the
+// worker has exited (or is talking out of turn) and is no good
+//
+static int cgi_idle_ok(cgi_worker_t *w) {
+    struct pollfd pfd;
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+static cgi_worker_t *cgi_worker_get(cgi_program_t *prog) {
+    pthread_mutex_lock_or_die(&prog->lock);
+    while (prog->idle == NULL && prog->running == workers)
+	pthread_cond_wait_or_die(&prog->idle_cv, &prog->lock);
+    cgi_worker_t *w = prog->idle;
+    if (w) {
+	prog->idle = w->next;
+	pthread_mutex_unlock_or_die(&prog->lock);
+	if (cgi_idle_ok(w))
+	    return w;
+	// start a replacement in its place
+	cgi_reap(w);
+    } else {
+	prog->running++;
+	pthread_mutex_unlock_or_die(&prog->lock);
+    }
+    return cgi_spawn(prog);
+}
+
+// ok says whether the worker is still good for more requests
+static void cgi_worker_put(cgi_program_t *prog, cgi_worker_t *w, int ok) {
+    if (!ok)
+	cgi_reap(w);
+    pthread_mutex_lock_or_die(&prog->lock);
+    if (ok) {
+	w->next = prog->idle;
+	prog->idle = w;
+    } else {
+	prog->running--;
+    }
+    pthread_cond_signal_or_die(&prog->idle_cv);
+    pthread_mutex_unlock_or_die(&prog->lock);
+}
+
+//
+// Sends one request frame to the worker and reads back the response
+// frame into *out (which comes from malloc()). Returns its length, or
+// -1 if the worker is broken.
+//
+static int cgi_call(cgi_worker_t *w, char *args, char **out) {
+    uint32_t n = strlen(args);
+    struct iovec iov[2] = { { &n, sizeof(n) }, { args, n } };
+    if (writev_all(w->fd, iov, 2) < 0)
+	return -1;
+    if (rio_readn(&w->rio, &n, sizeof(n)) != sizeof(n) || n > CGI_MAXOUTPUT)
+	return -1;
+    *out = malloc_or_die(n + 1);
+    if (rio_readn(&w->rio, *out, n) != n) {
+	free(*out);
+	return -1;
+    }
+    return n;
+}
+
+//
+// Sends back the output of a worker, with the status line and whatever
+// else we have to add in front of its headers
+//
+static void cgi_respond(request_t *req, char *out, int len) {
+    char buf[MAXBUF];
+
+    char *end = memmem(out, len, "\r\n\r\n", 4);
+    if (end == NULL) {
+	request_error(req, req->filename, "502", "Bad Gateway", "CGI program sent a malformed response");
+	return;
+    }
+    int has_length = 0;
+    char *p = out;
+    while (p < end) {
+	if (strncasecmp(p, "Content-Length:", 15) == 0)
+	    has_length = 1;
+	p = memchr(p, '\n', end - p);
+	if (p == NULL)
+	    break;
+	p++;
+    }
+
+    sprintf(buf, ""
+	    "HTTP/1.1 200 OK\r\n"
+	    "Server: OSTEP WebServer\r\n"
+	    "Connection: %s\r\n",
+	    req->keep_alive ? "keep-alive" : "close");
+    if (!has_length)
+	sprintf(buf + strlen(buf), "Content-Length: %ld\r\n", len - (end + 4 - out));
+
+    struct iovec iov[2] = { { buf, strlen(buf) }, { out, len } };
+    request_writev(req, iov, 2);
+}
+
+void cgi_serve(request_t *req) {
+    cgi_program_t *prog = cgi_program(req->filename);
+    cgi_worker_t *w = cgi_worker_get(prog);
+    char *out;
+    int len = cgi_call(w, req->cgiargs, &out);
+    cgi_worker_put(prog, w, len >= 0);
+
+    if (len < 0) {
+	request_error(req, req->filename, "502", "Bad Gateway", "CGI program did not answer");
+    } else {
+	cgi_respond(req, out, len);
+	free(out);
+    }
+    if (req->reply) {
+	struct iovec iov = { req->reply, req->reply_len };
+	request_writev(req, &iov, 1);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __CGI_H__
+#define __CGI_H__
+
+#include "request.h"
+
+//
+// Persistent CGI workers. Instead of a fork/exec per request, each CGI
+// program gets a pool of up to N long-lived worker processes (started
+// the first time they are needed), and requests are handed to an idle
+// one over a Unix socket. A worker that dies or breaks the protocol is
+// reaped and replaced by a fresh one on a later request.
+//
+// A worker is run with CGI_PERSISTENT=1 in its environment and its
+// socket on descriptor 0 (FastCGI's convention). It then loops over
+// frames, each a native-order uint32 length followed by that many
+// bytes:
+//
+//   server -> worker: the QUERY_STRING
+//   worker -> server: the CGI output (header lines such as
+//                     Content-Type, an empty line, then the body)
+//
+// Since the server knows where the output ends, it supplies the status
+// line and, if missing, Content-Length, and the connection can be kept
+// alive. See spin.c for a program that works both ways.
+//
+
+// largest response frame accepted from a worker
+#define CGI_MAXOUTPUT (16 * 1024 * 1024)
+
+// workers is the number of processes per program; 0 (the default)
+// means fork/exec for every request, as usual
+void cgi_init(int workers);
+int cgi_enabled();
+
+void cgi_serve(request_t *req);
+
+#endif // __CGI_H__
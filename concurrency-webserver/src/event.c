@@ -0,0 +1,406 @@
+#define _GNU_SOURCE // for accept4()
+#include "io_helper.h"
+#include "request.h"
+#include "pool.h"
+#include "event.h"
+#include <sys/eventfd.h>
+
+//
+// The event-driven engine. One thread waits on epoll for all
+// connections, which are non-blocking. Each connection moves through a
+// small state machine:
+//
+//   CONN_REQUEST_LINE -> CONN_HEADERS -> CONN_WRITING -> (closed)
+//          ^                                    |
+//          +------------ (keep-alive) ----------+
+//
+// Bytes are read as they arrive into the request's rio buffer and
+// complete lines are consumed from it in order; nothing ever blocks
+// waiting for the rest of a line. Once the empty line ending the
+// headers shows up, the request is prepared the same way the threaded
+// engine does it (request_prepare()). Static files are then sent from
+// here, out of the content cache or with sendfile(), a piece at a time
+// as the socket drains. CGI programs
+// are run with fork/exec/wait, which blocks, so those requests are
+// handed to the worker pool instead and leave the event loop for good.
+// The loop never waits for room in the pool: while it is full, such
+// connections are parked in order (with nothing read from them) and
+// handed over as workers free up, which the pool says through an
+// eventfd.
+//
+// A kept-alive connection goes back to waiting for a request line once
+// its response is out; requests the client pipelined behind it are
+// already in the read buffer and are picked up from there right away.
+// While a response is being written, nothing more is read from the
+// client. All connections are also kept on a list in order of last
+// activity, so the ones idle for longer than keep_alive_timeout can be
+// found and closed cheaply from the front.
+//
+
+#define MAXEVENTS (256)
+
+enum {
+    CONN_REQUEST_LINE,
+    CONN_HEADERS,
+    CONN_WRITING,
+};
+
+typedef struct __conn_t {
+    request_t *req;
+    int state;
+    uint32_t events;            // what we are waiting for on the socket
+    time_t last_active;
+    struct __conn_t *prev, *next; // on the idle list
+    cache_entry_t *entry;       // holds the cached response being sent
+    char hdr[MAXBUF];
+    struct iovec iov[2];        // the response from memory...
+    struct iovec *iov_next;
+    int iov_cnt;
+    off_t body_len;             // ...then req->file, with sendfile()
+    off_t body_off;
+    uint64_t t_serve;           // when the response was started
+} conn_t;
+
+static int epoll_fd;
+
+// least recently active first
+static conn_t *idle_head = NULL, *idle_tail = NULL;
+
+// waiting for room in the pool, oldest first (linked through next)
+static conn_t *parked_head = NULL, *parked_tail = NULL;
+static int room_fd;
+
+static void idle_remove(conn_t *conn) {
+    if (conn->prev)
+	conn->prev->next = conn->next;
+    else
+	idle_head = conn->next;
+    if (conn->next)
+	conn->next->prev = conn->prev;
+    else
+	idle_tail = conn->prev;
+}
+
+static void idle_append(conn_t *conn) {
+    conn->prev = idle_tail;
+    conn->next = NULL;
+    if (idle_tail)
+	idle_tail->next = conn;
+    else
+	idle_head = conn;
+    idle_tail = conn;
+}
+
+// moves conn to the back of the idle list
+static void conn_touch(conn_t *conn) {
+    conn->last_active = time(NULL);
+    if (conn != idle_tail) {
+	idle_remove(conn);
+	idle_append(conn);
+    }
+}
+
+static conn_t *conn_create(int fd) {
+    conn_t *conn = malloc_or_die(sizeof(conn_t));
+    conn->req = request_create(fd);
+    conn->state = CONN_REQUEST_LINE;
+    conn->events = 0;
+    conn->last_active = time(NULL);
+    conn->entry = NULL;
+    idle_append(conn);
+    return conn;
+}
+
+static void conn_destroy(conn_t *conn) {
+    if (conn->entry)
+	cache_put(conn->entry);
+    idle_remove(conn);
+    epoll_ctl_or_die(epoll_fd, EPOLL_CTL_DEL, conn->req->fd, NULL);
+    request_destroy(conn->req);
+    free(conn);
+}
+
+static void conn_watch(conn_t *conn, uint32_t events) {
+    if (events == conn->events)
+	return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl_or_die(epoll_fd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->req->fd, &ev);
+    conn->events = events;
+}
+
+//
+// Writes as much of the response as the socket takes right now.
+// Returns 1 once all of it is out, 0 if we have to wait for the socket
+// to drain, and -1 if the client went away.
+//
+static int conn_write(conn_t *conn) {
+    int fd = conn->req->fd;
+    while (1) {
+	ssize_t rc;
+	if (conn->iov_cnt > 0) {
+	    // MSG_MORE holds a header back so it goes out with the file
+	    struct msghdr msg = { 0 };
+	    msg.msg_iov = conn->iov_next;
+	    msg.msg_iovlen = conn->iov_cnt;
+	    rc = sendmsg(fd, &msg, conn->body_off < conn->body_len ? MSG_MORE : 0);
+	} else if (conn->body_off < conn->body_len) {
+	    // (this moves body_off along itself)
+	    rc = sendfile(fd, conn->req->file->fd, &conn->body_off, conn->body_len - conn->body_off);
+	} else {
+	    return 1;
+	}
+	if (rc < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	stats_count(STAT_BYTES, rc);
+	if (conn->iov_cnt > 0)
+	    iov_advance(&conn->iov_next, &conn->iov_cnt, rc);
+	else if (rc == 0)
+	    return -1; // the file shrank under us
+    }
+}
+
+//
+// Sets up the response in conn->iov (and the file to follow it, if
+// any) and moves on to writing it
+//
+static void conn_respond(conn_t *conn, int iov_cnt, off_t body_len) {
+    conn->iov_next = conn->iov;
+    conn->iov_cnt = iov_cnt;
+    conn->body_len = body_len;
+    conn->body_off = 0;
+    conn->state = CONN_WRITING;
+    conn->t_serve = stats_now();
+}
+
+static void conn_respond_reply(conn_t *conn) {
+    conn->iov[0].iov_base = conn->req->reply;
+    conn->iov[0].iov_len = conn->req->reply_len;
+    conn_respond(conn, 1, 0);
+}
+
+static void conn_respond_static(conn_t *conn) {
+    request_t *req = conn->req;
+    conn->entry = request_cache_static(req);
+    if (conn->entry) {
+	conn_respond(conn, request_static_iov(req, conn->entry, conn->hdr, conn->iov), 0);
+	return;
+    }
+    conn->iov[0].iov_base = conn->hdr;
+    conn->iov[0].iov_len = request_static_header(conn->hdr, req->filename, req->sbuf.st_size, req->keep_alive);
+    conn_respond(conn, 1, req->sbuf.st_size);
+}
+
+// hands parked connections to the pool for as long as it has room
+static void event_unpark() {
+    while (parked_head) {
+	conn_t *conn = parked_head;
+	if (pool_try_put(conn->req) < 0)
+	    return;
+	parked_head = conn->next;
+	if (parked_head == NULL)
+	    parked_tail = NULL;
+	free(conn);
+    }
+}
+
+//
+// All headers are in: decide what to do with the request. Returns 1 if
+// there is a response to write (an error or /stats from memory, or a
+// static file), 2 if the request was handed off to the pool (or is
+// waiting for room there).
+//
+static int conn_dispatch(conn_t *conn) {
+    request_t *req = conn->req;
+    if (request_prepare(req) < 0 || req->reply) {
+	conn_respond_reply(conn);
+	return 1;
+    }
+    if (req->is_static) {
+	conn_respond_static(conn);
+	return 1;
+    }
+
+    // off to a helper thread; it owns (and eventually closes) the request
+    idle_remove(conn);
+    epoll_ctl_or_die(epoll_fd, EPOLL_CTL_DEL, req->fd, NULL);
+    conn->events = 0;
+    set_nonblocking_or_die(req->fd, 0);
+    conn->next = NULL;
+    if (parked_tail)
+	parked_tail->next = conn;
+    else
+	parked_head = conn;
+    parked_tail = conn;
+    event_unpark();
+    return 2;
+}
+
+//
+// Consumes complete lines sitting in the request's read buffer, up to
+// the end of one request. Same return convention as conn_dispatch(),
+// plus 0 if the request is not complete yet and -1 on error.
+//
+static int conn_parse(conn_t *conn) {
+    request_t *req = conn->req;
+    char line[MAXBUF];
+    while (1) {
+	ssize_t len = rio_getline(&req->rio, line, MAXBUF);
+	if (len < 0)
+	    return -1; // line too long to ever complete
+	if (len == 0)
+	    return 0;
+
+	if (conn->state == CONN_REQUEST_LINE) {
+	    req->t_start = stats_now();
+	    if (request_parse_line(req, line) < 0) {
+		conn_respond_reply(conn);
+		return 1;
+	    }
+	    conn->state = CONN_HEADERS;
+	} else if (strcmp(line, "\r\n") == 0) {
+	    return conn_dispatch(conn);
+	} else {
+	    request_parse_header(req, line);
+	}
+    }
+}
+
+//
+// Pushes the connection along as far as it will go without waiting:
+// writes out the current response, then parses and answers whatever
+// further requests are already buffered. Returns -1 if the connection
+// was closed or handed off (conn is gone), otherwise 0.
+//
+static int conn_run(conn_t *conn) {
+    while (1) {
+	if (conn->state == CONN_WRITING) {
+	    int rc = conn_write(conn);
+	    if (rc == 0) {
+		conn_watch(conn, EPOLLOUT);
+		return 0;
+	    }
+	    if (rc > 0)
+		stats_time(STAT_SERVE, stats_now() - conn->t_serve);
+	    if (rc < 0 || !conn->req->keep_alive) {
+		conn_destroy(conn);
+		return -1;
+	    }
+	    // on to the next request
+	    if (conn->entry)
+		cache_put(conn->entry);
+	    conn->entry = NULL;
+	    request_reset(conn->req);
+	    conn->state = CONN_REQUEST_LINE;
+	}
+	int rc = conn_parse(conn);
+	if (rc == 0) {
+	    conn_watch(conn, EPOLLIN);
+	    return 0;
+	}
+	if (rc == 2)
+	    return -1;
+	if (rc < 0) {
+	    conn_destroy(conn);
+	    return -1;
+	}
+    }
+}
+
+static void conn_readable(conn_t *conn) {
+    while (1) {
+	ssize_t rc = rio_fill(&conn->req->rio);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    return;
+	if (rc <= 0) {
+	    conn_destroy(conn);
+	    return;
+	}
+	if (conn_run(conn) < 0)
+	    return;
+	if (conn->state == CONN_WRITING)
+	    return;
+    }
+}
+
+static void event_accept(int listen_fd) {
+    while (1) {
+	struct sockaddr_in client_addr;
+	socklen_t client_len = sizeof(client_addr);
+	int conn_fd = accept4(listen_fd, (sockaddr_t *) &client_addr, &client_len, SOCK_NONBLOCK);
+	if (conn_fd < 0) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+		return;
+	    if (errno == EINTR)
+		continue;
+	    perror("accept4");
+	    return;
+	}
+	stats_count(STAT_CONNECTIONS, 1);
+	conn_t *conn = conn_create(conn_fd);
+	conn_watch(conn, EPOLLIN);
+    }
+}
+
+// closes connections nobody has done anything with for too long
+static void event_sweep() {
+    time_t now = time(NULL);
+    while (idle_head && now - idle_head->last_active >= keep_alive_timeout)
+	conn_destroy(idle_head);
+}
+
+void event_loop(int listen_fd) {
+    struct epoll_event events[MAXEVENTS];
+    struct epoll_event ev;
+
+    epoll_fd = epoll_create1_or_die(0);
+    set_nonblocking_or_die(listen_fd, 1);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // marks the listening socket
+    epoll_ctl_or_die(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    room_fd = eventfd(0, EFD_NONBLOCK);
+    assert(room_fd >= 0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &room_fd;
+    epoll_ctl_or_die(epoll_fd, EPOLL_CTL_ADD, room_fd, &ev);
+    pool_notify(room_fd);
+
+    while (1) {
+	// wake up now and then to look for idle connections
+	stats_state(STAT_IDLE_US);
+	int n = epoll_wait(epoll_fd, events, MAXEVENTS, keep_alive_timeout > 0 ? 1000 : -1);
+	stats_state(STAT_BUSY_US);
+	if (n < 0) {
+	    assert(errno == EINTR);
+	    continue;
+	}
+	int i;
+	for (i = 0; i < n; i++) {
+	    conn_t *conn = events[i].data.ptr;
+	    if (conn == NULL) {
+		event_accept(listen_fd);
+		continue;
+	    }
+	    if (events[i].data.ptr == &room_fd) {
+		uint64_t ticks;
+		read_or_die(room_fd, &ticks, sizeof(ticks));
+		event_unpark();
+		continue;
+	    }
+	    conn_touch(conn);
+	    if (conn->state == CONN_WRITING)
+		conn_run(conn);
+	    else
+		conn_readable(conn);
+	}
+	if (keep_alive_timeout > 0)
+	    event_sweep();
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+//
+// Serves all connections on listen_fd from one epoll-driven thread;
+// CGI requests are passed on to the worker pool (see pool.h), which
+// must already be running. Never returns.
+//
+void event_loop(int listen_fd);
+
+#endif // __EVENT_H__
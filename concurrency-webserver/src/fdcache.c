@@ -0,0 +1,201 @@
+#include "io_helper.h"
+#include "fdcache.h"
+
+//
+// A chained hash table finds entries by path; a doubly-linked list
+// keeps them in LRU order (most recently used at the head). Both, and
+// all reference counts, are protected by one lock, which is never held
+// across a system call.
+//
+
+#define FDCACHE_BUCKETS (1024)
+
+static fdcache_entry_t *buckets[FDCACHE_BUCKETS];
+static fdcache_entry_t *lru_head = NULL, *lru_tail = NULL;
+static int capacity = 0;
+static int count = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void fdcache_init(int max_entries) {
+    capacity = max_entries;
+}
+
+static unsigned long fdcache_hash(char *path) {
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *path++) != '\0')
+	hash = hash * 33 + c;
+    return hash % FDCACHE_BUCKETS;
+}
+
+static int fdcache_same_file(struct stat *a, struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+	a->st_size == b->st_size &&
+	a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void fdcache_free(fdcache_entry_t *e) {
+    close_or_die(e->fd);
+    free(e->path);
+    free(e);
+}
+
+// the functions below are called with the lock held
+
+static void lru_unlink(fdcache_entry_t *e) {
+    if (e->lru_prev)
+	e->lru_prev->lru_next = e->lru_next;
+    else
+	lru_head = e->lru_next;
+    if (e->lru_next)
+	e->lru_next->lru_prev = e->lru_prev;
+    else
+	lru_tail = e->lru_prev;
+}
+
+static void lru_push(fdcache_entry_t *e) {
+    e->lru_prev = NULL;
+    e->lru_next = lru_head;
+    if (lru_head)
+	lru_head->lru_prev = e;
+    lru_head = e;
+    if (lru_tail == NULL)
+	lru_tail = e;
+}
+
+static fdcache_entry_t *fdcache_lookup(char *path) {
+    fdcache_entry_t *e;
+    for (e = buckets[fdcache_hash(path)]; e != NULL; e = e->hash_next)
+	if (strcmp(e->path, path) == 0)
+	    return e;
+    return NULL;
+}
+
+// takes e out of the cache; returns 1 if the caller should now free it
+static int fdcache_remove(fdcache_entry_t *e) {
+    fdcache_entry_t **pp = &buckets[fdcache_hash(e->path)];
+    while (*pp != e)
+	pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+    lru_unlink(e);
+    e->cached = 0;
+    count--;
+    return e->refs == 0;
+}
+
+static void fdcache_insert(fdcache_entry_t *e) {
+    unsigned long b = fdcache_hash(e->path);
+    e->hash_next = buckets[b];
+    buckets[b] = e;
+    lru_push(e);
+    e->cached = 1;
+    count++;
+}
+
+//
+// Evicts unreferenced entries from the cold end until we are within
+// capacity; they are chained through hash_next onto *victims, to be
+// closed once the lock is dropped.
+//
+static void fdcache_evict(fdcache_entry_t **victims) {
+    fdcache_entry_t *e = lru_tail;
+    while (count > capacity && e != NULL) {
+	fdcache_entry_t *prev = e->lru_prev;
+	if (e->refs == 0) {
+	    fdcache_remove(e);
+	    e->hash_next = *victims;
+	    *victims = e;
+	}
+	e = prev;
+    }
+}
+
+static void fdcache_free_all(fdcache_entry_t *victims) {
+    while (victims) {
+	fdcache_entry_t *next = victims->hash_next;
+	fdcache_free(victims);
+	victims = next;
+    }
+}
+
+fdcache_entry_t *fdcache_get(char *path) {
+    fdcache_entry_t *e, *victims = NULL;
+    struct stat sbuf;
+    time_t now = time(NULL);
+
+    // common case: a recently validated hit
+    pthread_mutex_lock_or_die(&lock);
+    e = fdcache_lookup(path);
+    if (e && now - e->validated < FDCACHE_REVALIDATE)
+	goto hit;
+    pthread_mutex_unlock_or_die(&lock);
+
+    // stale or missing: see whether what we have is still the same file
+    if (e) {
+	if (stat(path, &sbuf) < 0)
+	    return NULL;
+	pthread_mutex_lock_or_die(&lock);
+	e = fdcache_lookup(path);
+	if (e && fdcache_same_file(&e->sbuf, &sbuf)) {
+	    e->validated = now;
+	    goto hit;
+	}
+	pthread_mutex_unlock_or_die(&lock);
+    }
+
+    // (re)open it; without O_NONBLOCK, opening a FIFO would wait for a
+    // writer to show up, and only regular files are ever served
+    int fd = open(path, O_RDONLY | O_NONBLOCK, 0);
+    if (fd < 0)
+	return NULL;
+    fstat_or_die(fd, &sbuf);
+    if (!S_ISREG(sbuf.st_mode)) {
+	close_or_die(fd);
+	errno = EACCES;
+	return NULL;
+    }
+    e = malloc_or_die(sizeof(fdcache_entry_t));
+    e->fd = fd;
+    e->sbuf = sbuf;
+    e->path = strdup(path);
+    assert(e->path != NULL);
+    e->validated = now;
+    e->refs = 1;
+    e->cached = 0;
+    if (capacity == 0)
+	return e;
+
+    pthread_mutex_lock_or_die(&lock);
+    fdcache_entry_t *old = fdcache_lookup(path);
+    if (old && fdcache_remove(old)) {
+	old->hash_next = victims;
+	victims = old;
+    }
+    fdcache_insert(e);
+    fdcache_evict(&victims);
+    pthread_mutex_unlock_or_die(&lock);
+    fdcache_free_all(victims);
+    return e;
+
+ hit:
+    e->refs++;
+    lru_unlink(e);
+    lru_push(e);
+    pthread_mutex_unlock_or_die(&lock);
+    return e;
+}
+
+void fdcache_put(fdcache_entry_t *e) {
+    fdcache_entry_t *victims = NULL;
+    pthread_mutex_lock_or_die(&lock);
+    int done = (--e->refs == 0 && !e->cached);
+    // entries that were in use when we last went over capacity can go now
+    if (count > capacity)
+	fdcache_evict(&victims);
+    pthread_mutex_unlock_or_die(&lock);
+    if (done)
+	fdcache_free(e);
+    fdcache_free_all(victims);
+}
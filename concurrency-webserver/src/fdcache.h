@@ -0,0 +1,44 @@
+#ifndef __FDCACHE_H__
+#define __FDCACHE_H__
+
+#include <sys/stat.h>
+#include <time.h>
+
+//
+// A bounded LRU cache of open file descriptors for static files, along
+// with what fstat() said about them, keyed by path. A hit hands back
+// the open descriptor without any open() or stat(). Entries are only
+// trusted for FDCACHE_REVALIDATE seconds at a time; after that the next
+// lookup stat()s the path again, and if the file has changed (new
+// mtime, size or inode) the entry is replaced by a freshly opened one.
+//
+// Entries are reference counted: fdcache_get() takes a reference and
+// fdcache_put() drops it. The descriptor stays open while anyone holds
+// a reference, even if the entry is evicted or replaced meanwhile, so
+// it is safe to sendfile() from it without holding any lock (sendfile
+// with an explicit offset does not move the file position, so many
+// connections can share one descriptor).
+//
+
+#define FDCACHE_REVALIDATE (1)
+
+typedef struct __fdcache_entry_t {
+    char *path;
+    int fd;
+    struct stat sbuf;
+    time_t validated;           // when sbuf was last checked against the path
+    int refs;
+    int cached;                 // still reachable through the cache
+    struct __fdcache_entry_t *hash_next;
+    struct __fdcache_entry_t *lru_prev, *lru_next;
+} fdcache_entry_t;
+
+// capacity is the number of descriptors kept open; 0 turns caching off
+void fdcache_init(int capacity);
+
+// NULL (with errno set) if the file cannot be opened; EACCES if it is
+// not a regular file
+fdcache_entry_t *fdcache_get(char *path);
+void fdcache_put(fdcache_entry_t *entry);
+
+#endif // __FDCACHE_H__
@@ -0,0 +1,81 @@
+#include <string.h>
+#include "hist.h"
+
+//
+// Values below HIST_SUB_BUCKETS get a bucket each. Above that, a value
+// with its top bit at position e goes into group e - HIST_SUB_BITS + 1,
+// at the sub-bucket given by the HIST_SUB_BITS bits below the top one.
+//
+static int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS)
+	return v;
+    int e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS)
+	return HIST_BUCKETS - 1;
+    int sub = (v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// the largest value that goes into bucket b
+static uint64_t hist_bucket_max(int b) {
+    if (b < HIST_SUB_BUCKETS)
+	return b;
+    int e = b / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = b % HIST_SUB_BUCKETS;
+    return (1ULL << e) + ((sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+// single-writer updates; see hist.h
+#define hist_load(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define hist_store(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(hist_t));
+    h->min = UINT64_MAX;
+}
+
+void hist_add(hist_t *h, uint64_t value) {
+    int b = hist_bucket(value);
+    hist_store(h->counts[b], h->counts[b] + 1);
+    hist_store(h->total, h->total + 1);
+    hist_store(h->sum, h->sum + value);
+    if (value < h->min)
+	hist_store(h->min, value);
+    if (value > h->max)
+	hist_store(h->max, value);
+}
+
+void hist_merge(hist_t *into, hist_t *from) {
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+	into->counts[i] += hist_load(from->counts[i]);
+    into->total += hist_load(from->total);
+    into->sum += hist_load(from->sum);
+    uint64_t min = hist_load(from->min), max = hist_load(from->max);
+    if (min < into->min)
+	into->min = min;
+    if (max > into->max)
+	into->max = max;
+}
+
+uint64_t hist_percentile(hist_t *h, double p) {
+    if (h->total == 0)
+	return 0;
+    uint64_t rank = (uint64_t) (p * h->total);
+    if (rank >= h->total)
+	rank = h->total - 1;
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	seen += h->counts[i];
+	if (seen > rank)
+	    break;
+    }
+    // the bucket's upper end can overshoot what was actually seen
+    uint64_t v = hist_bucket_max(i);
+    return v > h->max ? h->max : v;
+}
+
+double hist_mean(hist_t *h) {
+    return h->total ? (double) h->sum / h->total : 0.0;
+}
@@ -0,0 +1,43 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+
+//
+// A latency histogram with log-linear buckets: each power of two is
+// split into HIST_SUB_BUCKETS equal parts, so any recorded value is
+// known to within about 6% no matter how large it is, with a fixed
+// amount of memory and O(1) insertion. Values are unitless (the
+// callers use microseconds), and anything at or beyond 2^HIST_MAX_BITS
+// lands in the last bucket.
+//
+// A histogram is not locked; give each thread its own and merge them
+// when reporting. Merging may go on while the owner is still adding
+// values: each field is only ever written by the owner, with relaxed
+// atomic stores, so a reader sees every field either before or after
+// an update, never torn (the fields may disagree slightly with each
+// other, which does not matter for a report).
+//
+
+#define HIST_SUB_BITS    (4)
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS    (40)
+#define HIST_BUCKETS     ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;             // number of values recorded
+    uint64_t sum;
+    uint64_t min, max;
+} hist_t;
+
+void hist_init(hist_t *h);
+void hist_add(hist_t *h, uint64_t value);
+void hist_merge(hist_t *into, hist_t *from);
+
+// the value below which a fraction p (0 to 1) of the recorded ones lie,
+// as the upper end of its bucket; 0 if nothing was recorded
+uint64_t hist_percentile(hist_t *h, double p);
+double hist_mean(hist_t *h);
+
+#endif // __HIST_H__
@@ -1,27 +1,123 @@
 #include "io_helper.h"
 
-ssize_t readline(int fd, void *buf, size_t maxlen) {
-    char c;
+void rio_init(rio_t *rp, int fd) {
+    rp->fd = fd;
+    rp->start = 0;
+    rp->end = 0;
+}
+
+//
+// Reads once into the free space at the end of the buffer (moving the
+// unread bytes to the front first). Returns what read() returned; a
+// full buffer is an error (ENOBUFS).
+//
+ssize_t rio_fill(rio_t *rp) {
+    if (rp->start > 0) {
+	memmove(rp->buf, rp->buf + rp->start, rp->end - rp->start);
+	rp->end -= rp->start;
+	rp->start = 0;
+    }
+    if (rp->end == RIO_BUFSIZE) {
+	errno = ENOBUFS;
+	return -1;
+    }
+    ssize_t rc;
+    do {
+	rc = read(rp->fd, rp->buf + rp->end, RIO_BUFSIZE - rp->end);
+    } while (rc < 0 && errno == EINTR);
+    if (rc > 0)
+	rp->end += rc;
+    return rc;
+}
+
+//
+// Reads a line (up to and including the '\n', and no more than
+// maxlen - 1 bytes of it) and terminates it with '\0'. Returns its
+// length, which is 0 at EOF, or -1 on error.
+//
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen) {
     char *bufp = buf;
-    int n;
-    for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
-	int rc;
-        if ((rc = read_or_die(fd, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+    size_t n = 0;
+    while (n < maxlen - 1) {
+	if (rp->start == rp->end) {
+	    ssize_t rc = rio_fill(rp);
+	    if (rc < 0)
+		return -1;    /* error */
+	    if (rc == 0)
+		break;        /* EOF */
+	}
+	char *src = rp->buf + rp->start;
+	size_t len = rp->end - rp->start;
+	if (len > maxlen - 1 - n)
+	    len = maxlen - 1 - n;
+	char *nl = memchr(src, '\n', len);
+	if (nl)
+	    len = nl - src + 1;
+	memcpy(bufp + n, src, len);
+	n += len;
+	rp->start += len;
+	if (nl)
+	    break;
     }
-    *bufp = '\0';
+    bufp[n] = '\0';
     return n;
 }
 
+//
+// Like rio_readline(), but never goes to the kernel: if the buffer does
+// not hold a complete line yet, returns 0 and hands out nothing. A line
+// that cannot fit in maxlen (or in the buffer) is an error.
+//
+ssize_t rio_getline(rio_t *rp, void *buf, size_t maxlen) {
+    char *src = rp->buf + rp->start;
+    size_t len = rp->end - rp->start;
+    char *nl = memchr(src, '\n', len);
+    if (nl == NULL)
+	return (len >= maxlen - 1 || len == RIO_BUFSIZE) ? -1 : 0;
+    len = nl - src + 1;
+    if (len > maxlen - 1)
+	return -1;
+    memcpy(buf, src, len);
+    ((char *) buf)[len] = '\0';
+    rp->start += len;
+    return len;
+}
+
+//
+// Reads n bytes, unless EOF comes first. Returns the number read, or
+// -1 on error. Big reads bypass the buffer once it is drained.
+//
+ssize_t rio_readn(rio_t *rp, void *buf, size_t n) {
+    char *bufp = buf;
+    size_t done = 0;
+    while (done < n) {
+	if (rp->start < rp->end) {
+	    size_t len = rp->end - rp->start;
+	    if (len > n - done)
+		len = n - done;
+	    memcpy(bufp + done, rp->buf + rp->start, len);
+	    rp->start += len;
+	    done += len;
+	    continue;
+	}
+	ssize_t rc;
+	if (n - done >= RIO_BUFSIZE) {
+	    do {
+		rc = read(rp->fd, bufp + done, n - done);
+	    } while (rc < 0 && errno == EINTR);
+	    if (rc > 0)
+		done += rc;
+	} else {
+	    rc = rio_fill(rp);
+	}
+	if (rc < 0)
+	    return -1;
+	if (rc == 0)
+	    break;
+    }
+    return done;
+}
+
 
 int open_client_fd(char *hostname, int port) {
     int client_fd;
@@ -80,4 +176,46 @@ int open_listen_fd(int port) {
     return listen_fd;
 }
 
+// turns O_NONBLOCK on (nonblocking != 0) or off for fd
+int set_nonblocking(int fd, int nonblocking) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+	return -1;
+    if (nonblocking)
+	flags |= O_NONBLOCK;
+    else
+	flags &= ~O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+// steps *iov / *iovcnt past the first n bytes (say, what writev() took)
+void iov_advance(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+	n -= (*iov)->iov_len;
+	(*iov)++;
+	(*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+	(*iov)->iov_base = (char *) (*iov)->iov_base + n;
+	(*iov)->iov_len -= n;
+    }
+}
+
+//
+// Like writev(), but keeps going until everything is out; iov is used
+// up along the way. Returns 0, or -1 on error (for instance, EPIPE
+// when the other end has gone away).
+//
+int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+	ssize_t rc = writev(fd, iov, iovcnt);
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	iov_advance(&iov, &iovcnt, rc);
+    }
+    return 0;
+}
 
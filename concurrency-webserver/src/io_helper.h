@@ -8,17 +8,22 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -34,6 +39,8 @@ typedef struct sockaddr sockaddr_t;
     assert(execve(filename, argv, envp) == 0); 
 #define wait_or_die(status) \
     ({ pid_t pid = wait(status); assert(pid >= 0); pid; })
+#define waitpid_or_die(pid, status, options) \
+    ({ pid_t rc = waitpid(pid, status, options); assert(rc >= 0); rc; })
 #define gethostname_or_die(name, len) \
     ({ int rc = gethostname(name, len); assert(rc == 0); rc; })
 #define setenv_or_die(name, value, overwrite) \
@@ -46,6 +53,12 @@ typedef struct sockaddr sockaddr_t;
     ({ ssize_t rc = read(fd, buf, count); assert(rc >= 0); rc; })
 #define write_or_die(fd, buf, count) \
     ({ ssize_t rc = write(fd, buf, count); assert(rc >= 0); rc; })
+#define writev_or_die(fd, iov, iovcnt) \
+    ({ ssize_t rc = writev(fd, iov, iovcnt); assert(rc >= 0); rc; })
+#define send_or_die(fd, buf, len, flags) \
+    ({ ssize_t rc = send(fd, buf, len, flags); assert(rc >= 0); rc; })
+#define sendfile_or_die(out_fd, in_fd, offset, count) \
+    ({ ssize_t rc = sendfile(out_fd, in_fd, offset, count); assert(rc >= 0); rc; })
 #define lseek_or_die(fd, offset, whence) \
     ({ off_t rc = lseek(fd, offset, whence); assert(rc >= 0); rc; })
 #define close_or_die(fd) \
@@ -78,18 +91,72 @@ typedef struct sockaddr sockaddr_t;
     ({ struct hostent *p = gethostbyname(name); assert(p != NULL); p; })
 #define gethostbyaddr_or_die(addr, len, type) \
     ({ struct hostent *p = gethostbyaddr(addr, len, type); assert(p != NULL); p; })
+#define epoll_create1_or_die(flags) \
+    ({ int rc = epoll_create1(flags); assert(rc >= 0); rc; })
+#define epoll_ctl_or_die(epfd, op, fd, event) \
+    { assert(epoll_ctl(epfd, op, fd, event) == 0); }
+#define socketpair_or_die(domain, type, protocol, sv) \
+    assert(socketpair(domain, type, protocol, sv) == 0);
+#define pthread_create_or_die(thread, attr, start_routine, arg) \
+    assert(pthread_create(thread, attr, start_routine, arg) == 0);
+#define pthread_detach_or_die(thread) \
+    assert(pthread_detach(thread) == 0);
+#define pthread_mutex_lock_or_die(mutex) \
+    assert(pthread_mutex_lock(mutex) == 0);
+#define pthread_mutex_unlock_or_die(mutex) \
+    assert(pthread_mutex_unlock(mutex) == 0);
+#define pthread_cond_wait_or_die(cond, mutex) \
+    assert(pthread_cond_wait(cond, mutex) == 0);
+#define pthread_cond_signal_or_die(cond) \
+    assert(pthread_cond_signal(cond) == 0);
+#define malloc_or_die(size) \
+    ({ void *ptr = malloc(size); assert(ptr != NULL); ptr; })
+
+//
+// Buffered reading from a connection (after Bryant/O'Hallaron's rio).
+// Rather than going to the kernel for every byte, reads fill the buffer
+// in large chunks and lines are handed out of it; whatever is left over
+// (say, the next pipelined request) stays there for the next call. Use
+// one rio_t per connection and don't mix it with plain read()s on the
+// same descriptor.
+//
+#define RIO_BUFSIZE (8192)
+
+typedef struct {
+    int fd;
+    int start;          // buf[start, end) has not been handed out yet
+    int end;
+    char buf[RIO_BUFSIZE];
+} rio_t;
+
+#define rio_buffered(rp) ((rp)->end - (rp)->start)
+
+void rio_init(rio_t *rp, int fd);
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen);
+ssize_t rio_readn(rio_t *rp, void *buf, size_t n);
+
+// for non-blocking descriptors: rio_fill() does a single read(), and
+// rio_getline() returns a line only if all of it is already buffered
+ssize_t rio_fill(rio_t *rp);
+ssize_t rio_getline(rio_t *rp, void *buf, size_t maxlen);
 
 // client/server helper functions 
-ssize_t readline(int fd, void *buf, size_t maxlen);
 int open_client_fd(char *hostname, int portno);
 int open_listen_fd(int portno);
+int set_nonblocking(int fd, int nonblocking);
+void iov_advance(struct iovec **iov, int *iovcnt, size_t n);
+int writev_all(int fd, struct iovec *iov, int iovcnt);
 
 // wrappers for above
-#define readline_or_die(fd, buf, maxlen) \
-    ({ ssize_t rc = readline(fd, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_readline_or_die(rp, buf, maxlen) \
+    ({ ssize_t rc = rio_readline(rp, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_readn_or_die(rp, buf, n) \
+    ({ ssize_t rc = rio_readn(rp, buf, n); assert(rc >= 0); rc; })
 #define open_client_fd_or_die(hostname, port) \
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
 #define open_listen_fd_or_die(port) \
     ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define set_nonblocking_or_die(fd, nonblocking) \
+    ({ int rc = set_nonblocking(fd, nonblocking); assert(rc >= 0); rc; })
 
 #endif // __IO_HELPER__
@@ -0,0 +1,163 @@
+#include "io_helper.h"
+#include "request.h"
+#include "pool.h"
+
+//
+// The buffer holds up to 'size' pending requests in arrival order
+// (the oldest at index 0); 'count' is the number of them. Along with
+// each request we keep how many times it has been passed over by SFF.
+//
+typedef struct {
+    request_t *req;
+    int skipped;
+} slot_t;
+
+static slot_t *buffer;
+static int size;
+static int count = 0;
+static int policy;
+
+// where to say there is room again, and whether anyone is waiting for it
+static int notify_fd = -1;
+static int refused = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+
+// call with the lock held and room in the buffer
+static void pool_insert(request_t *req) {
+    buffer[count].req = req;
+    buffer[count].skipped = 0;
+    count++;
+    pthread_cond_signal_or_die(&not_empty);
+}
+
+void pool_put(request_t *req) {
+    req->t_queued = stats_now();
+    pthread_mutex_lock_or_die(&lock);
+    while (count == size)
+	pthread_cond_wait_or_die(&not_full, &lock);
+    pool_insert(req);
+    pthread_mutex_unlock_or_die(&lock);
+}
+
+int pool_try_put(request_t *req) {
+    req->t_queued = stats_now();
+    pthread_mutex_lock_or_die(&lock);
+    if (count == size) {
+	refused = 1;
+	pthread_mutex_unlock_or_die(&lock);
+	return -1;
+    }
+    pool_insert(req);
+    pthread_mutex_unlock_or_die(&lock);
+    return 0;
+}
+
+void pool_notify(int fd) {
+    notify_fd = fd;
+}
+
+// index of the next request to hand out; call with the lock held
+static int pool_pick() {
+    if (policy == POOL_FIFO || buffer[0].skipped >= SFF_STARVATION_BOUND)
+	return 0;
+
+    int i, pick = 0;
+    for (i = 1; i < count; i++)
+	if (buffer[i].req->sbuf.st_size < buffer[pick].req->sbuf.st_size)
+	    pick = i;
+    // everyone older than the pick has now been passed over once more
+    for (i = 0; i < pick; i++)
+	buffer[i].skipped++;
+    return pick;
+}
+
+static request_t *pool_get() {
+    pthread_mutex_lock_or_die(&lock);
+    while (count == 0)
+	pthread_cond_wait_or_die(&not_empty, &lock);
+    int pick = pool_pick();
+    request_t *req = buffer[pick].req;
+    memmove(&buffer[pick], &buffer[pick + 1], (count - pick - 1) * sizeof(slot_t));
+    count--;
+    pthread_cond_signal_or_die(&not_full);
+    if (refused && notify_fd >= 0) {
+	uint64_t one = 1;
+	write_or_die(notify_fd, &one, sizeof(one));
+	refused = 0;
+    }
+    pthread_mutex_unlock_or_die(&lock);
+    return req;
+}
+
+// how many requests are waiting for a worker
+static int pool_pending() {
+    pthread_mutex_lock_or_die(&lock);
+    int n = count;
+    pthread_mutex_unlock_or_die(&lock);
+    return n;
+}
+
+//
+// Waits for the next request on a kept-alive connection. An idle
+// connection is not worth holding a worker for while other requests
+// are waiting, so this gives up as soon as there are any (checking
+// every POOL_LINGER_SLICE ms). Returns 0 if a request is coming.
+//
+static int pool_linger(request_t *req) {
+    int waited;
+    for (waited = 0; waited < keep_alive_timeout * 1000; waited += POOL_LINGER_SLICE) {
+	if (request_wait(req, pool_pending() > 0 ? 0 : POOL_LINGER_SLICE) == 0)
+	    return 0;
+	if (pool_pending() > 0)
+	    return -1;
+    }
+    return -1;
+}
+
+static void *pool_worker(void *arg) {
+    char name[32];
+    sprintf(name, "worker%ld", (long) arg);
+    stats_register(name);
+    
+    while (1) {
+	stats_state(STAT_IDLE_US);
+	request_t *req = pool_get();
+	stats_state(STAT_BUSY_US);
+	stats_time(STAT_QUEUE_WAIT, stats_now() - req->t_queued);
+	
+	// Under FIFO, the master hands over the connection unread. Under
+	// SFF, it has read the request, and a reply that is not ready to
+	// serve is an error it has sent back already. After that, keep
+	// serving requests on the connection for as long as the client keeps
+	// it alive.
+	while (1) {
+	    if (req->ready || (req->reply == NULL && request_read(req) == 0))
+		request_serve(req);
+	    if (!req->keep_alive)
+		break;
+	    stats_state(STAT_LINGER_US);
+	    int more = (pool_linger(req) == 0);
+	    stats_state(STAT_BUSY_US);
+	    if (!more)
+		break;
+	}
+	request_destroy(req);
+    }
+    return NULL;
+}
+
+void pool_init(int num_threads, int num_buffers, int sched_policy) {
+    size = num_buffers;
+    policy = sched_policy;
+    buffer = malloc_or_die(size * sizeof(slot_t));
+
+    int i;
+    for (i = 0; i < num_threads; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, pool_worker, (void *) (long) i);
+	pthread_detach_or_die(thread);
+    }
+}
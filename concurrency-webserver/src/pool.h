@@ -0,0 +1,46 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "request.h"
+
+//
+// A fixed-size pool of worker threads fed by a bounded buffer of
+// requests. The master thread is the producer (it accepts connections
+// and calls pool_put()); the workers are the consumers (they take a
+// request, serve it and any that follow on the same kept-alive
+// connection, and close it).
+//
+// Which pending request a worker takes depends on the policy:
+// - POOL_FIFO: the oldest one.
+// - POOL_SFF: the one for the smallest file. SFF needs the file size
+//   up front, so requests must have been read (request_read()) before
+//   they are put into the pool. To bound starvation, the oldest pending
+//   request is taken anyway once it has been passed over
+//   SFF_STARVATION_BOUND times.
+//
+
+#define POOL_FIFO (0)
+#define POOL_SFF  (1)
+
+#define SFF_STARVATION_BOUND (32)
+
+// how often (ms) a worker waiting on an idle kept-alive connection
+// checks whether others are waiting for it
+#define POOL_LINGER_SLICE (50)
+
+void pool_init(int num_threads, int num_buffers, int policy);
+
+// blocks while the buffer is full
+void pool_put(request_t *req);
+
+//
+// For callers that must not block (the event loop): puts req in the
+// buffer and returns 0 if there is room, otherwise returns -1 and
+// leaves req alone. After a refusal, the next request a worker takes
+// out makes the pool write to the eventfd given to pool_notify(), so
+// the caller knows when to try again.
+//
+int pool_try_put(request_t *req);
+void pool_notify(int fd);
+
+#endif // __POOL_H__
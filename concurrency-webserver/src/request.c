@@ -1,14 +1,20 @@
 #include "io_helper.h"
 #include "request.h"
+#include "cgi.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
 // Hopefully this is not a problem ... :)
 //
 
-#define MAXBUF (8192)
+int keep_alive_timeout = 5;
 
-void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+//
+// Puts together an error response. It is not sent from here: it is left
+// in req->reply for whoever is doing the writing (request_read() sends
+// it right away; the event loop queues it up like any other response).
+//
+void request_error(request_t *req, char *cause, char *errnum, char *shortmsg, char *longmsg) {
     char buf[MAXBUF], body[MAXBUF];
     
     // Create the body of error message first (have to know its length for header)
@@ -23,31 +29,96 @@ void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *long
 	    "</body>\r\n"
 	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
     
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
+    // Put together the header information for this response
+    sprintf(buf, ""
+	    "HTTP/1.1 %s %s\r\n"
+	    "Content-Type: text/html\r\n"
+	    "Content-Length: %lu\r\n"
+	    "Connection: %s\r\n\r\n", errnum, shortmsg, strlen(body),
+	    req->keep_alive ? "keep-alive" : "close");
     
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
+    stats_count(STAT_ERRORS, 1);
+    int hdr_len = strlen(buf), body_len = strlen(body);
+    req->reply = malloc_or_die(hdr_len + body_len);
+    memcpy(req->reply, buf, hdr_len);
+    memcpy(req->reply + hdr_len, body, body_len);
+    req->reply_len = hdr_len + body_len;
+}
+
+//
+// Writes out all of iov to the client. If that fails, the client has
+// gone away, and all there is to do is not keep the connection.
+//
+void request_writev(request_t *req, struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    if (writev_all(req->fd, iov, iovcnt) < 0)
+	req->keep_alive = 0;
+    else
+	stats_count(STAT_BYTES, len);
+}
+
+//
+// Puts the /stats report together as the reply
+//
+static void request_stats(request_t *req) {
+    char buf[MAXBUF];
+    int body_len;
+    char *body = stats_render(&body_len);
     
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
+    sprintf(buf, ""
+	    "HTTP/1.1 200 OK\r\n"
+	    "Server: OSTEP WebServer\r\n"
+	    "Content-Type: text/plain\r\n"
+	    "Content-Length: %d\r\n"
+	    "Connection: %s\r\n\r\n", body_len,
+	    req->keep_alive ? "keep-alive" : "close");
+    
+    int hdr_len = strlen(buf);
+    req->reply = malloc_or_die(hdr_len + body_len);
+    memcpy(req->reply, buf, hdr_len);
+    memcpy(req->reply + hdr_len, body, body_len);
+    req->reply_len = hdr_len + body_len;
+    free(body);
+}
+
+//
+// Looks at a header line; the only one we care about is Connection,
+// which can ask for the connection to be kept open (the default for
+// HTTP/1.1) or closed (the default for HTTP/1.0)
+//
+void request_parse_header(request_t *req, char *line) {
+    char value[MAXBUF];
+    int i;
     
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
+    if (strncasecmp(line, "Connection:", 11) != 0 || keep_alive_timeout == 0)
+	return;
+    for (i = 0; line[11 + i] != '\0'; i++)
+	value[i] = tolower(line[11 + i]);
+    value[i] = '\0';
+    if (strstr(value, "close"))
+	req->keep_alive = 0;
+    else if (strstr(value, "keep-alive"))
+	req->keep_alive = 1;
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Reads everything up to an empty text line, looking at each header as
+// it goes by. Returns -1 if the client hangs up first (or the read
+// fails; what comes off the socket is the peer's, so neither is fatal).
 //
-void request_read_headers(int fd) {
+int request_read_headers(request_t *req) {
     char buf[MAXBUF];
     
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
+    for (;;) {
+	if (rio_readline(&req->rio, buf, MAXBUF) <= 0)
+	    return -1;
+	if (strcmp(buf, "\r\n") == 0)
+	    return 0;
+	request_parse_header(req, buf);
     }
-    return;
 }
 
 //
@@ -93,88 +164,329 @@ void request_get_filetype(char *filename, char *filetype) {
 	strcpy(filetype, "text/plain");
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
+void request_serve_dynamic(request_t *req) {
+    int fd = req->fd;
+    char *filename = req->filename, *cgiargs = req->cgiargs;
     char buf[MAXBUF], *argv[] = { NULL };
     
     // The server does only a little bit of the header.  
     // The CGI script has to finish writing out the header.
+    // We can't tell where its output ends, other than by the
+    // connection closing, so this is the last response on it.
+    req->keep_alive = 0;
     sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n");
+	    "HTTP/1.1 200 OK\r\n"
+	    "Server: OSTEP WebServer\r\n"
+	    "Connection: close\r\n");
     
-    write_or_die(fd, buf, strlen(buf));
+    struct iovec iov = { buf, strlen(buf) };
+    if (writev_all(fd, &iov, 1) < 0)
+	return;
+    stats_count(STAT_BYTES, iov.iov_len);
     
-    if (fork_or_die() == 0) {                        // child
+    pid_t pid = fork_or_die();
+    if (pid == 0) {                                  // child
 	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
 	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
 	extern char **environ;                       // defined by libc 
 	execve_or_die(filename, argv, environ);
     } else {
-	wait_or_die(NULL);
+	// not just any child: persistent CGI workers are ours too
+	waitpid_or_die(pid, NULL, 0);
     }
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
+//
+// Puts together the response header for a static file into buf;
+// returns its length
+//
+int request_static_header(char *buf, char *filename, int filesize, int keep_alive) {
+    char filetype[MAXBUF];
     
     request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
-    
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    close_or_die(srcfd);
-    
-    // put together response
     sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
+	    "HTTP/1.1 200 OK\r\n"
 	    "Server: OSTEP WebServer\r\n"
 	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
+	    "Content-Type: %s\r\n"
+	    "Connection: %s\r\n\r\n", 
+	    filesize, filetype, keep_alive ? "keep-alive" : "close");
+    return strlen(buf);
+}
+
+//
+// Looks the static request up in the content cache, putting it there
+// first if it is small enough but not in yet. Returns a referenced
+// entry (release with cache_put()), or NULL if the file is not one for
+// the cache or could not be read in whole (it may have shrunk since it
+// was looked at), in which case it is sent off the disk as usual. Cached
+// responses are rendered for a kept-alive connection; see
+// request_static_iov() for the other case.
+//
+cache_entry_t *request_cache_static(request_t *req) {
+    cache_entry_t *entry = cache_get(req->filename, &req->sbuf);
+    if (entry || !cache_wants(req->sbuf.st_size))
+	return entry;
+
+    // render the whole response: header, then the file read in behind it
+    char buf[MAXBUF];
+    int filesize = req->sbuf.st_size;
+    int len = request_static_header(buf, req->filename, filesize, 1);
+    char *data = malloc_or_die(len + filesize);
+    memcpy(data, buf, len);
+    off_t offset = 0;
+    while (offset < filesize) {
+	ssize_t rc = pread(req->file->fd, data + len + offset, filesize - offset, offset);
+	if (rc <= 0) {
+	    free(data);
+	    return NULL;
+	}
+	offset += rc;
+    }
+    return cache_insert(req->filename, &req->sbuf, data, len, len + filesize);
+}
+
+//
+// Sets up iov (two entries at most; returns how many) for sending a
+// cached response. If the connection is to be closed, the header has
+// to say so: a fresh header is put together in buf instead of the
+// cached one.
+//
+int request_static_iov(request_t *req, cache_entry_t *entry, char *buf, struct iovec *iov) {
+    if (req->keep_alive) {
+	iov[0].iov_base = entry->data;
+	iov[0].iov_len = entry->len;
+	return 1;
+    }
+    iov[0].iov_base = buf;
+    iov[0].iov_len = request_static_header(buf, req->filename, req->sbuf.st_size, 0);
+    iov[1].iov_base = entry->data + entry->hdr_len;
+    iov[1].iov_len = entry->len - entry->hdr_len;
+    return 2;
+}
+
+void request_serve_static(request_t *req) {
+    int fd = req->fd;
+    int filesize = req->sbuf.st_size;
+    char buf[MAXBUF];
+    
+    // small files are served straight out of memory
+    cache_entry_t *entry = request_cache_static(req);
+    if (entry) {
+	struct iovec iov[2];
+	request_writev(req, iov, request_static_iov(req, entry, buf, iov));
+	cache_put(entry);
+	return;
+    }
     
-    write_or_die(fd, buf, strlen(buf));
+    // put together response; MSG_MORE holds the header back (like
+    // TCP_CORK, but for just this call) so that it goes out in the same
+    // segment as the start of the file
+    int len = request_static_header(buf, req->filename, filesize, req->keep_alive);
+    if (send(fd, buf, len, filesize > 0 ? MSG_MORE : 0) != len) {
+	req->keep_alive = 0;
+	return;
+    }
     
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    // Rather than read() the file into memory and write() it out again,
+    // have the kernel copy it from the page cache straight to the socket
+    off_t offset = 0;
+    while (offset < filesize) {
+	ssize_t rc = sendfile(fd, req->file->fd, &offset, filesize - offset);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0) {
+	    // the client went away, or the file shrank under us
+	    req->keep_alive = 0;
+	    break;
+	}
+    }
+    stats_count(STAT_BYTES, len + offset);
+}
+
+request_t *request_create(int fd) {
+    request_t *req = malloc_or_die(sizeof(request_t));
+    req->fd = fd;
+    req->ready = 0;
+    req->keep_alive = 0;
+    req->file = NULL;
+    req->reply = NULL;
+    rio_init(&req->rio, fd);
+    return req;
+}
+
+//
+// Gets ready for the next request on the same connection, letting go of
+// whatever the last one was holding on to
+//
+void request_reset(request_t *req) {
+    if (req->file)
+	fdcache_put(req->file);
+    req->file = NULL;
+    free(req->reply);
+    req->reply = NULL;
+    req->ready = 0;
+}
+
+void request_destroy(request_t *req) {
+    request_reset(req);
+    close_or_die(req->fd);
+    free(req);
+}
+
+//
+// After a response on a kept-alive connection, waits (up to timeout_ms)
+// for the next request to start arriving, and resets req for it.
+// Pipelined requests may already be sitting in the read buffer. Returns
+// -1 if the client does not come back in time.
+//
+int request_wait(request_t *req, int timeout_ms) {
+    request_reset(req);
+    if (rio_buffered(&req->rio) > 0)
+	return 0;
+    struct pollfd pfd;
+    pfd.fd = req->fd;
+    pfd.events = POLLIN;
+    int rc;
+    do {
+	rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0 ? 0 : -1;
 }
 
-// handle a request
-void request_handle(int fd) {
-    int is_static;
-    struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
+//
+// Parses the request line. Returns 0 if it is something we can go on
+// with; otherwise an error response has been put together in
+// req->reply and -1 is returned.
+//
+int request_parse_line(request_t *req, char *line) {
+    strcpy(req->version, "");
+    sscanf(line, "%s %s %s", req->method, req->uri, req->version);
+    printf("method:%s uri:%s version:%s\n", req->method, req->uri, req->version);
+    stats_count(STAT_REQUESTS, 1);
     
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
+    // until a Connection header says otherwise
+    req->keep_alive = keep_alive_timeout > 0 && strcasecmp(req->version, "HTTP/1.1") == 0;
     
-    if (strcasecmp(method, "GET")) {
-	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
-	return;
+    if (strcasecmp(req->method, "GET")) {
+	// we don't know how to skip whatever else it sent, so hang up
+	req->keep_alive = 0;
+	request_error(req, req->method, "501", "Not Implemented", "server does not implement this method");
+	return -1;
     }
-    request_read_headers(fd);
+    return 0;
+}
+
+//
+// Finds the file being asked for. This includes its stat information,
+// which is where the size used by the SFF scheduler comes from; static
+// files are also opened, both of which usually come out of the fd
+// cache. Same return convention as request_parse_line().
+//
+static int request_lookup(request_t *req) {
+    int found;
     
-    is_static = request_parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
-	return;
+    req->is_static = request_parse_uri(req->uri, req->filename, req->cgiargs);
+    if (req->is_static) {
+	req->file = fdcache_get(req->filename);
+	found = (req->file != NULL);
+	if (found)
+	    req->sbuf = req->file->sbuf;
+	else if (errno == EACCES) {
+	    request_error(req, req->filename, "403", "Forbidden", "server could not read this file");
+	    return -1;
+	}
+    } else {
+	found = (stat(req->filename, &req->sbuf) == 0);
+    }
+    if (!found) {
+	request_error(req, req->filename, "404", "Not found", "server could not find this file");
+	return -1;
     }
     
-    if (is_static) {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
-	    return;
+    if (req->is_static) {
+	if (!(S_ISREG(req->sbuf.st_mode)) || !(S_IRUSR & req->sbuf.st_mode)) {
+	    request_error(req, req->filename, "403", "Forbidden", "server could not read this file");
+	    return -1;
 	}
-	request_serve_static(fd, filename, sbuf.st_size);
     } else {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
-	    return;
+	if (!(S_ISREG(req->sbuf.st_mode)) || !(S_IXUSR & req->sbuf.st_mode)) {
+	    request_error(req, req->filename, "403", "Forbidden", "server could not run this CGI program");
+	    return -1;
+	}
+    }
+    req->ready = 1;
+    return 0;
+}
+
+//
+// Once the headers are in, figures out what is being asked for. Same
+// return convention as request_parse_line(); when 0 is returned, the
+// request is ready to serve.
+//
+int request_prepare(request_t *req) {
+    uint64_t now = stats_now();
+    stats_time(STAT_PARSE, now - req->t_start);
+    
+    // the report is put together right away, as a reply
+    if (strcmp(req->uri, STATS_URI) == 0) {
+	req->is_static = 0;
+	req->sbuf.st_size = 0; // for SFF
+	request_stats(req);
+	req->ready = 1;
+	return 0;
+    }
+    
+    int rc = request_lookup(req);
+    stats_time(STAT_STAT, stats_now() - now);
+    return rc;
+}
+
+//
+// Reads the request line and headers off the connection and prepares
+// the request. Returns 0 if the request is ready to be served;
+// otherwise -1 is returned, and an error has already been sent back to
+// the client (unless the client hung up before sending it all, or the
+// read failed, in which case keep_alive is off too).
+//
+int request_read(request_t *req) {
+    char buf[MAXBUF];
+    int rc = -1;
+    
+    req->t_start = stats_now();
+    if (rio_readline(&req->rio, buf, MAXBUF) <= 0) {
+	req->keep_alive = 0;
+	return -1;
+    }
+    if (request_parse_line(req, buf) == 0) {
+	if (request_read_headers(req) < 0) {
+	    req->keep_alive = 0;
+	    return -1;
 	}
-	request_serve_dynamic(fd, filename, cgiargs);
+	rc = request_prepare(req);
+    }
+    if (rc < 0 && req->reply) {
+	uint64_t start = stats_now();
+	struct iovec iov = { req->reply, req->reply_len };
+	request_writev(req, &iov, 1);
+	stats_time(STAT_SERVE, stats_now() - start);
+    }
+    return rc;
+}
+
+// serve a request that request_read() said was ready
+void request_serve(request_t *req) {
+    assert(req->ready);
+    uint64_t start = stats_now();
+    if (req->reply) {
+	struct iovec iov = { req->reply, req->reply_len };
+	request_writev(req, &iov, 1);
+    } else if (req->is_static) {
+	request_serve_static(req);
+    } else if (cgi_enabled()) {
+	cgi_serve(req);
+    } else {
+	request_serve_dynamic(req);
     }
+    stats_time(STAT_SERVE, stats_now() - start);
 }
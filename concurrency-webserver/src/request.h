@@ -1,5 +1,52 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
-void request_handle(int fd);
+#include "io_helper.h"
+#include "fdcache.h"
+#include "cache.h"
+#include "stats.h"
+
+#define MAXBUF (8192)
+
+// served by the server itself (see stats.h) rather than from a file
+#define STATS_URI "/stats"
+
+typedef struct __request_t {
+    int fd;
+    rio_t rio;          // everything read off fd goes through here
+    int ready;          // request line and headers read, file stat'd
+    int keep_alive;     // serve more requests on this connection after this one
+    int is_static;
+    struct stat sbuf;
+    fdcache_entry_t *file;      // static files: the open file to send
+    char *reply;                // a whole response (an error, /stats) to send instead
+    int reply_len;
+    uint64_t t_start;           // when we started reading the request
+    uint64_t t_queued;          // when it was put in the pool
+    char method[MAXBUF], uri[MAXBUF], version[MAXBUF];
+    char filename[MAXBUF], cgiargs[MAXBUF];
+} request_t;
+
+// how long (seconds) to wait for the next request on a kept-alive
+// connection; 0 turns keep-alive off
+extern int keep_alive_timeout;
+
+request_t *request_create(int fd);
+void request_destroy(request_t *req);    // also closes the connection
+
+int request_read(request_t *req);
+void request_serve(request_t *req);
+int request_wait(request_t *req, int timeout_ms);
+
+// the pieces of the above, for callers that do their own I/O
+void request_error(request_t *req, char *cause, char *errnum, char *shortmsg, char *longmsg);
+int request_parse_line(request_t *req, char *line);
+void request_parse_header(request_t *req, char *line);
+int request_prepare(request_t *req);
+void request_reset(request_t *req);
+int request_static_header(char *buf, char *filename, int filesize, int keep_alive);
+cache_entry_t *request_cache_static(request_t *req);
+int request_static_iov(request_t *req, cache_entry_t *entry, char *buf, struct iovec *iov);
+void request_writev(request_t *req, struct iovec *iov, int iovcnt);
 
 #endif // __REQUEST_H__
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,13 +22,19 @@ double get_seconds() {
 }
 
 
-int main(int argc, char *argv[]) {
-    // Extract arguments
+//
+// Spins for as many seconds as the query string says, and puts the
+// response (the rest of the header, then the body) into out, which has
+// room for size bytes; returns its length. Only the first QUERY_SHOWN
+// bytes of the query are echoed back, so the body always fits.
+//
+#define QUERY_SHOWN (MAXBUF / 2)
+
+int spin(char *query, char *out, size_t size) {
     double spin_for = 0.0;
-    char *buf;
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
+    if (query != NULL) {
 	// just expecting a single number
-	spin_for = (double) atoi(buf);
+	spin_for = (double) atoi(query);
     }
 
     double t1 = get_seconds();
@@ -37,16 +44,61 @@ int main(int argc, char *argv[]) {
     
     /* Make the response body */
     char content[MAXBUF];
-    sprintf(content, "<p>Welcome to the CGI program (%s)</p>\r\n", buf);
-    sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
-    sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
+    int len = snprintf(content, MAXBUF, "<p>Welcome to the CGI program (%.*s)</p>\r\n",
+		       QUERY_SHOWN, query ? query : "(null)");
+    len += snprintf(content + len, MAXBUF - len, "<p>My only purpose is to waste time on the server!</p>\r\n");
+    len += snprintf(content + len, MAXBUF - len, "<p>I spun for %.2f seconds</p>\r\n", t2 - t1);
     
     /* Generate the HTTP response */
-    printf("Content-Length: %lu\r\n", strlen(content));
-    printf("Content-Type: text/html\r\n\r\n");
-    printf("%s", content);
+    int n = snprintf(out, size, "Content-Length: %d\r\n", len);
+    n += snprintf(out + n, size - n, "Content-Type: text/html\r\n\r\n");
+    n += snprintf(out + n, size - n, "%s", content);
+    return n;
+}
+
+// read or write exactly n bytes on fd; 0 on success
+int full_io(int fd, void *buf, size_t n, int writing) {
+    while (n > 0) {
+	ssize_t rc = writing ? write(fd, buf, n) : read(fd, buf, n);
+	if (rc <= 0)
+	    return -1;
+	buf = (char *) buf + rc;
+	n -= rc;
+    }
+    return 0;
+}
+
+//
+// Run by the server as a persistent worker (wserver -P): requests come
+// in on descriptor 0, one length-prefixed query string at a time, and
+// each response goes back the same way. Runs until the server hangs up.
+//
+void serve_persistent() {
+    char query[MAXBUF], out[2 * MAXBUF];
+    uint32_t n;
+    
+    while (full_io(STDIN_FILENO, &n, sizeof(n), 0) == 0) {
+	if (n >= MAXBUF || full_io(STDIN_FILENO, query, n, 0) != 0)
+	    break;
+	query[n] = '\0';
+	n = spin(query, out, sizeof(out));
+	if (full_io(STDIN_FILENO, &n, sizeof(n), 1) != 0 ||
+	    full_io(STDIN_FILENO, out, n, 1) != 0)
+	    break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (getenv("CGI_PERSISTENT") != NULL) {
+	serve_persistent();
+	exit(0);
+    }
+    
+    // Extract arguments
+    char out[2 * MAXBUF];
+    spin(getenv("QUERY_STRING"), out, sizeof(out));
+    printf("%s", out);
     fflush(stdout);
     
     exit(0);
 }
-
@@ -0,0 +1,140 @@
+#include "io_helper.h"
+#include "cache.h"
+#include "stats.h"
+
+typedef struct {
+    char name[32];
+    int state;                  // which of the *_US counters time goes to...
+    uint64_t since;             // ...from when
+    uint64_t counters[STAT_COUNTERS];
+    hist_t phases[STAT_PHASES];
+} stats_thread_t;
+
+static char *counter_names[STAT_COUNTERS] = {
+    "connections", "requests", "errors", "bytes_sent", "busy_us", "linger_us", "idle_us"
+};
+static char *phase_names[STAT_PHASES] = {
+    "accept", "queue_wait", "parse", "stat", "serve"
+};
+
+static stats_thread_t **threads;
+static int max_threads;
+static int num_threads = 0;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t started;
+
+static __thread stats_thread_t *mine = NULL;
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_init(int n) {
+    max_threads = n;
+    threads = malloc_or_die(n * sizeof(stats_thread_t *));
+    started = stats_now();
+}
+
+void stats_register(char *name) {
+    stats_thread_t *t = malloc_or_die(sizeof(stats_thread_t));
+    memset(t, 0, sizeof(stats_thread_t));
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->state = STAT_BUSY_US;
+    t->since = stats_now();
+    int i;
+    for (i = 0; i < STAT_PHASES; i++)
+	hist_init(&t->phases[i]);
+
+    pthread_mutex_lock_or_die(&register_lock);
+    assert(num_threads < max_threads);
+    threads[num_threads] = t;
+    // readers look at threads[] without the lock, up to num_threads
+    __atomic_store_n(&num_threads, num_threads + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock_or_die(&register_lock);
+    mine = t;
+}
+
+void stats_count(int counter, uint64_t n) {
+    if (mine)
+	__atomic_store_n(&mine->counters[counter], mine->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+void stats_time(int phase, uint64_t us) {
+    if (mine)
+	hist_add(&mine->phases[phase], us);
+}
+
+#define stats_read(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+void stats_state(int state) {
+    if (mine == NULL || state == mine->state)
+	return;
+    uint64_t now = stats_now();
+    stats_count(mine->state, now - mine->since);
+    __atomic_store_n(&mine->state, state, __ATOMIC_RELAXED);
+    __atomic_store_n(&mine->since, now, __ATOMIC_RELAXED);
+}
+
+char *stats_render(int *len) {
+    char *buf;
+    size_t size;
+    FILE *f = open_memstream(&buf, &size);
+    assert(f != NULL);
+    uint64_t now = stats_now();
+
+    int n = __atomic_load_n(&num_threads, __ATOMIC_ACQUIRE);
+    uint64_t totals[STAT_COUNTERS] = { 0 };
+    hist_t phases[STAT_PHASES];
+    int i, j;
+    for (j = 0; j < STAT_PHASES; j++)
+	hist_init(&phases[j]);
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < STAT_COUNTERS; j++)
+	    totals[j] += stats_read(threads[i]->counters[j]);
+	for (j = 0; j < STAT_PHASES; j++)
+	    hist_merge(&phases[j], &threads[i]->phases[j]);
+    }
+
+    fprintf(f, "uptime_s %.1f\n", (now - started) / 1e6);
+    for (j = 0; j < STAT_BUSY_US; j++)
+	fprintf(f, "%s %lu\n", counter_names[j], totals[j]);
+
+    fprintf(f, "\n%-12s %10s %10s %10s %10s %10s %10s %10s\n",
+	    "phase_us", "count", "mean", "p50", "p90", "p99", "p999", "max");
+    for (j = 0; j < STAT_PHASES; j++) {
+	hist_t *h = &phases[j];
+	fprintf(f, "%-12s %10lu %10.0f %10lu %10lu %10lu %10lu %10lu\n",
+		phase_names[j], h->total, hist_mean(h),
+		hist_percentile(h, 0.50), hist_percentile(h, 0.90),
+		hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+    }
+
+    fprintf(f, "\n%-12s %10s %10s %10s %7s %10s\n",
+	    "thread", "busy_s", "linger_s", "idle_s", "busy%", "requests");
+    for (i = 0; i < n; i++) {
+	uint64_t c[STAT_COUNTERS];
+	for (j = 0; j < STAT_COUNTERS; j++)
+	    c[j] = stats_read(threads[i]->counters[j]);
+	// and the time in the state it is in now
+	uint64_t since = stats_read(threads[i]->since);
+	if (since < now)
+	    c[stats_read(threads[i]->state)] += now - since;
+	uint64_t busy = c[STAT_BUSY_US], linger = c[STAT_LINGER_US], idle = c[STAT_IDLE_US];
+	uint64_t all = busy + linger + idle;
+	fprintf(f, "%-12s %10.2f %10.2f %10.2f %6.1f%% %10lu\n",
+		threads[i]->name, busy / 1e6, linger / 1e6, idle / 1e6,
+		all ? 100.0 * busy / all : 0.0, c[STAT_REQUESTS]);
+    }
+
+    cache_stats_t cs;
+    cache_get_stats(&cs);
+    fprintf(f, "\ncache_hits %lu\ncache_misses %lu\ncache_evictions %lu\n"
+	    "cache_entries %lu\ncache_bytes %lu\n",
+	    cs.hits, cs.misses, cs.evictions, cs.entries, cs.bytes);
+
+    fclose(f);
+    *len = size;
+    return buf;
+}
@@ -0,0 +1,68 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include "hist.h"
+
+//
+// Server instrumentation. Every thread that handles connections (the
+// master, each worker, the event loop) registers itself and gets its
+// own set of counters and latency histograms, which only it writes,
+// so recording never takes a lock or bounces a cache line between
+// threads. A request for /stats adds them all up (see hist.h for why
+// reading them while they are written is fine) and reports:
+//
+// - counters: connections accepted, requests, error responses, bytes
+//   sent;
+// - how long (in microseconds) each phase of a request took:
+//   STAT_ACCEPT       from accept() to the connection being queued
+//   STAT_QUEUE_WAIT   from being queued to a worker taking it
+//   STAT_PARSE        reading the request line and headers
+//   STAT_STAT         finding the file (fd cache, stat())
+//   STAT_SERVE        sending the response
+// - per thread, how much time it spent busy, lingering on an idle
+//   kept-alive connection, and idle (waiting for work), which shows
+//   imbalance and whether -t and -b are about right. Threads say which
+//   of these they are in with stats_state(); time is charged to a
+//   state when the thread leaves it (or the report is made).
+//
+
+enum {
+    STAT_CONNECTIONS,
+    STAT_REQUESTS,
+    STAT_ERRORS,
+    STAT_BYTES,
+    STAT_BUSY_US,
+    STAT_LINGER_US,
+    STAT_IDLE_US,
+    STAT_COUNTERS
+};
+
+enum {
+    STAT_ACCEPT,
+    STAT_QUEUE_WAIT,
+    STAT_PARSE,
+    STAT_STAT,
+    STAT_SERVE,
+    STAT_PHASES
+};
+
+// max_threads is how many threads will call stats_register()
+void stats_init(int max_threads);
+void stats_register(char *name);
+
+// microseconds on a monotonic clock
+uint64_t stats_now();
+
+// these record into the calling thread's stats (and do nothing for a
+// thread that has not registered)
+void stats_count(int counter, uint64_t n);
+void stats_time(int phase, uint64_t us);
+
+// state is STAT_BUSY_US, STAT_LINGER_US or STAT_IDLE_US
+void stats_state(int state);
+
+// the report, as a malloc()'d string
+char *stats_render(int *len);
+
+#endif // __STATS_H__
@@ -7,35 +7,58 @@
 // Sends one HTTP request to the specified HTTP server.
 // Prints out the HTTP response.
 //
-// For testing your server, you will want to modify this client.  
-// For example:
-// You may want to make this multi-threaded so that you can 
-// send many requests simultaneously to the server.
+// Given any of the options below, it is a load generator instead:
 //
-// You may also want to be able to request different URIs; 
-// you may want to get more URIs from the command line 
-// or read the list from a file. 
+//      client [-f urifile] [-c conns] [-n requests | -d seconds] [-k]
+//             [-r rate] hostname portnumber [filename]
 //
-// When we test your server, we will be using modifications to this client.
+// -c threads (one connection each) request filename, or the URIs
+// listed in urifile (one per line) in turn, until -n requests have been
+// made or -d seconds (10 by default) have passed. With -k, connections
+// are kept alive between requests rather than opened for each one.
+//
+// Without -r, the load is closed-loop: each thread sends its next
+// request as soon as the last response is in. With -r, requests are
+// sent at a fixed total rate (per second) regardless of how fast the
+// server answers (open loop), and latency is measured from when a
+// request was due rather than when it could actually go out, so a
+// server that falls behind is not flattered by the client slowing down
+// with it.
+//
+// At the end, it prints throughput and a latency distribution.
 //
 
+#define _GNU_SOURCE // for strcasestr()
 #include "io_helper.h"
+#include "hist.h"
 
 #define MAXBUF (8192)
 
+char hostname[MAXBUF];
+
+//
+// Put together an HTTP request for the specified file; returns its
+// length
+//
+int client_request(char *buf, char *filename, int keep_alive) {
+    /* Form the HTTP request */
+    int len = sprintf(buf, "GET %s HTTP/1.1\n", filename);
+    len += sprintf(buf + len, "host: %s\n", hostname);
+    if (!keep_alive)
+	len += sprintf(buf + len, "Connection: close\n");
+    len += sprintf(buf + len, "\r\n");
+    return len;
+}
+
 //
 // Send an HTTP request for the specified file 
 //
 void client_send(int fd, char *filename) {
     char buf[MAXBUF];
-    char hostname[MAXBUF];
     
-    gethostname_or_die(hostname, MAXBUF);
-    
-    /* Form and send the HTTP request */
-    sprintf(buf, "GET %s HTTP/1.1\n", filename);
-    sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
-    write_or_die(fd, buf, strlen(buf));
+    // we read the response until the server hangs up
+    int len = client_request(buf, filename, 0);
+    write_or_die(fd, buf, len);
 }
 
 //
@@ -44,12 +67,15 @@ void client_send(int fd, char *filename) {
 void client_print(int fd) {
     char buf[MAXBUF];  
     int n;
+    rio_t rio;
+    
+    rio_init(&rio, fd);
     
     // Read and display the HTTP Header 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
     while (strcmp(buf, "\r\n") && (n > 0)) {
 	printf("Header: %s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	n = rio_readline_or_die(&rio, buf, MAXBUF);
 	
 	// If you want to look for certain HTTP tags... 
 	// int length = 0;
@@ -59,26 +85,279 @@ void client_print(int fd) {
     }
     
     // Read and display the HTTP Body 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
     while (n > 0) {
 	printf("%s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	n = rio_readline_or_die(&rio, buf, MAXBUF);
+    }
+}
+
+//
+// The load generator
+//
+
+typedef struct {
+    pthread_t thread;
+    hist_t latency;             // in microseconds
+    long requests;              // answered (with any status)
+    long errors;                // failed to connect or no full response
+    long non_2xx;
+    long long bytes;            // of response bodies
+} bench_thread_t;
+
+static char *host;
+static int port;
+static char **uris;
+static int num_uris;
+static int keep_alive = 0;
+static int conns = 1;
+static long max_requests = 0;   // 0: run for 'duration' instead
+static double duration = 10.0;
+static double rate = 0.0;       // 0: closed loop
+
+static long issued = 0;         // requests claimed by threads so far
+static uint64_t start_us, deadline_us;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t when_us) {
+    uint64_t now = now_us();
+    if (when_us > now)
+	usleep(when_us - now);
+}
+
+//
+// Reads one response off the connection. Returns its status code, or
+// -1 if the connection broke first. Sets *closing if the server is
+// going to hang up after it.
+//
+static int bench_read_response(rio_t *rp, long long *bytes, int *closing) {
+    char buf[MAXBUF];
+    int status = -1;
+    long long length = -1;
+    
+    if (rio_readline(rp, buf, MAXBUF) <= 0 || sscanf(buf, "HTTP/%*s %d", &status) != 1)
+	return -1;
+    while (1) {
+	if (rio_readline(rp, buf, MAXBUF) <= 0)
+	    return -1;
+	if (strcmp(buf, "\r\n") == 0)
+	    break;
+	if (strncasecmp(buf, "Content-Length:", 15) == 0)
+	    length = atoll(buf + 15);
+	else if (strncasecmp(buf, "Connection:", 11) == 0 && strcasestr(buf, "close"))
+	    *closing = 1;
+    }
+    
+    // without a length, the body runs until the server hangs up
+    if (length < 0)
+	*closing = 1;
+    while (length != 0) {
+	size_t want = (length < 0 || length > MAXBUF) ? MAXBUF : length;
+	ssize_t n = rio_readn(rp, buf, want);
+	if (n < 0 || (n == 0 && length > 0))
+	    return -1;
+	if (n == 0)
+	    break;
+	*bytes += n;
+	if (length > 0)
+	    length -= n;
+    }
+    return status;
+}
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *t = arg;
+    char buf[MAXBUF];
+    rio_t rio;
+    int fd = -1;
+    // in open loop, each thread takes an equal share of the rate
+    uint64_t interval = rate > 0 ? (uint64_t) (conns * 1e6 / rate) : 0;
+    uint64_t due = start_us;
+    
+    while (1) {
+	long i = __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+	if (max_requests > 0 && i >= max_requests)
+	    break;
+	uint64_t t0 = now_us();
+	if (rate > 0) {
+	    if (deadline_us && due >= deadline_us)
+		break;
+	    sleep_until(due);
+	    t0 = due;
+	    due += interval;
+	} else if (deadline_us && t0 >= deadline_us) {
+	    break;
+	}
+	
+	int len = client_request(buf, uris[i % num_uris], keep_alive);
+	int status = -1, closing = 0, tries;
+	// a kept-alive connection may have been closed by the server while
+	// we weren't looking; that is worth one more try on a new one
+	for (tries = 0; tries < 2 && status < 0; tries++) {
+	    int reused = fd >= 0;
+	    if (fd < 0) {
+		if ((fd = open_client_fd(host, port)) < 0)
+		    break;
+		rio_init(&rio, fd);
+	    }
+	    struct iovec iov = { buf, len };
+	    if (writev_all(fd, &iov, 1) == 0)
+		status = bench_read_response(&rio, &t->bytes, &closing);
+	    if (status < 0 || closing || !keep_alive) {
+		close_or_die(fd);
+		fd = -1;
+	    }
+	    if (!reused)
+		break;
+	}
+	if (status < 0) {
+	    t->errors++;
+	    continue;
+	}
+	hist_add(&t->latency, now_us() - t0);
+	t->requests++;
+	if (status < 200 || status > 299)
+	    t->non_2xx++;
+    }
+    if (fd >= 0)
+	close_or_die(fd);
+    return NULL;
+}
+
+static void bench_read_uris(char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+	perror(path);
+	exit(1);
+    }
+    char line[MAXBUF];
+    int room = 16;
+    uris = malloc_or_die(room * sizeof(char *));
+    while (fgets(line, MAXBUF, f)) {
+	line[strcspn(line, "\r\n")] = '\0';
+	if (line[0] == '\0' || line[0] == '#')
+	    continue;
+	if (num_uris == room) {
+	    room *= 2;
+	    uris = realloc(uris, room * sizeof(char *));
+	    assert(uris != NULL);
+	}
+	uris[num_uris++] = strdup(line);
+    }
+    fclose(f);
+    if (num_uris == 0) {
+	fprintf(stderr, "%s: no URIs\n", path);
+	exit(1);
     }
 }
 
+static void bench_run() {
+    bench_thread_t *threads = malloc_or_die(conns * sizeof(bench_thread_t));
+    int i;
+    
+    // the server might hang up while we were writing; we'll see that as EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    
+    start_us = now_us();
+    deadline_us = max_requests > 0 ? 0 : start_us + (uint64_t) (duration * 1e6);
+    for (i = 0; i < conns; i++) {
+	memset(&threads[i], 0, sizeof(bench_thread_t));
+	hist_init(&threads[i].latency);
+	pthread_create_or_die(&threads[i].thread, NULL, bench_thread, &threads[i]);
+    }
+    
+    bench_thread_t all;
+    memset(&all, 0, sizeof(all));
+    hist_init(&all.latency);
+    for (i = 0; i < conns; i++) {
+	assert(pthread_join(threads[i].thread, NULL) == 0);
+	hist_merge(&all.latency, &threads[i].latency);
+	all.requests += threads[i].requests;
+	all.errors += threads[i].errors;
+	all.non_2xx += threads[i].non_2xx;
+	all.bytes += threads[i].bytes;
+    }
+    double elapsed = (now_us() - start_us) / 1e6;
+    
+    printf("%ld requests in %.2f s (%ld errors, %ld non-2xx), %d connections%s\n",
+	   all.requests, elapsed, all.errors, all.non_2xx, conns,
+	   keep_alive ? " (keep-alive)" : "");
+    printf("throughput: %.1f requests/s, %.2f MB/s\n",
+	   all.requests / elapsed, all.bytes / elapsed / (1024 * 1024));
+    hist_t *h = &all.latency;
+    printf("latency (ms): min %.3f mean %.3f p50 %.3f p90 %.3f p99 %.3f p999 %.3f max %.3f\n",
+	   h->total ? h->min / 1e3 : 0.0, hist_mean(h) / 1e3,
+	   hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.90) / 1e3,
+	   hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+	   h->max / 1e3);
+    free(threads);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s <host> <port> <filename>\n"
+	    "       %s [-f urifile] [-c conns] [-n requests | -d seconds] [-k] [-r rate]\n"
+	    "           <host> <port> [filename]\n", prog, prog);
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    char *host, *filename;
-    int port;
+    char *filename = NULL, *uri_file = NULL;
     int clientfd;
+    int c, bench = 0;
     
-    if (argc != 4) {
-	fprintf(stderr, "Usage: %s <host> <port> <filename>\n", argv[0]);
-	exit(1);
+    while ((c = getopt(argc, argv, "f:c:n:d:kr:")) != -1) {
+	bench = 1;
+	switch (c) {
+	case 'f':
+	    uri_file = optarg;
+	    break;
+	case 'c':
+	    conns = atoi(optarg);
+	    break;
+	case 'n':
+	    max_requests = atol(optarg);
+	    break;
+	case 'd':
+	    duration = atof(optarg);
+	    break;
+	case 'k':
+	    keep_alive = 1;
+	    break;
+	case 'r':
+	    rate = atof(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
     }
+    int nargs = argc - optind;
+    char **args = argv + optind;
+    if (nargs == 3)
+	filename = args[2];
+    else if (!(nargs == 2 && uri_file))
+	usage(argv[0]);
+    if (conns <= 0 || max_requests < 0 || duration <= 0 || rate < 0)
+	usage(argv[0]);
     
-    host = argv[1];
-    port = atoi(argv[2]);
-    filename = argv[3];
+    host = args[0];
+    port = atoi(args[1]);
+    gethostname_or_die(hostname, MAXBUF);
+    
+    if (bench) {
+	if (uri_file) {
+	    bench_read_uris(uri_file);
+	} else {
+	    uris = &filename;
+	    num_uris = 1;
+	}
+	bench_run();
+	exit(0);
+    }
     
     /* Open a single connection to the specified host and port */
     clientfd = open_client_fd_or_die(host, port);
@@ -1,18 +1,53 @@
 #include <stdio.h>
 #include "request.h"
+#include "pool.h"
+#include "event.h"
+#include "fdcache.h"
+#include "cache.h"
+#include "cgi.h"
+#include "stats.h"
 #include "io_helper.h"
 
 char default_root[] = ".";
 
+void usage() {
+    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffers] [-s FIFO|SFF]\n"
+	    "               [-e] [-F fdcache_entries] [-c cache_kb] [-m max_cached_file_kb]\n"
+	    "               [-k keep_alive_seconds] [-P cgi_workers]\n");
+    exit(1);
+}
+
+//
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-s <schedalg>]
+//           [-e] [-F <fdcache_entries>] [-c <cache_kb>] [-m <max_cached_file_kb>]
+//           [-k <keep_alive_seconds>] [-P <cgi_workers>]
+//
+// With -e, connections are served by a single epoll-driven event loop
+// instead; the worker pool then only runs CGI programs.
+//
+// Connections are kept open for more requests (HTTP/1.1 keep-alive)
+// until they have been idle for -k seconds; -k 0 closes each connection
+// after one response, like HTTP/1.0.
+//
+// With -P, each CGI program is run as a pool of that many persistent
+// worker processes (see cgi.h) instead of being forked per request.
 //
-// ./wserver [-d <basedir>] [-p <portnum>] 
+// GET /stats reports what the server has been up to (see stats.h).
 // 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
+    int threads = 1;
+    int buffers = 1;
+    int policy = POOL_FIFO;
+    int events = 0;
+    int fdcache_entries = 256;
+    long cache_kb = 16 * 1024;
+    long max_cached_file_kb = 64;
+    int cgi_workers = 0;
     
-    while ((c = getopt(argc, argv, "d:p:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:b:s:eF:c:m:k:P:")) != -1)
 	switch (c) {
 	case 'd':
 	    root_dir = optarg;
@@ -20,22 +55,94 @@ int main(int argc, char *argv[]) {
 	case 'p':
 	    port = atoi(optarg);
 	    break;
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'b':
+	    buffers = atoi(optarg);
+	    break;
+	case 's':
+	    if (strcmp(optarg, "FIFO") == 0)
+		policy = POOL_FIFO;
+	    else if (strcmp(optarg, "SFF") == 0)
+		policy = POOL_SFF;
+	    else
+		usage();
+	    break;
+	case 'e':
+	    events = 1;
+	    break;
+	case 'F':
+	    fdcache_entries = atoi(optarg);
+	    break;
+	case 'c':
+	    cache_kb = atol(optarg);
+	    break;
+	case 'm':
+	    max_cached_file_kb = atol(optarg);
+	    break;
+	case 'k':
+	    keep_alive_timeout = atoi(optarg);
+	    break;
+	case 'P':
+	    cgi_workers = atoi(optarg);
+	    break;
 	default:
-	    fprintf(stderr, "usage: wserver [-d basedir] [-p port]\n");
-	    exit(1);
+	    usage();
 	}
+    if (threads <= 0 || buffers <= 0 || fdcache_entries < 0 ||
+	cache_kb < 0 || max_cached_file_kb < 0 || keep_alive_timeout < 0 ||
+	cgi_workers < 0)
+	usage();
+
+    // the client might hang up while we were writing; we'll see that as EPIPE
+    signal(SIGPIPE, SIG_IGN);
 
     // run out of this directory
     chdir_or_die(root_dir);
 
+    // how many open static files to keep around (0: none)
+    fdcache_init(fdcache_entries);
+
+    // and how much memory to spend on responses for small files (0: none)
+    cache_init(cache_kb * 1024, max_cached_file_kb * 1024);
+
+    // and how many processes to keep running per CGI program (0: none)
+    cgi_init(cgi_workers);
+
+    // every thread serving connections keeps its own statistics
+    stats_init(threads + 1);
+    stats_register(events ? "event" : "master");
+
+    // start the workers; they block until there is a connection to handle
+    pool_init(threads, buffers, policy);
+
     // now, get to work
     int listen_fd = open_listen_fd_or_die(port);
+    if (events)
+	event_loop(listen_fd);
     while (1) {
 	struct sockaddr_in client_addr;
 	int client_len = sizeof(client_addr);
+	stats_state(STAT_IDLE_US);
 	int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
-	request_handle(conn_fd);
-	close_or_die(conn_fd);
+	stats_state(STAT_BUSY_US);
+	stats_count(STAT_CONNECTIONS, 1);
+	uint64_t accepted = stats_now();
+	request_t *req = request_create(conn_fd);
+	// SFF has to know the file size before it can schedule the request.
+	// If reading it failed, the error has been sent already; unless the
+	// connection is done for, a worker still waits on it for more (with
+	// nothing left to send, it goes in as the smallest).
+	int rc = (policy == POOL_SFF) ? request_read(req) : 0;
+	if (rc < 0 && !req->keep_alive) {
+	    request_destroy(req);
+	} else {
+	    if (rc < 0)
+		req->sbuf.st_size = 0;
+	    pool_put(req);
+	}
+	stats_time(STAT_ACCEPT, stats_now() - accepted);
     }
     return 0;
 }
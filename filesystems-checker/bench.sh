@@ -0,0 +1,58 @@
+#! /usr/bin/env bash
+
+# Times xcheck on images mkimg makes, at a few scales and thread counts:
+#
+# prompt> ./bench.sh [threads ...]
+#
+# For each scale, the image is made once (in $TMPDIR), checked (it must
+# come out clean), and then timed with XCHECK_THREADS set to each of the
+# counts given (1, 2 and 4 if none are); the best of a few runs is
+# reported, in inodes checked per second. With strace about, the system
+# calls of one run are counted too.
+
+if ! [[ -x xcheck && -x mkimg ]]; then
+    echo "xcheck or mkimg does not exist (make first)"
+    exit 1
+fi
+
+threads=${*:-1 2 4}
+image=${TMPDIR:-/tmp}/xcheck-bench.$$.img
+runs=3
+trap 'rm -f $image' EXIT
+
+# scale name, then mkimg arguments
+scales=(
+    "small  -t 2 -w 4 -n 8 -s 4"
+    "medium -t 3 -w 8 -n 10 -s 8"
+    "large  -i 65000 -t 3 -w 20 -n 6 -s 8"
+)
+
+for scale in "${scales[@]}"; do
+    read -r name args <<< "$scale"
+    inodes=$(./mkimg -f $image $args | awk '{ print $2 }')
+    if [[ -z $inodes ]] || ! ./xcheck $image; then
+	echo "$name: image does not check out clean"
+	exit 1
+    fi
+    echo "$name: $inodes inodes ($args)"
+
+    for t in $threads; do
+	best=
+	for (( r = 0; r < runs; r++ )); do
+	    start=$(date +%s%N)
+	    XCHECK_THREADS=$t ./xcheck $image
+	    end=$(date +%s%N)
+	    ns=$(( end - start ))
+	    if [[ -z $best ]] || (( ns < best )); then
+		best=$ns
+	    fi
+	done
+	awk -v t=$t -v ns=$best -v n=$inodes \
+	    'BEGIN { printf "  %2d threads: %8.3f ms, %10.0f inodes/s", t, ns / 1e6, n * 1e9 / ns }'
+	if command -v strace > /dev/null; then
+	    calls=$(XCHECK_THREADS=$t strace -f -c ./xcheck $image 2>&1 | awk '/^100.00/ { print $4 }')
+	    printf ", %s system calls" $calls
+	fi
+	printf "\n"
+    done
+done
@@ -0,0 +1,416 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+#define T_DIR  1   // Directory
+#define T_FILE 2   // File
+#define T_DEV  3   // Device
+
+typedef unsigned char uchar;
+
+// Makes a synthetic xv6 file system image, for trying xcheck on, laid out
+// the way xv6's mkfs lays one out:
+//
+// prompt> mkimg -f image [-i inodes] [-b blocks] [-t depth] [-w fanout]
+//               [-n files] [-s blocks] [-r seed] [-c corruption]
+//
+// The tree is every directory having fanout subdirectories, down to
+// depth levels below the root, and files in every one of them; file
+// sizes (in blocks) are drawn at random, exponentially, with the mean
+// given, up to the largest a file can be. The image is mapped and built
+// in place; what is in the data blocks is left as zeroes (and the file
+// sparse). The image is consistent, unless a corruption is asked for:
+// each one is made to set off one of the errors xcheck looks for (see
+// corruptions[] below), on top of an image that is otherwise fine.
+
+typedef struct {
+	char *name;
+	char *what;
+} corruption_t;
+
+corruption_t corruptions[] = {
+	{ "badinode",    "a file's type is not one there is" },
+	{ "baddirect",   "a file's first block is past the end of the image" },
+	{ "badindirect", "a file's indirect block is past the end" },
+	{ "noroot",      "the root's '..' is not the root" },
+	{ "badfmt",      "a directory's '.' is not itself" },
+	{ "markfree",    "a block a file uses is free in the bitmap" },
+	{ "markused",    "a block no one uses is in use in the bitmap" },
+	{ "dupdirect",   "two files have the same direct block" },
+	{ "dupindirect", "two files have the same block through their indirect blocks" },
+	{ "orphan",      "an inode in use is in no directory" },
+	{ "freeref",     "a file in a directory has a free inode" },
+	{ "nlink",       "a file's link count is one too many" },
+	{ "dirtwice",    "a directory is in two directories" },
+	{ NULL, NULL },
+};
+
+uchar *img;
+struct superblock sb;
+uint nmeta, next_inum, next_block;
+uint depth = 2, fanout = 4, nfiles = 8;
+double mean_blocks = 4;
+
+// building the image
+uint ialloc(short type);
+uint balloc(void);
+uint bmap(uint inum, uint n);
+void dir_add(uint dir, char *name, uint inum);
+uint make_dir(uint parent);
+uint make_file(void);
+void make_tree(uint dir, uint level);
+void corrupt(char *name);
+
+// helper functions
+struct dinode *dinode(uint inum);
+void *block(uint bn);
+void bit_set(uint bn, int v);
+void free_blocks(struct dinode *ip);
+uint find_file(uint min_blocks, int indirect, uint skip);
+void usage(void);
+
+
+int main(int argc, char **argv) {
+	char *image = NULL, *corruption = NULL;
+	uint ninodes = 0, size = 0;
+	int ch, seed = 1;
+
+	while ((ch = getopt(argc, argv, "f:i:b:t:w:n:s:r:c:")) != -1) {
+		switch (ch) {
+		case 'f': image = optarg; break;
+		case 'i': ninodes = atoi(optarg); break;
+		case 'b': size = atoi(optarg); break;
+		case 't': depth = atoi(optarg); break;
+		case 'w': fanout = atoi(optarg); break;
+		case 'n': nfiles = atoi(optarg); break;
+		case 's': mean_blocks = atof(optarg); break;
+		case 'r': seed = atoi(optarg); break;
+		case 'c': corruption = optarg; break;
+		default: usage();
+		}
+	}
+	if (image == NULL) {
+		usage();
+	}
+	if (corruption != NULL) {
+		int i;
+		for (i = 0; corruptions[i].name; ++i) {
+			if (strcmp(corruptions[i].name, corruption) == 0) {
+				break;
+			}
+		}
+		if (corruptions[i].name == NULL) {
+			usage();
+		}
+	}
+	srandom(seed);
+
+	// unless told, enough for the tree, with some to spare
+	uint ndirs = 1, level = 1;
+	for (uint i = 0; i < depth; ++i) {
+		level *= fanout;
+		ndirs += level;
+	}
+	if (ninodes == 0) {
+		ninodes = (ndirs * (nfiles + 1) + 2) * 5 / 4 + 200;
+	}
+	// (a directory entry's inode number is a ushort)
+	if (ninodes > 65535) {
+		fprintf(stderr, "mkimg: at most 65535 inodes\n");
+		exit(1);
+	}
+	if (size == 0) {
+		size = ninodes * (mean_blocks + 3) * 2 + 1000;
+	}
+
+	sb.size = size;
+	sb.ninodes = ninodes;
+	sb.nlog = 30;
+	sb.logstart = 2;
+	sb.inodestart = 2 + sb.nlog;
+	sb.bmapstart = sb.inodestart + ninodes / IPB + 1;
+	nmeta = sb.bmapstart + size / BPB + 1;
+	if (nmeta >= size) {
+		fprintf(stderr, "mkimg: image too small\n");
+		exit(1);
+	}
+	sb.nblocks = size - nmeta;
+
+	int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (ftruncate(fd, (off_t) size * BSIZE) < 0) {
+		perror("ftruncate");
+		exit(1);
+	}
+	img = mmap(NULL, (size_t) size * BSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (img == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	memcpy(img + BSIZE, &sb, sizeof(sb));
+	for (uint b = 0; b < nmeta; ++b) {
+		bit_set(b, 1);
+	}
+	next_inum = ROOTINO;
+	next_block = nmeta;
+
+	uint root = make_dir(0);
+	make_tree(root, 0);
+	if (corruption != NULL) {
+		corrupt(corruption);
+	}
+
+	printf("inodes %u of %u, blocks %u of %u (%u data)\n",
+	       next_inum - 1, ninodes, next_block, size, next_block - nmeta);
+	if (munmap(img, (size_t) size * BSIZE) < 0 || fsync(fd) < 0) {
+		perror("write");
+		exit(1);
+	}
+	close(fd);
+	return 0;
+}
+
+uint ialloc(short type) {
+	if (next_inum >= sb.ninodes) {
+		fprintf(stderr, "mkimg: out of inodes (try -i)\n");
+		exit(1);
+	}
+	struct dinode *ip = dinode(next_inum);
+	ip->type = type;
+	ip->nlink = 1;
+	return next_inum++;
+}
+
+uint balloc(void) {
+	if (next_block >= sb.size) {
+		fprintf(stderr, "mkimg: out of blocks (try -b)\n");
+		exit(1);
+	}
+	bit_set(next_block, 1);
+	return next_block++;
+}
+
+// block n of inode inum, allocated if it is not yet
+uint bmap(uint inum, uint n) {
+	struct dinode *ip = dinode(inum);
+	if (n < NDIRECT) {
+		if (ip->addrs[n] == 0) {
+			ip->addrs[n] = balloc();
+		}
+		return ip->addrs[n];
+	}
+	if (ip->addrs[NDIRECT] == 0) {
+		ip->addrs[NDIRECT] = balloc();
+	}
+	uint *bpi = block(ip->addrs[NDIRECT]);
+	if (bpi[n - NDIRECT] == 0) {
+		bpi[n - NDIRECT] = balloc();
+	}
+	return bpi[n - NDIRECT];
+}
+
+void dir_add(uint dir, char *name, uint inum) {
+	struct dinode *ip = dinode(dir);
+	uint n = ip->size / sizeof(struct dirent);
+	if (n >= MAXFILE * (BSIZE / sizeof(struct dirent))) {
+		fprintf(stderr, "mkimg: directory too big (try less -n or -w)\n");
+		exit(1);
+	}
+	struct dirent *de = block(bmap(dir, n / (BSIZE / sizeof(struct dirent))));
+	de += n % (BSIZE / sizeof(struct dirent));
+	de->inum = inum;
+	strncpy(de->name, name, DIRSIZ);
+	ip->size += sizeof(struct dirent);
+}
+
+// a new directory in parent (0: it is the root)
+uint make_dir(uint parent) {
+	uint inum = ialloc(T_DIR);
+	dir_add(inum, ".", inum);
+	dir_add(inum, "..", parent ? parent : inum);
+	return inum;
+}
+
+uint make_file(void) {
+	uint inum = ialloc(T_FILE);
+	// how many blocks: exponential, with the mean asked for
+	double u = (random() + 1.0) / ((double) RAND_MAX + 2.0);
+	uint n = (uint) (-log(u) * mean_blocks);
+	if (n > MAXFILE) {
+		n = MAXFILE;
+	}
+	for (uint i = 0; i < n; ++i) {
+		bmap(inum, i);
+	}
+	dinode(inum)->size = n * BSIZE - (n ? random() % BSIZE : 0);
+	return inum;
+}
+
+void make_tree(uint dir, uint level) {
+	char name[DIRSIZ + 1];
+	for (uint i = 0; i < nfiles; ++i) {
+		snprintf(name, sizeof(name), "f%u", i);
+		dir_add(dir, name, make_file());
+	}
+	if (level == depth) {
+		return;
+	}
+	for (uint i = 0; i < fanout; ++i) {
+		uint sub = make_dir(dir);
+		snprintf(name, sizeof(name), "d%u", i);
+		dir_add(dir, name, sub);
+		make_tree(sub, level + 1);
+	}
+}
+
+void corrupt(char *name) {
+	uint f, g, b;
+	struct dinode *ip;
+
+	if (strcmp(name, "noroot") == 0) {
+		struct dirent *de = block(dinode(ROOTINO)->addrs[0]);
+		de[1].inum = ROOTINO + 1;
+		return;
+	}
+	if (strcmp(name, "badfmt") == 0 || strcmp(name, "dirtwice") == 0) {
+		// the first directory under the root
+		for (f = ROOTINO + 1; f < next_inum && dinode(f)->type != T_DIR; ++f) {
+		}
+		if (f == next_inum) {
+			fprintf(stderr, "mkimg: no directory to corrupt (try -t)\n");
+			exit(1);
+		}
+		if (strcmp(name, "badfmt") == 0) {
+			struct dirent *de = block(dinode(f)->addrs[0]);
+			de[0].inum = ROOTINO;
+		} else {
+			dir_add(ROOTINO, "again", f);
+		}
+		return;
+	}
+	if (strcmp(name, "orphan") == 0) {
+		ialloc(T_FILE);
+		return;
+	}
+	if (strcmp(name, "markused") == 0) {
+		if (next_block >= sb.size) {
+			fprintf(stderr, "mkimg: no free block to corrupt (try -b)\n");
+			exit(1);
+		}
+		bit_set(next_block, 1);
+		return;
+	}
+
+	int indirect = strcmp(name, "badindirect") == 0 || strcmp(name, "dupindirect") == 0;
+	f = find_file(1, indirect, 0);
+	ip = dinode(f);
+	// (blocks a corruption cuts off are let go, as is the whole of a bad
+	// inode, so that only the corruption itself is wrong)
+	if (strcmp(name, "badinode") == 0) {
+		free_blocks(ip);
+		ip->type = T_DEV + 4;
+	} else if (strcmp(name, "baddirect") == 0) {
+		bit_set(ip->addrs[0], 0);
+		ip->addrs[0] = sb.size + 1;
+	} else if (strcmp(name, "badindirect") == 0) {
+		uint direct[NDIRECT];
+		memcpy(direct, ip->addrs, sizeof(direct));
+		free_blocks(ip);
+		for (uint i = 0; i < NDIRECT; ++i) {
+			bit_set(direct[i], 1);
+		}
+		ip->addrs[NDIRECT] = sb.size + 1;
+	} else if (strcmp(name, "markfree") == 0) {
+		bit_set(ip->addrs[0], 0);
+	} else if (strcmp(name, "nlink") == 0) {
+		ip->nlink++;
+	} else if (strcmp(name, "freeref") == 0) {
+		// (its blocks are free as well, as if it had been let go)
+		free_blocks(ip);
+		memset(ip, 0, sizeof(*ip));
+	} else {
+		// another file's block, in place of one of this one's (which
+		// is let go, so only the sharing is wrong)
+		g = find_file(indirect ? 1 : 2, indirect, f);
+		if (indirect) {
+			uint *bpi = block(ip->addrs[NDIRECT]);
+			b = bpi[0];
+			bpi[0] = ((uint *) block(dinode(g)->addrs[NDIRECT]))[0];
+		} else {
+			b = ip->addrs[0];
+			ip->addrs[0] = dinode(g)->addrs[1];
+		}
+		bit_set(b, 0);
+	}
+}
+
+struct dinode *dinode(uint inum) {
+	return (struct dinode *)(img + sb.inodestart * BSIZE) + inum;
+}
+
+void *block(uint bn) {
+	return img + (size_t) bn * BSIZE;
+}
+
+void bit_set(uint bn, int v) {
+	uchar *byte = img + sb.bmapstart * BSIZE + bn / 8;
+	if (v) {
+		*byte |= 1 << (bn % 8);
+	} else {
+		*byte &= ~(1 << (bn % 8));
+	}
+}
+
+void free_blocks(struct dinode *ip) {
+	for (uint i = 0; i < NDIRECT; ++i) {
+		if (ip->addrs[i] != 0) {
+			bit_set(ip->addrs[i], 0);
+		}
+	}
+	if (ip->addrs[NDIRECT] != 0) {
+		uint *bpi = block(ip->addrs[NDIRECT]);
+		for (uint i = 0; i < NINDIRECT; ++i) {
+			if (bpi[i] != 0) {
+				bit_set(bpi[i], 0);
+			}
+		}
+		bit_set(ip->addrs[NDIRECT], 0);
+	}
+}
+
+// a file with at least min_blocks blocks (and an indirect block, if asked),
+// other than skip
+uint find_file(uint min_blocks, int indirect, uint skip) {
+	for (uint i = ROOTINO + 1; i < next_inum; ++i) {
+		struct dinode *ip = dinode(i);
+		if (i == skip || ip->type != T_FILE) {
+			continue;
+		}
+		if (indirect ? ip->addrs[NDIRECT] != 0 : ip->addrs[min_blocks - 1] != 0) {
+			return i;
+		}
+	}
+	fprintf(stderr, "mkimg: no file big enough to corrupt (try more -n or -s)\n");
+	exit(1);
+}
+
+void usage(void) {
+	fprintf(stderr, "usage: mkimg -f <image> [-i inodes] [-b blocks] [-t depth] [-w fanout]\n"
+		"             [-n files] [-s mean blocks] [-r seed] [-c corruption]\n"
+		"corruptions:\n");
+	for (int i = 0; corruptions[i].name; ++i) {
+		fprintf(stderr, "  %-12s %s\n", corruptions[i].name, corruptions[i].what);
+	}
+	exit(1);
+}
@@ -1,10 +1,14 @@
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "fs.h"
 
@@ -14,29 +18,80 @@
 
 typedef unsigned char uchar;
 
-FILE *fp;
+// The image is mapped in whole, and checked where it lies, by a pool of
+// threads (XCHECK_THREADS of them, or one per CPU) going through three
+// phases, with a barrier between each:
+// 1. the inode table, in chunks of CHUNK inodes handed out in turn: each
+//    inode's type and blocks, and the '.' and '..' of each directory. The
+//    used blocks are kept as a bitvector laid out like the bitmap, set
+//    with an atomic or, so a block's second user is always caught.
+// 2. the directory tree, from the root: each thread has a deque of
+//    directories to look through, takes the newest from its own, and
+//    when that is empty, steals the oldest from another's. Each entry
+//    counts (atomically) as a reference to its inode; the first to a
+//    directory puts it on the deque.
+// 3. the counts, again in chunks of inodes, and the bitmap compared with
+//    the used blocks, in chunks of bytes (8 blocks to a byte).
+// Every error found is kept, and they are all reported at the end, in
+// order (by phase, then inode or block), so the output does not depend
+// on how the work was split up.
+
+#define CHUNK 1024
+#define MAX_THREADS 64
+
+typedef struct {
+	int phase;
+	uint where;     // the inode or block it is about
+	const char *msg;
+} err_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint *dirs;
+	int head, tail, cap;    // dirs[head, tail) are in it
+} deque_t;
+
+uchar *img;
 struct superblock sb;
-uint ninodes, iblocks, bmapblocks, nblocks, bmapstart, nmeta;
-uint *inode_refs, *block_refs;
+uint ninodes, iblocks, bmapblocks, nmeta;
 struct dinode *inodes;
-
-// functions for reading in blocks and data-structures (inodes)
-// from the disk image.
-void fp_seek_block(uint num);
-void fp_seek_inode(uint inum);
-void fp_seek(uint off, int whence); 
-void rblock(uint num, void *buf);
-void rinode(uint inum, struct dinode *ip);
-void rdirent(uint ent, void *buf, struct dirent *ep);
-uint bmapval(uint num);
-
-// recursively traverse through a directory, filling out the bookkeeping
-// data-structures.
-void recurse_dir(struct dinode *dir, uint inum);
-void process_file(struct dinode *f);
+uchar *bitmap;
+uchar *used;
+uint *inode_refs;
+
+int nthreads;
+pthread_barrier_t barrier;
+uint next_chunk;        // of the phase going on (atomic)
+long pending;           // directories queued but not yet looked through
+deque_t deques[MAX_THREADS];
+
+pthread_mutex_t err_lock = PTHREAD_MUTEX_INITIALIZER;
+err_t *errs;
+int nerrs, maxerrs;
+
+// the phases, and what each does for one inode (or byte of bitmap)
+void *worker(void *arg);
+void check_inode(uint inum, struct dinode *ip);
+void use_block(uint bp, int indirect);
+void check_dir_format(uint inum, struct dinode *dir);
+void walk_tree(int self);
+void scan_dir(int self, struct dinode *dir);
+void scan_dir_block(int self, uint bp, int first);
+void check_refs(uint inum);
+void check_bitmap(uint byte);
+
+// the deques
+void push_dir(int self, uint inum);
+int pop_dir(int self, uint *inum);
+int steal_dir(int self, uint *inum);
 
 // helper functions
+int take_chunk(uint count, uint *from, uint *to);
 uint check_bp(uint bp);
+void *block(uint bp);
+void error(int phase, uint where, const char *msg);
+int by_order(const void *a, const void *b);
+void *xmalloc(size_t size);
 
 
 int main(int argc, char** argv) {
@@ -45,301 +100,400 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
- 	fp = fopen(argv[1], "rb");
-	if (fp == NULL) {
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		printf("invalid image file.\n");
+		exit(1);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < 2 * BSIZE) {
 		printf("invalid image file.\n");
-	} 
+		exit(1);
+	}
+	img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (img == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
 
-	struct dinode root_inode;
 	// The superblock should be one block after the boot block.
-	fp_seek(BSIZE, SEEK_CUR);
-	if (fread(&sb, sizeof(struct superblock), 1, fp) != 1) {
- 		printf("Unable to read superblock.\n");
-	}
+	memcpy(&sb, block(1), sizeof(struct superblock));
 	bmapblocks = sb.size / (BSIZE*8) + 1;
 	ninodes = sb.ninodes;
 	iblocks = ninodes / IPB + 1;
 	// metadata includes boot block, superblock (2), inode & bmap blocks
 	nmeta = 2 + sb.nlog + iblocks + bmapblocks;
-	nblocks = sb.nblocks;
-	bmapstart = sb.bmapstart;
-	inode_refs = malloc(sb.ninodes * BSIZE);
-	block_refs = malloc(nblocks * BSIZE);
-	memset(inode_refs, 0, sb.ninodes * BSIZE);
-	memset(block_refs, 0, nblocks * BSIZE);
-
-	// Find the root directory inode and start traversing it
-	// and building the maps.
-	rinode(1, &root_inode);
-	if (root_inode.type != T_DIR) {
-		printf("ERROR: root directory does not exist.\n");
+	if ((off_t) sb.size * BSIZE > st.st_size
+	    || sb.inodestart + iblocks > sb.size
+	    || sb.bmapstart + bmapblocks > sb.size) {
+		printf("Unable to read superblock.\n");
+		exit(1);
+	}
+	inodes = block(sb.inodestart);
+	bitmap = block(sb.bmapstart);
+	used = calloc((sb.size + 7) / 8, 1);
+	inode_refs = calloc(ninodes, sizeof(uint));
+	if (used == NULL || inode_refs == NULL) {
+		perror("calloc");
 		exit(1);
 	}
 
-	// check that root inode is its own parent
-	char buf[BSIZE];
-	struct dirent parent_dirent;
-	rblock(root_inode.addrs[0], buf);
-	rdirent(1, buf, &parent_dirent);
-	if (parent_dirent.inum != 1) {
-		printf("ERROR: root directory does not exist.\n");
+	// the root directory must be there, and be its own parent; without
+	// it, there is no tree to check
+	struct dirent *de = NULL;
+	if (ninodes > ROOTINO && inodes[ROOTINO].type == T_DIR
+	    && check_bp(inodes[ROOTINO].addrs[0])) {
+		de = block(inodes[ROOTINO].addrs[0]);
+	}
+	if (de == NULL || de[1].inum != ROOTINO) {
+		fprintf(stderr, "ERROR: root directory does not exist.\n");
 		exit(1);
 	}
-	// start recursive traversal from the root to build out maps.
-	recurse_dir(&root_inode, 1);
-
-	// iterate over all inodes and check them.
-	struct dinode inode;
-	for (int i = 2; i < ninodes; ++i) {
-		rinode(i, &inode);
-		if (inode.type == 0) {
-			if (inode_refs[i] != 0) {
-				printf("ERROR: inode referred "
-				       "to in directory but marked free.");
-				exit(1);
-			} else {
-				continue;
-			}
-		}
 
-		if (inode.type < T_DIR || inode.type > T_DEV) {
-			printf("ERROR: bad inode.");
+	char *env = getenv("XCHECK_THREADS");
+	nthreads = env ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	if (nthreads > MAX_THREADS) {
+		nthreads = MAX_THREADS;
+	}
+	pthread_barrier_init(&barrier, NULL, nthreads);
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].cap = 64;
+		deques[i].dirs = xmalloc(deques[i].cap * sizeof(uint));
+	}
+	// (counted as found already, so an entry for it does not queue it again)
+	inode_refs[ROOTINO] = 1;
+	push_dir(0, ROOTINO);
+
+	pthread_t threads[MAX_THREADS];
+	for (long i = 1; i < nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, worker, (void *) i) != 0) {
+			perror("pthread_create");
 			exit(1);
 		}
+	}
+	worker((void *) 0);
+	for (int i = 1; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
 
-		if (inode_refs[i] == 0) {
-			printf("ERROR: inode marked use but "
-			       "not found in a directory.");
-			printf("\ninode number: %d", i);
-			exit(1);
-		}
+	qsort(errs, nerrs, sizeof(err_t), by_order);
+	for (int i = 0; i < nerrs; ++i) {
+		fprintf(stderr, "%s\n", errs[i].msg);
+	}
+	return nerrs > 0;
+}
 
-		if (inode.type == T_DIR &&
-		    inode_refs[i] > 1) {
-			printf("ERROR: directory appears "
-			       "more than once in file system.");
-			exit(1);
-		}
+void *worker(void *arg) {
+	int self = (long) arg;
+	uint from, to;
 
-		if (inode.nlink != inode_refs[i]){
-			printf("ERROR: bad reference count for file.");
-			exit(1);
+	while (take_chunk(ninodes, &from, &to)) {
+		for (uint i = from; i < to; ++i) {
+			check_inode(i, &inodes[i]);
 		}
+	}
+	pthread_barrier_wait(&barrier);
+	if (self == 0) {
+		next_chunk = 0;
+	}
 
-		for (int i = 0; i < NDIRECT; i++) {
-			if (inode.addrs[i] == 0) {
-				break;
-			}
-			if (!bmapval(inode.addrs[i])) {
-				printf("ERROR: address used by inode "
-				       "but marked free in bitmap.");
-				exit(1);
-			}
-			if (i == NDIRECT - 1) {
-				if (inode.addrs[NDIRECT] == 0){
-					break;
-				}
-				if (!bmapval(inode.addrs[NDIRECT])) {
-					printf("ERROR: address used by "
-					       "inode but marked free in bitmap.");
-				}
-			}
+	walk_tree(self);
+	pthread_barrier_wait(&barrier);
+
+	while (take_chunk(ninodes, &from, &to)) {
+		for (uint i = from; i < to; ++i) {
+			check_refs(i);
 		}
 	}
+	pthread_barrier_wait(&barrier);
+	if (self == 0) {
+		next_chunk = nmeta / 8;
+	}
+	pthread_barrier_wait(&barrier);
 
-	// iterate over the bitmap and and check each entry.
-	for (int i = nmeta; i < nblocks; ++i) {
-		if (bmapval(i) && block_refs[i - nmeta] == 0) {
-			printf("ERROR: bitmap marks block in "
-			       "use but it is not in use.");
-			exit(1);
+	while (take_chunk((sb.size + 7) / 8, &from, &to)) {
+		for (uint i = from; i < to; ++i) {
+			check_bitmap(i);
 		}
 	}
-
-	fclose(fp);
-	return 0;
+	return NULL;
 }
 
-void recurse_dir(struct dinode *dir, uint inum) {
-	if (dir->type != T_DIR) {
-		printf("Application Error: 'traversedir'"
-		       " called on a non-directory");
-		exit(1);
+void check_inode(uint inum, struct dinode *ip) {
+	if (inum < ROOTINO || ip->type == 0) {
+		return;
+	}
+	if (ip->type < T_DIR || ip->type > T_DEV) {
+		error(1, inum, "ERROR: bad inode.");
+		return;
 	}
 
-	uint bp, bdeidx, maxidx;
-	char buf[BSIZE];
-	struct dirent de;
-	struct dinode cur_inode;
-	maxidx = BSIZE / sizeof(struct dirent);
 	for (int i = 0; i < NDIRECT; ++i) {
-		bdeidx = 0;
-		bp = dir->addrs[i];
-		if (bp == 0) {
-			break;
+		if (ip->addrs[i] == 0) {
+			continue;
 		}
-		if (!check_bp(bp)) {
-			printf("ERROR: bad direct address in inode.");
-			exit(1);
-		}
-		// need to mark directory data-block as referenced.
-		++block_refs[bp - nmeta];
-		rblock(bp, buf);
-		// first check that the '.' and '..' dirs
-		// are correct.
-		if (i == 0) {
-			rdirent(bdeidx++, buf, &de);
-			if (strcmp(de.name, ".") != 0
-			    || de.inum != inum) {
-				printf("ERROR: directory not properly formatted.");
-				exit(1);
-			}
-
-			rdirent(bdeidx++, buf, &de);
-			if (strcmp(de.name, "..") != 0) {
-				printf("ERROR: directory not properly formatted.");
-				exit(1);
-			}
+		if (!check_bp(ip->addrs[i])) {
+			error(1, inum, "ERROR: bad direct address in inode.");
+			continue;
 		}
-		while (bdeidx < maxidx) {
-			rdirent(bdeidx++, buf, &de);
-			// processed all dirents.
-			if (de.inum == 0) {
-				break;
-			}
-			rinode(de.inum, &cur_inode);
-			if (cur_inode.type < T_DIR ||
-			    cur_inode.type > T_DEV) {
-				printf("Invalide inode type\n");
-				exit(1);
-			}
+		use_block(ip->addrs[i], 0);
+	}
 
-			// update bookkeeping for inode depending on type.
-			++inode_refs[de.inum];
-			if (cur_inode.type == T_DIR) {
-				if (inode_refs[de.inum] > 1) {
-					printf("ERROR: directory appears more "
-					       "than once in file system.");
-					exit(1);
+	uint ibp = ip->addrs[NDIRECT];
+	if (ibp != 0) {
+		if (!check_bp(ibp)) {
+			error(1, inum, "ERROR: bad indirect address in inode.");
+		} else {
+			// the indirect block itself is one of the inode's blocks
+			use_block(ibp, 0);
+			uint *bpi = block(ibp);
+			for (int i = 0; i < NINDIRECT; ++i) {
+				if (bpi[i] == 0) {
+					continue;
 				}
-				recurse_dir(&cur_inode, de.inum);
-			} else {
-				process_file(&cur_inode);
+				if (!check_bp(bpi[i])) {
+					error(1, inum, "ERROR: bad indirect address in inode.");
+					continue;
+				}
+				use_block(bpi[i], 1);
 			}
 		}
 	}
-	// I'm pretty sure we don't need to scan the indirect block of
-	// a directory. We would run out of inodes before we get to that
-	// point. (200 inodes, IPB = 25(?), NDIRECT=12, 12 * 25 > 200).
-	// Although it might be necessary if deletions are allowed.
+
+	if (ip->type == T_DIR) {
+		check_dir_format(inum, ip);
+	}
 }
 
-void process_file(struct dinode *f) {
-	if (f->type != T_FILE && f->type != T_DEV) {
-		printf("Application Error: non-file inode"
-		       " passed to process_file");
-		exit(1);
+// notes a block as used by an inode; the second to use it is an error
+void use_block(uint bp, int indirect) {
+	uchar bit = 1 << (bp % 8);
+	if (__atomic_fetch_or(&used[bp / 8], bit, __ATOMIC_RELAXED) & bit) {
+		error(1, bp, indirect ? "ERROR: indirect address used more than once."
+			: "ERROR: direct address used more than once.");
+	}
+}
+
+// '.' and '..' must be a directory's first two entries
+void check_dir_format(uint inum, struct dinode *dir) {
+	if (!check_bp(dir->addrs[0])) {
+		error(1, inum, "ERROR: directory not properly formatted.");
+		return;
+	}
+	struct dirent *de = block(dir->addrs[0]);
+	if (strncmp(de[0].name, ".", DIRSIZ) != 0 || de[0].inum != inum
+	    || strncmp(de[1].name, "..", DIRSIZ) != 0) {
+		error(1, inum, "ERROR: directory not properly formatted.");
 	}
+}
 
-	uint bp;
+void walk_tree(int self) {
+	uint inum;
+	while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0) {
+		if (!pop_dir(self, &inum) && !steal_dir(self, &inum)) {
+			sched_yield();
+			continue;
+		}
+		scan_dir(self, &inodes[inum]);
+		__atomic_fetch_sub(&pending, 1, __ATOMIC_RELEASE);
+	}
+}
+
+// counts the references a directory's entries make (bar its own '.' and
+// '..'), and queues the directories it finds for the first time
+void scan_dir(int self, struct dinode *dir) {
 	for (int i = 0; i < NDIRECT; ++i) {
-		bp = f->addrs[i];
-		if (bp == 0) {
-			return;
+		if (check_bp(dir->addrs[i])) {
+			scan_dir_block(self, dir->addrs[i], i == 0);
 		}
-		if (!check_bp(bp)) {
-			printf("ERROR: bad direct address in inode.");
-			exit(1);
+	}
+	if (check_bp(dir->addrs[NDIRECT])) {
+		uint *bpi = block(dir->addrs[NDIRECT]);
+		for (int i = 0; i < NINDIRECT; ++i) {
+			if (check_bp(bpi[i])) {
+				scan_dir_block(self, bpi[i], 0);
+			}
 		}
-		if(++block_refs[bp - nmeta] > 1) {
-			printf("ERROR: direct address used more than once.");
-			exit(1);
+	}
+}
+
+void scan_dir_block(int self, uint bp, int first) {
+	struct dirent *de = block(bp);
+	uint n = BSIZE / sizeof(struct dirent);
+	for (uint i = first ? 2 : 0; i < n; ++i) {
+		uint inum = de[i].inum;
+		if (inum == 0) {
+			continue;
+		}
+		if (inum >= ninodes) {
+			error(2, inum, "ERROR: inode referred to in directory but marked free.");
+			continue;
+		}
+		if (__atomic_fetch_add(&inode_refs[inum], 1, __ATOMIC_RELAXED) == 0
+		    && inodes[inum].type == T_DIR) {
+			push_dir(self, inum);
 		}
 	}
+}
 
-	uint ibp = f->addrs[NDIRECT];
-	if (ibp == 0) {
+void check_refs(uint inum) {
+	struct dinode *ip = &inodes[inum];
+	if (inum <= ROOTINO) {
 		return;
 	}
-	if (!check_bp(bp)) {
-		printf("ERROR: bad direct address in inode.");
-		exit(1);
-	}
-	// need to also record the usage of indirect block.
-	if (++block_refs[ibp - nmeta] > 1) {
-		printf("ERROR: direct address used more than once.");
-	}
-	uint *bpi;
-	char buf[BSIZE];
-	rblock(ibp, buf);
-	for (int i = 0; i < NINDIRECT; ++i) {
-		bpi = (uint *)buf + i;
-		if (*bpi == 0) {
-			return;
+	if (ip->type == 0) {
+		if (inode_refs[inum] != 0) {
+			error(3, inum, "ERROR: inode referred to in directory but marked free.");
 		}
-		if (!check_bp(*bpi)) {
-			printf("ERROR: bad indirect address in inode.");
-			exit(1);
+		return;
+	}
+	if (ip->type < T_DIR || ip->type > T_DEV) {
+		return;
+	}
+	if (inode_refs[inum] == 0) {
+		error(3, inum, "ERROR: inode marked use but not found in a directory.");
+		return;
+	}
+	if (ip->type == T_DIR && inode_refs[inum] > 1) {
+		error(3, inum, "ERROR: directory appears more than once in file system.");
+	}
+	if (ip->type == T_FILE && ip->nlink != inode_refs[inum]) {
+		error(3, inum, "ERROR: bad reference count for file.");
+	}
+}
+
+// compares the bitmap with the blocks in use, from the first data block on
+void check_bitmap(uint byte) {
+	uchar mask = 0xff;
+	if (byte == nmeta / 8) {
+		mask &= 0xff << (nmeta % 8);
+	}
+	if (byte == sb.size / 8) {
+		mask &= 0xff >> (8 - sb.size % 8);
+	}
+	uchar unmarked = used[byte] & ~bitmap[byte] & mask;
+	uchar unused = bitmap[byte] & ~used[byte] & mask;
+	for (int i = 0; (unmarked | unused) >> i; ++i) {
+		if ((unmarked >> i) & 1) {
+			error(4, byte * 8 + i, "ERROR: address used by inode but marked free in bitmap.");
 		}
-		if (++block_refs[*bpi - nmeta] > 1) {
-			printf("ERROR: indirect address used more than once.");
-			exit(1);
+		if ((unused >> i) & 1) {
+			error(4, byte * 8 + i, "ERROR: bitmap marks block in use but it is not in use.");
 		}
 	}
 }
 
-void fp_seek_block(uint num) {
-	uint off;
-	off = num * BSIZE;
-	fp_seek(off, SEEK_SET);
+void push_dir(int self, uint inum) {
+	deque_t *d = &deques[self];
+	__atomic_fetch_add(&pending, 1, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&d->lock);
+	if (d->tail == d->cap) {
+		// slide what is there down first, and grow only if it is full
+		memmove(d->dirs, d->dirs + d->head, (d->tail - d->head) * sizeof(uint));
+		d->tail -= d->head;
+		d->head = 0;
+		if (d->tail == d->cap) {
+			d->cap *= 2;
+			d->dirs = realloc(d->dirs, d->cap * sizeof(uint));
+			if (d->dirs == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+	}
+	d->dirs[d->tail++] = inum;
+	pthread_mutex_unlock(&d->lock);
 }
 
-void fp_seek(uint off, int whence) {
-	if (fseek(fp, off, whence) < 0) {
-		perror("fseek");
-		exit(1);
+// the newest directory on the thread's own deque
+int pop_dir(int self, uint *inum) {
+	deque_t *d = &deques[self];
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if (d->head < d->tail) {
+		*inum = d->dirs[--d->tail];
+		found = 1;
 	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
 }
 
-void rblock(uint num, void *buf) {
-	fp_seek_block(num);
-	if (fread((char *)buf, BSIZE, 1, fp) != 1) {
-		perror("fread");
-		exit(1);
+// the oldest directory on some other thread's deque
+int steal_dir(int self, uint *inum) {
+	for (int i = 1; i < nthreads; ++i) {
+		deque_t *d = &deques[(self + i) % nthreads];
+		int found = 0;
+		pthread_mutex_lock(&d->lock);
+		if (d->head < d->tail) {
+			*inum = d->dirs[d->head++];
+			found = 1;
+		}
+		pthread_mutex_unlock(&d->lock);
+		if (found) {
+			return 1;
+		}
 	}
+	return 0;
 }
 
-void rinode(uint inum, struct dinode *ip) {
-	char buf[BSIZE];
-	uint bn;
-	struct dinode *dip;
+// the next chunk of [0, count) of the phase going on, if there is one
+int take_chunk(uint count, uint *from, uint *to) {
+	uint n = __atomic_fetch_add(&next_chunk, CHUNK, __ATOMIC_RELAXED);
+	if (n >= count) {
+		return 0;
+	}
+	*from = n;
+	*to = n + CHUNK < count ? n + CHUNK : count;
+	return 1;
+}
 
-	bn = IBLOCK(inum, sb);
-	rblock(bn, buf);
-	dip = (struct dinode*)buf + (inum % IPB);
-	*ip = *dip;
+uint check_bp(uint bp) {
+	return bp >= nmeta && bp < sb.size;
 }
 
-void rdirent(uint ent, void *buf, struct dirent *ep) {
-	struct dirent *dep;
-	dep = (struct dirent*)buf + ent;
-	*ep = *dep;
+// where block bp is in the image (in 64 bits: images can be over 4 GB)
+void *block(uint bp) {
+	return img + (size_t) bp * BSIZE;
 }
 
-uint bmapval(uint num) {
-	uint blk, bit;
-	uchar byte;
-	uchar buf[BSIZE];
-	blk = (num / 8) / BSIZE;
-	bit = num - (BSIZE * 8 * blk);
-	rblock(blk + bmapstart, buf);
-	byte = buf[bit/8];
-	uint retval = (byte >> (bit%8)) & 0x1;
-	return retval;
+void error(int phase, uint where, const char *msg) {
+	pthread_mutex_lock(&err_lock);
+	if (nerrs == maxerrs) {
+		maxerrs = maxerrs ? 2 * maxerrs : 64;
+		errs = realloc(errs, maxerrs * sizeof(err_t));
+		if (errs == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	errs[nerrs].phase = phase;
+	errs[nerrs].where = where;
+	errs[nerrs].msg = msg;
+	nerrs++;
+	pthread_mutex_unlock(&err_lock);
 }
 
-uint check_bp(uint bp) {
-	return bp >= nmeta && bp < sb.nblocks;
+int by_order(const void *a, const void *b) {
+	const err_t *x = a, *y = b;
+	if (x->phase != y->phase) {
+		return x->phase - y->phase;
+	}
+	if (x->where != y->where) {
+		return x->where < y->where ? -1 : 1;
+	}
+	return strcmp(x->msg, y->msg);
 }
-	
 
+void *xmalloc(size_t size) {
+	void *p = malloc(size);
+	if (p == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
@@ -0,0 +1,320 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "ufs.h"
+
+//
+// How it works:
+// - The pinned blocks are one array (meta), with a dirty flag per block.
+// - The cached blocks are slots on a doubly-linked LRU list (most recent
+//   at the head), found through a chained hash table on block number.
+//   A miss takes the slot at the tail, writing it out first in the rare
+//   case it is dirty (the fsync at commit time still covers it).
+// - Every block that is marked dirty is also put on a dirty list, so a
+//   commit does not have to look at anything else: it sorts the list,
+//   and writes each run of consecutive blocks with one pwritev.
+// - The cache's own state is under one lock, so blocks can be looked up
+//   from more than one thread at a time (and bcache_read() copies out of
+//   a slot before letting go of it, so the slot cannot be taken for
+//   another block halfway through). Changing what is in a block,
+//   and writing the dirty ones out, is left to the caller to keep apart
+//   from everything else (the server does it with a rwlock).
+//
+
+#define WRITE_RUN (1024)    // blocks in one pwritev, at most (IOV_MAX)
+
+typedef struct __slot_t {
+    unsigned int block;
+    int valid;
+    int dirty;
+    char *data;
+    struct __slot_t *prev, *next;   // LRU list
+    struct __slot_t *hash_next;
+} slot_t;
+
+static int image_fd;
+
+static char *meta;
+static char *meta_dirty;
+static int num_meta;
+
+static slot_t *slots;
+static slot_t **hash;
+static unsigned int hash_mask;
+static slot_t *lru_head, *lru_tail;
+
+static unsigned int *dirty_list;
+static int num_dirty, max_dirty;
+
+static bcache_stats_t stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    return p;
+}
+
+static unsigned int hash_of(unsigned int block) {
+    return (block * 2654435761u) & hash_mask;
+}
+
+static void lru_unlink(slot_t *s) {
+    if (s->prev)
+	s->prev->next = s->next;
+    else
+	lru_head = s->next;
+    if (s->next)
+	s->next->prev = s->prev;
+    else
+	lru_tail = s->prev;
+}
+
+static void lru_push(slot_t *s) {
+    s->prev = NULL;
+    s->next = lru_head;
+    if (lru_head)
+	lru_head->prev = s;
+    lru_head = s;
+    if (lru_tail == NULL)
+	lru_tail = s;
+}
+
+static void hash_remove(slot_t *s) {
+    slot_t **p = &hash[hash_of(s->block)];
+    while (*p != s)
+	p = &(*p)->hash_next;
+    *p = s->hash_next;
+}
+
+static slot_t *lookup(unsigned int block) {
+    slot_t *s;
+    for (s = hash[hash_of(block)]; s != NULL; s = s->hash_next)
+	if (s->block == block)
+	    return s;
+    return NULL;
+}
+
+int bcache_init(int fd, int meta_blocks, int cache_blocks) {
+    image_fd = fd;
+    num_meta = meta_blocks;
+    meta = xmalloc((size_t) meta_blocks * UFS_BLOCK_SIZE);
+    meta_dirty = xmalloc(meta_blocks);
+    memset(meta_dirty, 0, meta_blocks);
+    size_t len = (size_t) meta_blocks * UFS_BLOCK_SIZE, done = 0;
+    while (done < len) {
+	ssize_t rc = pread(fd, meta + done, len - done, done);
+	if (rc <= 0)
+	    return -1;
+	done += rc;
+	stats.reads++;
+    }
+
+    if (cache_blocks < BCACHE_MIN)
+	cache_blocks = BCACHE_MIN;
+    unsigned int buckets = 1;
+    while (buckets < 2 * (unsigned int) cache_blocks)
+	buckets <<= 1;
+    hash_mask = buckets - 1;
+    hash = xmalloc(buckets * sizeof(slot_t *));
+    memset(hash, 0, buckets * sizeof(slot_t *));
+    slots = xmalloc(cache_blocks * sizeof(slot_t));
+    memset(slots, 0, cache_blocks * sizeof(slot_t));
+    char *data = xmalloc((size_t) cache_blocks * UFS_BLOCK_SIZE);
+    int i;
+    for (i = 0; i < cache_blocks; i++) {
+	slots[i].data = data + (size_t) i * UFS_BLOCK_SIZE;
+	lru_push(&slots[i]);
+    }
+
+    max_dirty = 64;
+    dirty_list = xmalloc(max_dirty * sizeof(unsigned int));
+    return 0;
+}
+
+static int write_block(unsigned int block, char *data) {
+    stats.writes++;
+    return pwrite(image_fd, data, UFS_BLOCK_SIZE, (off_t) block * UFS_BLOCK_SIZE) == UFS_BLOCK_SIZE ? 0 : -1;
+}
+
+// finds block in the cache, or takes the least recently used slot for it
+static slot_t *slot_for(unsigned int block, int *found) {
+    slot_t *s = lookup(block);
+    *found = s != NULL;
+    if (s == NULL) {
+	s = lru_tail;
+	if (s->valid) {
+	    if (s->dirty && write_block(s->block, s->data) < 0)
+		perror("write");
+	    hash_remove(s);
+	}
+	s->block = block;
+	s->valid = 1;
+	s->dirty = 0;
+	s->hash_next = hash[hash_of(block)];
+	hash[hash_of(block)] = s;
+    }
+    lru_unlink(s);
+    lru_push(s);
+    return s;
+}
+
+// the slot holding block, read in if it was not; call with the lock held
+static slot_t *slot_in(unsigned int block) {
+    int found;
+    slot_t *s = slot_for(block, &found);
+    if (found) {
+	stats.hits++;
+    } else {
+	stats.misses++;
+	stats.reads++;
+	if (pread(image_fd, s->data, UFS_BLOCK_SIZE, (off_t) block * UFS_BLOCK_SIZE) != UFS_BLOCK_SIZE)
+	    memset(s->data, 0, UFS_BLOCK_SIZE);
+    }
+    return s;
+}
+
+void *bcache_get(unsigned int block) {
+    if (block < num_meta)
+	return meta + (size_t) block * UFS_BLOCK_SIZE;
+    pthread_mutex_lock(&lock);
+    slot_t *s = slot_in(block);
+    pthread_mutex_unlock(&lock);
+    return s->data;
+}
+
+void bcache_read(unsigned int block, void *buf, int offset, int len) {
+    if (block < num_meta) {
+	memcpy(buf, meta + (size_t) block * UFS_BLOCK_SIZE + offset, len);
+	return;
+    }
+    pthread_mutex_lock(&lock);
+    slot_t *s = slot_in(block);
+    memcpy(buf, s->data + offset, len);
+    pthread_mutex_unlock(&lock);
+}
+
+void *bcache_zero(unsigned int block) {
+    if (block < num_meta) {
+	memset(meta + (size_t) block * UFS_BLOCK_SIZE, 0, UFS_BLOCK_SIZE);
+	return meta + (size_t) block * UFS_BLOCK_SIZE;
+    }
+    int found;
+    pthread_mutex_lock(&lock);
+    slot_t *s = slot_for(block, &found);
+    memset(s->data, 0, UFS_BLOCK_SIZE);
+    pthread_mutex_unlock(&lock);
+    return s->data;
+}
+
+void bcache_dirty(unsigned int block) {
+    pthread_mutex_lock(&lock);
+    int was_dirty;
+    if (block < num_meta) {
+	was_dirty = meta_dirty[block];
+	meta_dirty[block] = 1;
+    } else {
+	slot_t *s = lookup(block);
+	assert(s != NULL);
+	was_dirty = s->dirty;
+	s->dirty = 1;
+    }
+    if (!was_dirty) {
+	if (num_dirty == max_dirty) {
+	    max_dirty *= 2;
+	    dirty_list = realloc(dirty_list, max_dirty * sizeof(unsigned int));
+	    assert(dirty_list != NULL);
+	}
+	dirty_list[num_dirty++] = block;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static int by_block(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+    return x < y ? -1 : x > y;
+}
+
+static char *data_of(unsigned int block) {
+    if (block < num_meta)
+	return meta + (size_t) block * UFS_BLOCK_SIZE;
+    slot_t *s = lookup(block);
+    // written out early by slot_for(); nothing left to do for it
+    return s != NULL && s->dirty ? s->data : NULL;
+}
+
+static void clean(unsigned int block) {
+    if (block < num_meta) {
+	meta_dirty[block] = 0;
+    } else {
+	slot_t *s = lookup(block);
+	if (s != NULL)
+	    s->dirty = 0;
+    }
+}
+
+int bcache_write_back() {
+    pthread_mutex_lock(&lock);
+    if (num_dirty == 0) {
+	pthread_mutex_unlock(&lock);
+	return 0;
+    }
+    qsort(dirty_list, num_dirty, sizeof(unsigned int), by_block);
+    int rc = 0, i = 0;
+    while (i < num_dirty) {
+	struct iovec iov[WRITE_RUN];
+	unsigned int first = dirty_list[i];
+	int n = 0;
+	while (i < num_dirty && n < WRITE_RUN && dirty_list[i] == first + n) {
+	    char *data = data_of(dirty_list[i]);
+	    if (data == NULL)
+		break;
+	    iov[n].iov_base = data;
+	    iov[n].iov_len = UFS_BLOCK_SIZE;
+	    clean(dirty_list[i]);
+	    n++, i++;
+	}
+	if (n == 0) {
+	    i++;
+	    continue;
+	}
+	stats.writes++;
+	if (pwritev(image_fd, iov, n, (off_t) first * UFS_BLOCK_SIZE) != (ssize_t) n * UFS_BLOCK_SIZE)
+	    rc = -1;
+    }
+    num_dirty = 0;
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+int bcache_sync() {
+    pthread_mutex_lock(&lock);
+    stats.syncs++;
+    pthread_mutex_unlock(&lock);
+    return fsync(image_fd);
+}
+
+int bcache_commit() {
+    pthread_mutex_lock(&lock);
+    int dirty = num_dirty > 0;
+    pthread_mutex_unlock(&lock);
+    if (!dirty)
+	return 0;
+    int rc = bcache_write_back();
+    return bcache_sync() < 0 ? -1 : rc;
+}
+
+void bcache_stats(bcache_stats_t *s) {
+    pthread_mutex_lock(&lock);
+    *s = stats;
+    pthread_mutex_unlock(&lock);
+}
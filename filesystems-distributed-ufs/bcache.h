@@ -0,0 +1,46 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+//
+// The server's view of the image, a block at a time.
+//
+// The first meta_blocks blocks (super block, bitmaps and inode table)
+// are read in once and stay in memory for good. Every other block goes
+// through an LRU cache of cache_blocks blocks. A block that is changed is
+// marked with bcache_dirty(), and stays in memory until bcache_commit()
+// writes all of the dirty blocks out (contiguous ones with a single
+// pwritev) and fsyncs the image once; the server does that at the end of
+// each operation that changed something, before it replies. That is
+// bcache_write_back() and then bcache_sync(), which can also be called
+// on their own, to let more than one operation share an fsync.
+//
+// A pointer from bcache_get() or bcache_zero() stays good until another
+// BCACHE_MIN blocks have been brought in; no operation comes close to
+// touching that many. That only holds while nothing else brings blocks
+// in, though, so it is for an operation that has the cache to itself (in
+// the server, one that changes the image). Operations running alongside
+// others use bcache_read() instead, which copies len bytes from offset
+// in the block into buf while no other thread can take its slot.
+//
+
+#define BCACHE_MIN (64)
+
+typedef struct {
+    long hits;
+    long misses;
+    long reads;         // preads
+    long writes;        // pwrite(v)s
+    long syncs;         // fsyncs
+} bcache_stats_t;
+
+int bcache_init(int fd, int meta_blocks, int cache_blocks);
+void *bcache_get(unsigned int block);
+void *bcache_zero(unsigned int block);
+void bcache_read(unsigned int block, void *buf, int offset, int len);
+void bcache_dirty(unsigned int block);
+int bcache_write_back();
+int bcache_sync();
+int bcache_commit();
+void bcache_stats(bcache_stats_t *stats);
+
+#endif // __BCACHE_H__
@@ -0,0 +1,236 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mfs.h"
+
+//
+// Times MFS calls against a server of its own:
+//
+// prompt> bench [-n <ops>] [-p <port>] [-a] <file-system-image>
+//
+// There are four phases, each of ops calls: creat (of files spread over
+// directories it makes for them, DIR_FILES to a directory), lookup (of
+// each of them), write (a block to each) and read (that block back). -a
+// makes the calls with the asynchronous API, MFS_WINDOW at a time, and
+// not one by one.
+//
+// Each phase has a server to itself (./server, or $UFS_SERVER), started
+// with UFS_STATS set and shut down after, so what it says it did (the
+// requests, and the reads, writes and fsyncs of the image: the system
+// calls that cost) is for that phase alone; that goes out with the calls
+// per second. The image is left with the files in it.
+//
+
+#define DIR_FILES (1000)
+
+typedef struct {
+    char *name;
+    int (*call)(int i);
+    int (*start)(int i);
+} phase_t;
+
+static int ops = 2000, port = 12000, async;
+static char *image;
+static int *dirs, *files;
+static char block[MFS_BLOCK_SIZE], got[MFS_BLOCK_SIZE];
+static pid_t server;
+static FILE *server_err;
+static int failed;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: bench [-n <ops>] [-p <port>] [-a] <file-system-image>\n");
+    exit(1);
+}
+
+static void start_server() {
+    int fds[2];
+    if (pipe(fds) < 0) {
+	perror("pipe");
+	exit(1);
+    }
+    if ((server = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (server == 0) {
+	char port_s[16], *path = getenv("UFS_SERVER") ? getenv("UFS_SERVER") : "./server";
+	sprintf(port_s, "%d", port);
+	setenv("UFS_STATS", "1", 1);
+	dup2(fds[1], 2);
+	close(fds[0]);
+	execl(path, path, port_s, image, (char *) NULL);
+	perror(path);
+	exit(1);
+    }
+    close(fds[1]);
+    server_err = fdopen(fds[0], "r");
+    // (time for it to be listening; anything sent before then is only
+    // sent again after a timeout)
+    usleep(200 * 1000);
+    if (MFS_Init("localhost", port) < 0) {
+	fprintf(stderr, "bench: MFS_Init failed\n");
+	exit(1);
+    }
+}
+
+// shuts the server down, and gives back the numbers it printed
+static int stop_server(long *stats) {
+    MFS_Shutdown();
+    char line[256];
+    int found = 0;
+    while (fgets(line, sizeof(line), server_err))
+	if (sscanf(line, "requests %ld: cache hits %ld misses %ld, reads %ld writes %ld fsyncs %ld",
+		   &stats[0], &stats[1], &stats[2], &stats[3], &stats[4], &stats[5]) == 6)
+	    found = 1;
+    fclose(server_err);
+    waitpid(server, NULL, 0);
+    return found;
+}
+
+static void file_name(int i, char *name) {
+    sprintf(name, "f%d", i);
+}
+
+static int creat_call(int i) {
+    char name[28];
+    file_name(i, name);
+    return MFS_Creat(dirs[i / DIR_FILES], MFS_REGULAR_FILE, name);
+}
+
+static int lookup_call(int i) {
+    char name[28];
+    file_name(i, name);
+    return (files[i] = MFS_Lookup(dirs[i / DIR_FILES], name)) < 0 ? -1 : 0;
+}
+
+static int write_call(int i) {
+    return MFS_Write(files[i], block, 0, MFS_BLOCK_SIZE);
+}
+
+static int read_call(int i) {
+    return MFS_Read(files[i], got, 0, MFS_BLOCK_SIZE);
+}
+
+static void done(int id, int rc, void *arg) {
+    if (rc < 0)
+	failed++;
+}
+
+static void lookup_done(int id, int rc, void *arg) {
+    int i = (int) (long) arg;
+    files[i] = rc;
+    done(id, rc, arg);
+}
+
+static int creat_start(int i) {
+    char name[28];
+    file_name(i, name);
+    return MFS_CreatAsync(dirs[i / DIR_FILES], MFS_REGULAR_FILE, name, done, NULL);
+}
+
+static int lookup_start(int i) {
+    char name[28];
+    file_name(i, name);
+    return MFS_LookupAsync(dirs[i / DIR_FILES], name, lookup_done, (void *) (long) i);
+}
+
+static int write_start(int i) {
+    return MFS_WriteAsync(files[i], block, 0, MFS_BLOCK_SIZE, done, NULL);
+}
+
+static int read_start(int i) {
+    // (every read is into the same buffer; only whether it worked counts)
+    return MFS_ReadAsync(files[i], got, 0, MFS_BLOCK_SIZE, done, NULL);
+}
+
+static phase_t phases[] = {
+    { "creat", creat_call, creat_start },
+    { "lookup", lookup_call, lookup_start },
+    { "write", write_call, write_start },
+    { "read", read_call, read_start },
+};
+
+int main(int argc, char *argv[]) {
+    int ch;
+    while ((ch = getopt(argc, argv, "n:p:a")) != -1) {
+	switch (ch) {
+	case 'n':
+	    ops = atoi(optarg);
+	    break;
+	case 'p':
+	    port = atoi(optarg);
+	    break;
+	case 'a':
+	    async = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1 || ops < 1)
+	usage();
+    image = argv[optind];
+    signal(SIGPIPE, SIG_IGN);
+
+    int ndirs = (ops + DIR_FILES - 1) / DIR_FILES, i;
+    dirs = malloc(ndirs * sizeof(int));
+    files = malloc(ops * sizeof(int));
+    if (dirs == NULL || files == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    memset(block, 'b', sizeof(block));
+
+    // somewhere of its own for the files
+    start_server();
+    char name[28];
+    sprintf(name, "bench%d", getpid());
+    int top = -1;
+    if (MFS_Creat(0, MFS_DIRECTORY, name) == 0)
+	top = MFS_Lookup(0, name);
+    for (i = 0; i < ndirs && top >= 0; i++) {
+	sprintf(name, "d%d", i);
+	if (MFS_Creat(top, MFS_DIRECTORY, name) < 0 || (dirs[i] = MFS_Lookup(top, name)) < 0)
+	    top = -1;
+    }
+    long stats[6];
+    stop_server(stats);
+    if (top < 0) {
+	fprintf(stderr, "bench: could not make directories (a bigger image?)\n");
+	exit(1);
+    }
+
+    int p;
+    for (p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+	start_server();
+	failed = 0;
+	double t = now();
+	for (i = 0; i < ops; i++) {
+	    if (async ? phases[p].start(i) < 0 : phases[p].call(i) < 0)
+		failed++;
+	}
+	while (async && MFS_Poll(-1) > 0)
+	    ;
+	t = now() - t;
+	int have_stats = stop_server(stats);
+	printf("%-7s %d ops in %.3f s: %.0f ops/s", phases[p].name, ops, t, ops / t);
+	if (have_stats)
+	    printf("; server: %ld requests, %ld reads %ld writes %ld fsyncs",
+		   stats[0], stats[3], stats[4], stats[5]);
+	if (failed)
+	    printf(" (%d failed)", failed);
+	printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirindex.h"
+
+//
+// How it works:
+// - The names are an open-addressing hash table of (hash, slot) pairs,
+//   probed linearly, and kept no more than half full. Removing one
+//   shifts back the pairs after it that would have been in its place,
+//   so there are no tombstones to skip over.
+// - The free slots are a binary min-heap.
+//
+
+typedef struct {
+    unsigned int hash;
+    int slot;           // -1: empty
+} pair_t;
+
+struct __dindex_t {
+    pair_t *pairs;
+    int capacity;       // a power of two
+    int count;
+    int *heap;
+    int heap_count, heap_capacity;
+};
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    return p;
+}
+
+static void pairs_init(dindex_t *d, int capacity) {
+    d->pairs = xmalloc(capacity * sizeof(pair_t));
+    d->capacity = capacity;
+    d->count = 0;
+    int i;
+    for (i = 0; i < capacity; i++)
+	d->pairs[i].slot = -1;
+}
+
+dindex_t *dindex_new() {
+    dindex_t *d = xmalloc(sizeof(dindex_t));
+    pairs_init(d, 64);
+    d->heap_capacity = 64;
+    d->heap = xmalloc(d->heap_capacity * sizeof(int));
+    d->heap_count = 0;
+    return d;
+}
+
+void dindex_free(dindex_t *d) {
+    if (d == NULL)
+	return;
+    free(d->pairs);
+    free(d->heap);
+    free(d);
+}
+
+unsigned int dindex_hash(char *name) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < 28 && name[i] != '\0'; i++)
+	h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h;
+}
+
+static void insert(dindex_t *d, unsigned int hash, int slot) {
+    unsigned int mask = d->capacity - 1, i = hash & mask;
+    while (d->pairs[i].slot != -1)
+	i = (i + 1) & mask;
+    d->pairs[i].hash = hash;
+    d->pairs[i].slot = slot;
+    d->count++;
+}
+
+void dindex_add(dindex_t *d, unsigned int hash, int slot) {
+    if (2 * (d->count + 1) > d->capacity) {
+	pair_t *old = d->pairs;
+	int i, capacity = d->capacity;
+	pairs_init(d, 2 * capacity);
+	for (i = 0; i < capacity; i++)
+	    if (old[i].slot != -1)
+		insert(d, old[i].hash, old[i].slot);
+	free(old);
+    }
+    insert(d, hash, slot);
+}
+
+void dindex_remove(dindex_t *d, unsigned int hash, int slot) {
+    unsigned int mask = d->capacity - 1, i = hash & mask;
+    while (d->pairs[i].slot != slot) {
+	if (d->pairs[i].slot == -1)
+	    return;
+	i = (i + 1) & mask;
+    }
+    d->pairs[i].slot = -1;
+    d->count--;
+    // shift back whatever after it was pushed along past i
+    unsigned int j = i;
+    while (1) {
+	j = (j + 1) & mask;
+	if (d->pairs[j].slot == -1)
+	    return;
+	unsigned int home = d->pairs[j].hash & mask;
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	    d->pairs[i] = d->pairs[j];
+	    d->pairs[j].slot = -1;
+	    i = j;
+	}
+    }
+}
+
+int dindex_find(dindex_t *d, unsigned int hash, int (*match)(int slot, void *arg), void *arg) {
+    unsigned int mask = d->capacity - 1, i = hash & mask;
+    for (; d->pairs[i].slot != -1; i = (i + 1) & mask)
+	if (d->pairs[i].hash == hash && match(d->pairs[i].slot, arg))
+	    return d->pairs[i].slot;
+    return -1;
+}
+
+void dindex_put_free(dindex_t *d, int slot) {
+    if (d->heap_count == d->heap_capacity) {
+	d->heap_capacity *= 2;
+	d->heap = realloc(d->heap, d->heap_capacity * sizeof(int));
+	if (d->heap == NULL) {
+	    perror("realloc");
+	    exit(1);
+	}
+    }
+    int i = d->heap_count++;
+    while (i > 0 && d->heap[(i - 1) / 2] > slot) {
+	d->heap[i] = d->heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    d->heap[i] = slot;
+}
+
+int dindex_peek_free(dindex_t *d) {
+    return d->heap_count == 0 ? -1 : d->heap[0];
+}
+
+int dindex_take_free(dindex_t *d) {
+    if (d->heap_count == 0)
+	return -1;
+    int top = d->heap[0], last = d->heap[--d->heap_count], i = 0;
+    while (1) {
+	int c = 2 * i + 1;
+	if (c >= d->heap_count)
+	    break;
+	if (c + 1 < d->heap_count && d->heap[c + 1] < d->heap[c])
+	    c++;
+	if (d->heap[c] >= last)
+	    break;
+	d->heap[i] = d->heap[c];
+	i = c;
+    }
+    d->heap[i] = last;
+    return top;
+}
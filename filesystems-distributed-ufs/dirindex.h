@@ -0,0 +1,29 @@
+#ifndef __DIRINDEX_H__
+#define __DIRINDEX_H__
+
+//
+// An in-memory index of one directory: which slot (entry number) each
+// name is in, and which slots are free, for fs.c to find both without
+// going through the directory's blocks.
+//
+// Names are only known by their hash here; dindex_find() gives back
+// each slot with the hash asked for, and it is up to match() to say if
+// the name there is the one being looked for. Free slots come back
+// lowest first, so a directory fills up from the front, as it does
+// without an index (dindex_peek_free() says which that will be, without
+// taking it); either gives -1 if there are none.
+//
+
+typedef struct __dindex_t dindex_t;
+
+dindex_t *dindex_new();
+void dindex_free(dindex_t *d);
+unsigned int dindex_hash(char *name);
+void dindex_add(dindex_t *d, unsigned int hash, int slot);
+void dindex_remove(dindex_t *d, unsigned int hash, int slot);
+int dindex_find(dindex_t *d, unsigned int hash, int (*match)(int slot, void *arg), void *arg);
+void dindex_put_free(dindex_t *d, int slot);
+int dindex_peek_free(dindex_t *d);
+int dindex_take_free(dindex_t *d);
+
+#endif // __DIRINDEX_H__
@@ -0,0 +1,473 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "dirindex.h"
+#include "fs.h"
+#include "ufs.h"
+
+//
+// How it works:
+// - The super block, both bitmaps and the inode table are pinned in the
+//   block cache, so they are used where they sit; changing an inode or a
+//   bit only has to mark the block it lives in dirty.
+// - Bitmaps keep the on-disk convention: unit n is bit 31 - n % 32 of
+//   word n / 32 (so unit 0 is 0x1 << 31). Each keeps a count of its free
+//   units too, so an operation can tell up front whether it will fit,
+//   and never has to undo half of itself.
+// - Allocating looks for a free unit a word at a time, from a cursor
+//   below which nothing is free. A data block can be asked for near
+//   another (a hint): it goes in the first free one after there if there
+//   is one, so a file written in order lies in order on disk.
+// - Data block addresses in an inode are absolute; -1 is an unused
+//   pointer, and a hole in a file (a pointer never written) reads as
+//   zeroes.
+// - Every inode has a version (in memory only), bumped whenever it or
+//   what it holds changes, so clients can tell whether what they cached
+//   of it is still good; see mcache.c.
+// - A directory is found by name through an index of it (see dirindex.c),
+//   made the first time it is needed by going through the directory once,
+//   and kept up to date by fs_creat() and fs_unlink() from then on. As a
+//   lookup can be the one to make it, with other lookups going on, the
+//   indexes are under a lock of their own (index_lock); fs_creat() and
+//   fs_unlink() run with the file system to themselves, so do not need it.
+// - For the same reason, whatever runs alongside other operations (reads
+//   and lookups) copies what it needs out of cached blocks with
+//   bcache_read(); only the operations that have the file system to
+//   themselves hold on to pointers into the cache.
+//
+
+#define INODES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(inode_t))
+#define ENTRIES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+#define BITS_PER_BLOCK (UFS_BLOCK_SIZE * 8)
+#define MAX_FILE_SIZE (DIRECT_PTRS * UFS_BLOCK_SIZE)
+#define NO_BLOCK ((unsigned int) -1)
+
+typedef struct {
+    unsigned int *bits;
+    int addr;           // of its first block
+    int count;          // units
+    int free;
+    int next;           // nothing before it is free
+} bitmap_t;
+
+static super_t *s;
+static inode_t *inodes;
+static bitmap_t inode_map, data_map;
+static unsigned int *versions;
+static dindex_t **indexes;      // by inode, NULL until made
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int bit_get(bitmap_t *m, int n) {
+    return (m->bits[n / 32] >> (31 - n % 32)) & 1;
+}
+
+static void bit_put(bitmap_t *m, int n, int v) {
+    if (v)
+	m->bits[n / 32] |= 0x1u << (31 - n % 32);
+    else
+	m->bits[n / 32] &= ~(0x1u << (31 - n % 32));
+    m->free += v ? -1 : 1;
+    if (!v && n < m->next)
+	m->next = n;
+    bcache_dirty(m->addr + n / BITS_PER_BLOCK);
+}
+
+// the free units of word w, as set bits (units past the end are not)
+static unsigned int free_bits(bitmap_t *m, int w) {
+    unsigned int f = ~m->bits[w];
+    if (w == m->count / 32)
+	f &= ~(0xffffffffu >> (m->count % 32));
+    return f;
+}
+
+// the first free unit from n on, or -1
+static int bit_find(bitmap_t *m, int n) {
+    if (n < 0 || n >= m->count)
+	return -1;
+    int w = n / 32, words = (m->count + 31) / 32;
+    unsigned int f = free_bits(m, w) & (0xffffffffu >> (n % 32));
+    while (f == 0) {
+	if (++w == words)
+	    return -1;
+	f = free_bits(m, w);
+    }
+    // unit 0 of a word is its top bit
+    return w * 32 + __builtin_clz(f);
+}
+
+// a free unit, the first after hint if there is one (hint < 0: none)
+static int bit_alloc(bitmap_t *m, int hint) {
+    int n = hint >= m->next ? bit_find(m, hint) : -1;
+    if (n < 0)
+	n = bit_find(m, m->next);
+    if (n < 0)
+	return -1;
+    bit_put(m, n, 1);
+    if (n == m->next)
+	m->next = n + 1;
+    return n;
+}
+
+static void bitmap_init(bitmap_t *m, int addr, int count) {
+    m->bits = bcache_get(addr);
+    m->addr = addr;
+    m->count = count;
+    m->free = 0;
+    int w;
+    for (w = 0; w < (count + 31) / 32; w++)
+	m->free += __builtin_popcount(free_bits(m, w));
+    m->next = 0;
+}
+
+static int inode_valid(int inum) {
+    return inum >= 0 && inum < s->num_inodes && bit_get(&inode_map, inum);
+}
+
+static void inode_dirty(int inum) {
+    bcache_dirty(s->inode_region_addr + inum / INODES_PER_BLOCK);
+}
+
+// a free data block, near after block near if can be (NO_BLOCK: anywhere)
+static unsigned int block_alloc(unsigned int near) {
+    int hint = near == NO_BLOCK ? -1 : (int) (near - s->data_region_addr) + 1;
+    int n = bit_alloc(&data_map, hint);
+    return n < 0 ? NO_BLOCK : s->data_region_addr + n;
+}
+
+// what to put block b of inode in near: the block before it in the file
+static unsigned int block_before(inode_t *in, int b) {
+    while (--b >= 0)
+	if (in->direct[b] != NO_BLOCK)
+	    return in->direct[b];
+    return NO_BLOCK;
+}
+
+static void block_free(unsigned int block) {
+    bit_put(&data_map, block - s->data_region_addr, 0);
+}
+
+// a fresh, empty directory block
+static void dir_block_init(unsigned int block) {
+    dir_ent_t *e = bcache_zero(block);
+    int i;
+    for (i = 0; i < ENTRIES_PER_BLOCK; i++)
+	e[i].inum = -1;
+    bcache_dirty(block);
+}
+
+int fs_init(char *image) {
+    int fd = open(image, O_RDWR);
+    if (fd < 0)
+	return -1;
+    super_t super;
+    if (pread(fd, &super, sizeof(super), 0) != sizeof(super))
+	return -1;
+    char *env = getenv("UFS_CACHE_BLOCKS");
+    int cache = env ? atoi(env) : 1024;
+    if (bcache_init(fd, super.data_region_addr, cache) < 0)
+	return -1;
+    s = bcache_get(0);
+    inodes = bcache_get(s->inode_region_addr);
+    bitmap_init(&inode_map, s->inode_bitmap_addr, s->num_inodes);
+    bitmap_init(&data_map, s->data_bitmap_addr, s->num_data);
+    versions = malloc(s->num_inodes * sizeof(unsigned int));
+    if (versions == NULL)
+	return -1;
+    int i;
+    for (i = 0; i < s->num_inodes; i++)
+	versions[i] = 1;
+    indexes = calloc(s->num_inodes, sizeof(dindex_t *));
+    if (indexes == NULL)
+	return -1;
+    return 0;
+}
+
+unsigned int fs_version(int inum) {
+    return inum >= 0 && inum < s->num_inodes ? versions[inum] : 0;
+}
+
+int fs_commit() {
+    return bcache_commit();
+}
+
+int fs_write_back() {
+    return bcache_write_back();
+}
+
+int fs_sync() {
+    return bcache_sync();
+}
+
+static dir_ent_t *dir_entry(inode_t *dir, int slot) {
+    return (dir_ent_t *) bcache_get(dir->direct[slot / ENTRIES_PER_BLOCK]) + slot % ENTRIES_PER_BLOCK;
+}
+
+// a copy of a directory entry, for use alongside other operations
+static void dir_entry_read(inode_t *dir, int slot, dir_ent_t *e) {
+    int offset = slot % ENTRIES_PER_BLOCK * sizeof(dir_ent_t);
+    bcache_read(dir->direct[slot / ENTRIES_PER_BLOCK], e, offset, sizeof(dir_ent_t));
+}
+
+// the index of directory pinum, made now if it has not been
+static dindex_t *dir_index(int pinum) {
+    if (indexes[pinum] != NULL)
+	return indexes[pinum];
+    inode_t *dir = &inodes[pinum];
+    dindex_t *d = dindex_new();
+    int n = dir->size / sizeof(dir_ent_t), b, i;
+    for (b = 0; b < DIRECT_PTRS; b++) {
+	if (dir->direct[b] == NO_BLOCK)
+	    continue;
+	dir_ent_t e[ENTRIES_PER_BLOCK];
+	bcache_read(dir->direct[b], e, 0, UFS_BLOCK_SIZE);
+	for (i = 0; i < ENTRIES_PER_BLOCK; i++) {
+	    int slot = b * ENTRIES_PER_BLOCK + i;
+	    if (e[i].inum == -1)
+		dindex_put_free(d, slot);
+	    else if (slot < n)
+		dindex_add(d, dindex_hash(e[i].name), slot);
+	}
+    }
+    indexes[pinum] = d;
+    return d;
+}
+
+typedef struct {
+    inode_t *dir;
+    char *name;
+} name_t;
+
+static int name_matches(int slot, void *arg) {
+    name_t *n = arg;
+    dir_ent_t e;
+    dir_entry_read(n->dir, slot, &e);
+    return strncmp(e.name, n->name, sizeof(e.name)) == 0;
+}
+
+// finds name in directory pinum; returns the slot number of its entry
+static int dir_find(int pinum, char *name) {
+    name_t n = { &inodes[pinum], name };
+    return dindex_find(dir_index(pinum), dindex_hash(name), name_matches, &n);
+}
+
+int fs_lookup(int pinum, char *name) {
+    if (!inode_valid(pinum) || inodes[pinum].type != UFS_DIRECTORY)
+	return -1;
+    pthread_mutex_lock(&index_lock);
+    int slot = dir_find(pinum, name);
+    pthread_mutex_unlock(&index_lock);
+    if (slot < 0)
+	return -1;
+    dir_ent_t e;
+    dir_entry_read(&inodes[pinum], slot, &e);
+    return e.inum;
+}
+
+int fs_stat(int inum, MFS_Stat_t *m) {
+    if (!inode_valid(inum))
+	return -1;
+    m->type = inodes[inum].type;
+    m->size = inodes[inum].size;
+    return 0;
+}
+
+// any part of a file, up to all of it (fs_write() and fs_read() stick to
+// a block's worth)
+static int write_range(int inum, char *buffer, int offset, int nbytes) {
+    if (!inode_valid(inum) || inodes[inum].type != UFS_REGULAR_FILE)
+	return -1;
+    if (nbytes < 0 || offset < 0 || offset > MAX_FILE_SIZE - nbytes)
+	return -1;
+    inode_t *in = &inodes[inum];
+    int first = offset / UFS_BLOCK_SIZE, last = (offset + nbytes - 1) / UFS_BLOCK_SIZE, b, need = 0;
+    if (nbytes == 0)
+	return 0;
+    for (b = first; b <= last; b++)
+	need += in->direct[b] == NO_BLOCK;
+    if (need > data_map.free)
+	return -1;
+
+    int done = 0;
+    for (b = first; b <= last; b++) {
+	char *data;
+	if (in->direct[b] == NO_BLOCK) {
+	    in->direct[b] = block_alloc(block_before(in, b));
+	    data = bcache_zero(in->direct[b]);
+	} else {
+	    data = bcache_get(in->direct[b]);
+	}
+	int from = b == first ? offset % UFS_BLOCK_SIZE : 0;
+	int n = UFS_BLOCK_SIZE - from;
+	if (n > nbytes - done)
+	    n = nbytes - done;
+	memcpy(data + from, buffer + done, n);
+	bcache_dirty(in->direct[b]);
+	done += n;
+    }
+    if (offset + nbytes > in->size)
+	in->size = offset + nbytes;
+    inode_dirty(inum);
+    versions[inum]++;
+    return 0;
+}
+
+static int read_range(int inum, char *buffer, int offset, int nbytes) {
+    if (!inode_valid(inum))
+	return -1;
+    inode_t *in = &inodes[inum];
+    if (nbytes < 0 || offset < 0 || offset > in->size - nbytes)
+	return -1;
+    int done = 0;
+    while (done < nbytes) {
+	int b = (offset + done) / UFS_BLOCK_SIZE, from = (offset + done) % UFS_BLOCK_SIZE;
+	int n = UFS_BLOCK_SIZE - from;
+	if (n > nbytes - done)
+	    n = nbytes - done;
+	if (in->direct[b] == NO_BLOCK)
+	    memset(buffer + done, 0, n);
+	else
+	    bcache_read(in->direct[b], buffer + done, from, n);
+	done += n;
+    }
+    return 0;
+}
+
+int fs_write(int inum, char *buffer, int offset, int nbytes) {
+    return nbytes > MFS_BLOCK_SIZE ? -1 : write_range(inum, buffer, offset, nbytes);
+}
+
+int fs_read(int inum, char *buffer, int offset, int nbytes) {
+    return nbytes > MFS_BLOCK_SIZE ? -1 : read_range(inum, buffer, offset, nbytes);
+}
+
+int fs_write_bulk(int inum, char *buffer, int offset, int nbytes) {
+    return nbytes > MFS_MAX_BULK ? -1 : write_range(inum, buffer, offset, nbytes);
+}
+
+int fs_read_bulk(int inum, char *buffer, int offset, int nbytes) {
+    return nbytes > MFS_MAX_BULK ? -1 : read_range(inum, buffer, offset, nbytes);
+}
+
+int fs_creat(int pinum, int type, char *name, int *child) {
+    *child = -1;
+    if (!inode_valid(pinum) || inodes[pinum].type != UFS_DIRECTORY)
+	return -1;
+    if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE)
+	return -1;
+    if (name[0] == '\0' || strnlen(name, sizeof(((dir_ent_t *) 0)->name)) == sizeof(((dir_ent_t *) 0)->name))
+	return -1;
+    inode_t *dir = &inodes[pinum];
+    int found = dir_find(pinum, name);
+    if (found >= 0) {
+	*child = dir_entry(dir, found)->inum;
+	return 0;
+    }
+    dindex_t *d = dir_index(pinum);
+    int need = 0, b = 0;
+    if (dindex_peek_free(d) < 0) {
+	// the blocks it has are full; it takes another
+	while (b < DIRECT_PTRS && dir->direct[b] != NO_BLOCK)
+	    b++;
+	need = b < DIRECT_PTRS ? 1 : -1;
+    }
+    if (need < 0 || inode_map.free == 0 || need + (type == UFS_DIRECTORY) > data_map.free)
+	return -1;
+
+    if (need > 0) {
+	int i;
+	dir->direct[b] = block_alloc(block_before(dir, b));
+	dir_block_init(dir->direct[b]);
+	for (i = 0; i < ENTRIES_PER_BLOCK; i++)
+	    dindex_put_free(d, b * ENTRIES_PER_BLOCK + i);
+    }
+    int slot = dindex_take_free(d);
+
+    int inum = bit_alloc(&inode_map, -1), i;
+    inode_t *in = &inodes[inum];
+    in->type = type;
+    in->size = 0;
+    for (i = 0; i < DIRECT_PTRS; i++)
+	in->direct[i] = NO_BLOCK;
+    if (type == UFS_DIRECTORY) {
+	in->direct[0] = block_alloc(NO_BLOCK);
+	dir_block_init(in->direct[0]);
+	dir_ent_t *e = bcache_get(in->direct[0]);
+	strcpy(e[0].name, ".");
+	e[0].inum = inum;
+	strcpy(e[1].name, "..");
+	e[1].inum = pinum;
+	in->size = 2 * sizeof(dir_ent_t);
+    }
+    inode_dirty(inum);
+
+    dir_ent_t *e = dir_entry(dir, slot);
+    strcpy(e->name, name);
+    e->inum = inum;
+    bcache_dirty(dir->direct[slot / ENTRIES_PER_BLOCK]);
+    dindex_add(d, dindex_hash(name), slot);
+    if ((slot + 1) * sizeof(dir_ent_t) > dir->size)
+	dir->size = (slot + 1) * sizeof(dir_ent_t);
+    inode_dirty(pinum);
+    versions[pinum]++;
+    versions[inum]++;
+    *child = inum;
+    return 0;
+}
+
+static int dir_empty(inode_t *dir) {
+    int n = dir->size / sizeof(dir_ent_t), i;
+    for (i = 2; i < n; i++)
+	if (dir->direct[i / ENTRIES_PER_BLOCK] != NO_BLOCK && dir_entry(dir, i)->inum != -1)
+	    return 0;
+    return 1;
+}
+
+int fs_unlink(int pinum, char *name, int *child) {
+    *child = -1;
+    if (!inode_valid(pinum) || inodes[pinum].type != UFS_DIRECTORY)
+	return -1;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	return -1;
+    inode_t *dir = &inodes[pinum];
+    int slot = dir_find(pinum, name);
+    if (slot < 0)
+	return 0;
+    dir_ent_t *e = dir_entry(dir, slot);
+    int inum = e->inum, b;
+    inode_t *in = &inodes[inum];
+    if (in->type == UFS_DIRECTORY && !dir_empty(in))
+	return -1;
+    *child = inum;
+
+    for (b = 0; b < DIRECT_PTRS; b++)
+	if (in->direct[b] != NO_BLOCK) {
+	    block_free(in->direct[b]);
+	    in->direct[b] = NO_BLOCK;
+	}
+    in->size = 0;
+    inode_dirty(inum);
+    bit_put(&inode_map, inum, 0);
+    dindex_free(indexes[inum]);
+    indexes[inum] = NULL;
+
+    e = dir_entry(dir, slot);
+    dindex_remove(indexes[pinum], dindex_hash(e->name), slot);
+    dindex_put_free(indexes[pinum], slot);
+    e->inum = -1;
+    bcache_dirty(dir->direct[slot / ENTRIES_PER_BLOCK]);
+    if ((slot + 1) * sizeof(dir_ent_t) == dir->size) {
+	// the last entry went; the size ends at the one before it now
+	while (slot > 0 && (dir->direct[(slot - 1) / ENTRIES_PER_BLOCK] == NO_BLOCK || dir_entry(dir, slot - 1)->inum == -1))
+	    slot--;
+	dir->size = slot * sizeof(dir_ent_t);
+    }
+    inode_dirty(pinum);
+    versions[pinum]++;
+    versions[inum]++;
+    return 0;
+}
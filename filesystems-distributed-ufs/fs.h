@@ -0,0 +1,35 @@
+#ifndef __FS_H__
+#define __FS_H__
+
+#include "mfs.h"
+
+//
+// The file system itself, on top of the block cache: one routine per
+// MFS_ call, each returning what the call does (see the README). Changes
+// are left in the cache; fs_commit() puts them on disk, and is what the
+// server calls before replying to anything that changed the image. It
+// is fs_write_back() and then fs_sync(), which can be done on their own.
+//
+// Nothing here does any locking of its own (bar what fs_lookup() needs
+// among lookups): the caller keeps anything that changes the file system
+// apart from everything else.
+//
+// fs_creat() and fs_unlink() also say (in *child) which inode they made,
+// found or removed, and fs_version() gives what an inode's version is.
+//
+
+int fs_init(char *image);
+int fs_lookup(int pinum, char *name);
+int fs_stat(int inum, MFS_Stat_t *m);
+int fs_write(int inum, char *buffer, int offset, int nbytes);
+int fs_read(int inum, char *buffer, int offset, int nbytes);
+int fs_write_bulk(int inum, char *buffer, int offset, int nbytes);
+int fs_read_bulk(int inum, char *buffer, int offset, int nbytes);
+int fs_creat(int pinum, int type, char *name, int *child);
+int fs_unlink(int pinum, char *name, int *child);
+unsigned int fs_version(int inum);
+int fs_commit();
+int fs_write_back();
+int fs_sync();
+
+#endif // __FS_H__
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mcache.h"
+
+//
+// How it works:
+// - Each reply says what version the inode it is about has, and gives a
+//   lease on it (see message.h). Those are kept per inode, in nodes.
+// - Everything cached is tagged with the version of the inode it came
+//   from: a lookup with its directory's, a block with its file's. It is
+//   only used while that is still the inode's version, and the lease on
+//   the inode has not run out. So any change the server reports (to our
+//   own writes, creats and unlinks as much as anyone's) makes everything
+//   older for that inode go away on its own, with nothing to flush.
+// - Once a lease runs out, the next use of the inode has to go to the
+//   server; a stat is what MFS_Read() uses to renew it, and if the
+//   version has not moved, the blocks cached before are still good.
+//   Changes made by other clients are thus seen within lease_ms.
+// - Replies to calls made at once can come back in any order, so within
+//   an epoch a version older than the one held for an inode is stale:
+//   it only renews the lease, and what came with it is not cached.
+// - A new epoch means a new server (versions start over), and empties
+//   everything.
+// - The tables are direct-mapped: a new entry takes the place of
+//   whatever was in its slot.
+//
+
+#define NODES  (1024)
+#define NAMES  (1024)
+#define BLOCKS (256)
+
+typedef struct {
+    int inum;           // -1: empty
+    unsigned int version;
+    long expires;       // in ms
+    int have_stat;
+    MFS_Stat_t stat;
+} node_t;
+
+typedef struct {
+    int pinum;          // -1: empty
+    unsigned int version;
+    char name[28];
+    int inum;
+} name_t;
+
+typedef struct {
+    int inum;           // -1: empty
+    int block;
+    unsigned int version;
+    int len;
+    char data[MFS_BLOCK_SIZE];
+} block_t;
+
+static int enabled;
+static unsigned int epoch;
+static node_t nodes[NODES];
+static name_t names[NAMES];
+static block_t *blocks;
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void empty() {
+    int i;
+    for (i = 0; i < NODES; i++)
+	nodes[i].inum = -1;
+    for (i = 0; i < NAMES; i++)
+	names[i].pinum = -1;
+    for (i = 0; i < BLOCKS; i++)
+	blocks[i].inum = -1;
+}
+
+void mcache_init(int on) {
+    if (blocks == NULL && (blocks = malloc(BLOCKS * sizeof(block_t))) == NULL)
+	on = 0;
+    enabled = on;
+    if (enabled)
+	empty();
+}
+
+int mcache_enabled() {
+    return enabled;
+}
+
+// the node for inum, if its lease is good
+static node_t *fresh(int inum) {
+    node_t *n = &nodes[(unsigned int) inum % NODES];
+    return n->inum == inum && now_ms() < n->expires ? n : NULL;
+}
+
+// returns 0 if version is older than what we have for inum already
+static int note(int inum, unsigned int version, int lease_ms) {
+    if (inum < 0)
+	return 1;
+    node_t *n = &nodes[inum % NODES];
+    int current = 1;
+    if (n->inum != inum) {
+	n->inum = inum;
+	n->version = version;
+	n->have_stat = 0;
+    } else if (n->version != version) {
+	// (versions only go up; the difference copes with them wrapping)
+	current = (int) (version - n->version) > 0;
+	if (current) {
+	    n->version = version;
+	    n->have_stat = 0;
+	}
+    }
+    n->expires = now_ms() + lease_ms;
+    return current;
+}
+
+int mcache_learn(message_t *m) {
+    if (!enabled)
+	return 0;
+    if (m->epoch != epoch) {
+	empty();
+	epoch = m->epoch;
+    }
+    int current = note(m->inum, m->version, m->lease_ms);
+    note(m->child, m->child_version, m->lease_ms);
+    return current;
+}
+
+static unsigned int name_hash(int pinum, char *name) {
+    unsigned int h = 2166136261u ^ pinum;
+    for (; *name; name++)
+	h = (h ^ (unsigned char) *name) * 16777619u;
+    return h % NAMES;
+}
+
+int mcache_lookup(int pinum, char *name, int *inum) {
+    node_t *n;
+    if (!enabled || (n = fresh(pinum)) == NULL)
+	return 0;
+    name_t *e = &names[name_hash(pinum, name)];
+    if (e->pinum != pinum || e->version != n->version || strcmp(e->name, name) != 0)
+	return 0;
+    *inum = e->inum;
+    return 1;
+}
+
+void mcache_put_lookup(int pinum, char *name, int inum) {
+    node_t *n;
+    if (!enabled || (n = fresh(pinum)) == NULL)
+	return;
+    name_t *e = &names[name_hash(pinum, name)];
+    e->pinum = pinum;
+    e->version = n->version;
+    strcpy(e->name, name);
+    e->inum = inum;
+}
+
+int mcache_stat(int inum, MFS_Stat_t *stat) {
+    node_t *n;
+    if (!enabled || (n = fresh(inum)) == NULL || !n->have_stat)
+	return 0;
+    *stat = n->stat;
+    return 1;
+}
+
+void mcache_put_stat(int inum, MFS_Stat_t *stat) {
+    node_t *n;
+    if (!enabled || (n = fresh(inum)) == NULL)
+	return;
+    n->stat = *stat;
+    n->have_stat = 1;
+}
+
+static block_t *block_slot(int inum, int block) {
+    return &blocks[((unsigned int) inum * 31 + block) % BLOCKS];
+}
+
+char *mcache_block(int inum, int block, int *len) {
+    node_t *n;
+    if (!enabled || (n = fresh(inum)) == NULL)
+	return NULL;
+    block_t *b = block_slot(inum, block);
+    if (b->inum != inum || b->block != block || b->version != n->version)
+	return NULL;
+    *len = b->len;
+    return b->data;
+}
+
+void mcache_put_block(int inum, int block, char *data, int len) {
+    node_t *n;
+    if (!enabled || (n = fresh(inum)) == NULL)
+	return;
+    block_t *b = block_slot(inum, block);
+    b->inum = inum;
+    b->block = block;
+    b->version = n->version;
+    b->len = len;
+    memcpy(b->data, data, len);
+}
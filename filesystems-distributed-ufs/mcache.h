@@ -0,0 +1,28 @@
+#ifndef __MCACHE_H__
+#define __MCACHE_H__
+
+#include "message.h"
+
+//
+// What the client library remembers of the server's answers: lookups,
+// stats and (whole, or up to the end of the file) blocks read. See
+// mcache.c for how it stays coherent.
+//
+// mcache_learn() is given every reply that comes back, and returns
+// whether what it says of its inode is current (0: an older reply came
+// in behind a newer one; do not put anything from it). The lookups
+// return whether they found something (1) or not (0); the puts store
+// what an RPC just returned. With the cache off, nothing is found.
+//
+
+void mcache_init(int enabled);
+int mcache_enabled();
+int mcache_learn(message_t *m);
+int mcache_lookup(int pinum, char *name, int *inum);
+void mcache_put_lookup(int pinum, char *name, int inum);
+int mcache_stat(int inum, MFS_Stat_t *stat);
+void mcache_put_stat(int inum, MFS_Stat_t *stat);
+char *mcache_block(int inum, int block, int *len);
+void mcache_put_block(int inum, int block, char *data, int len);
+
+#endif // __MCACHE_H__
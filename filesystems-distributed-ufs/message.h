@@ -0,0 +1,78 @@
+#ifndef __MESSAGE_H__
+#define __MESSAGE_H__
+
+#include <stddef.h>
+
+#include "mfs.h"
+
+//
+// What goes between libmfs and the server: one datagram each way per
+// call. A request carries its operation and arguments; the reply is the
+// same message with rc (and, for a read or stat, buffer or stat) filled
+// in. Only the header and the nbytes of buffer that matter are sent, so
+// a stat does not drag an empty 4 KB block along with it.
+//
+// seq is picked by the client for each call and echoed by the server,
+// so replies are matched to the calls they answer. A call keeps its seq
+// when it is sent again, so a reply to any attempt at it will do; a
+// reply that comes after its call is over (answered by another attempt)
+// is told apart from the calls made since, and dropped.
+//
+// Every reply also says what the server knows of the inode the request
+// was about (inum): its version, and for how long (lease_ms) the client
+// may go on using what it has cached of it without asking again. A creat
+// or unlink says the same of the inode it made or removed (child). Both
+// are only good for as long as the server that gave them out is up, so
+// each server picks an epoch of its own at start, and says that too.
+//
+// A bulk write, or the reply to a bulk read, is more than one datagram
+// can sensibly hold, so it goes as nfrags fragments of MFS_BLOCK_SIZE
+// bytes (the last one shorter), all with the same seq and header; frag
+// says which part of the nbytes is in buffer. The other side puts them
+// back together, in whatever order they come. If any are lost, the
+// client times out and sends the whole request again.
+//
+
+#define MFS_LOOKUP   (1)
+#define MFS_STAT     (2)
+#define MFS_WRITE    (3)
+#define MFS_READ     (4)
+#define MFS_CREAT    (5)
+#define MFS_UNLINK   (6)
+#define MFS_SHUTDOWN (7)
+#define MFS_WRITE_BULK (8)
+#define MFS_READ_BULK  (9)
+
+typedef struct {
+    int mtype;          // MFS_LOOKUP, ...
+    int seq;
+    int rc;             // in the reply
+    int inum;           // or pinum, for lookup, creat and unlink
+    int offset;
+    int nbytes;
+    int type;           // for creat
+    int frag;           // for bulk operations: this is fragment frag...
+    int nfrags;         // ...of nfrags
+    MFS_Stat_t stat;    // in the reply to a stat
+    unsigned int epoch; // in every reply
+    unsigned int version;
+    int lease_ms;
+    int child;
+    unsigned int child_version;
+    char name[28];
+    char buffer[MFS_BLOCK_SIZE];
+} message_t;
+
+#define MESSAGE_HEADER (offsetof(message_t, buffer))
+
+// how many fragments nbytes of bulk data takes, and how much is in one
+static inline int message_frags(int nbytes) {
+    return nbytes <= MFS_BLOCK_SIZE ? 1 : (nbytes + MFS_BLOCK_SIZE - 1) / MFS_BLOCK_SIZE;
+}
+
+static inline int message_frag_len(int nbytes, int frag) {
+    int left = nbytes - frag * MFS_BLOCK_SIZE;
+    return left < MFS_BLOCK_SIZE ? left : MFS_BLOCK_SIZE;
+}
+
+#endif // __MESSAGE_H__
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mcache.h"
+#include "message.h"
+#include "udp.h"
+
+//
+// The client library: each call is a request to the server, sent again
+// every MFS_TIMEOUT seconds until a reply to it comes back (which is safe;
+// see server.c). Each call has a seq of its own, kept when it is sent
+// again: replies are matched to calls by it, so a late reply to a call
+// that is already over is just dropped. The bulk calls go (or come back)
+// in fragments; see message.h.
+//
+// Up to MFS_WINDOW requests can be outstanding at once, each in a req_t
+// of its own with its own timer; the synchronous calls are just one of
+// them started and then waited for. MFS_Poll() takes in whatever replies
+// have come (and finishes their requests, calling done if there is one)
+// and sends again anything that has timed out.
+//
+// Lookups, stats and reads are answered from the cache in mcache.c when
+// it can, which it does unless MFS_CACHE=0 is in the environment.
+// MFS_Read() goes through it a block at a time: a block that is not
+// there is read (up to the end of the file) and kept. (The asynchronous
+// calls always go to the server, but what they find is cached too.)
+//
+
+#define MFS_TIMEOUT (5)
+
+typedef struct {
+    int busy;           // waiting for its reply
+    int finished;       // replied to, waiting for MFS_Wait()
+    message_t m;        // the request, to send again
+    int len;
+    char *out;          // for a bulk write, what to write
+    char *in;           // for a read, where to put what is read
+    MFS_Stat_t *stat;   // for a stat, where to put it
+    unsigned int have;  // fragments of a bulk read in so far (a bit each)
+    long deadline;      // in ms, for sending again
+    int rc;
+    int current;        // what mcache_learn() said of the reply
+    MFS_Done_t done;
+    void *arg;
+} req_t;
+
+static int sd = -1;
+static struct sockaddr_in server;
+static int next_seq;
+static req_t reqs[MFS_WINDOW];
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int MFS_Init(char *hostname, int port) {
+    if (sd < 0 && (sd = UDP_Open(0)) < 0)
+	return -1;
+    if (UDP_FillSockAddr(&server, hostname, port) < 0)
+	return -1;
+    next_seq = ((getpid() << 16) ^ time(NULL)) & 0x7fffffff;
+    memset(reqs, 0, sizeof(reqs));
+    char *cache = getenv("MFS_CACHE");
+    mcache_init(cache == NULL || atoi(cache) != 0);
+    return 0;
+}
+
+static void send_req(req_t *r) {
+    message_t *m = &r->m;
+    if (r->out == NULL) {
+	m->frag = 0;
+	UDP_Write(sd, &server, (char *) m, r->len);
+    } else {
+	for (m->frag = 0; m->frag < m->nfrags; m->frag++) {
+	    int n = message_frag_len(m->nbytes, m->frag);
+	    memcpy(m->buffer, r->out + m->frag * MFS_BLOCK_SIZE, n);
+	    UDP_Write(sd, &server, (char *) m, MESSAGE_HEADER + n);
+	}
+    }
+    r->deadline = now_ms() + MFS_TIMEOUT * 1000;
+}
+
+// the reply to r is all in; current is what mcache_learn() said of it
+static void finish(req_t *r, message_t *reply, int current) {
+    message_t *m = &r->m;
+    r->busy = 0;
+    r->rc = reply->rc;
+    r->current = current;
+    if (current && m->mtype == MFS_LOOKUP)
+	mcache_put_lookup(m->inum, m->name, reply->rc);
+    if (reply->rc == 0 && m->mtype == MFS_STAT) {
+	*r->stat = reply->stat;
+	if (current)
+	    mcache_put_stat(m->inum, r->stat);
+    }
+    if (reply->rc == 0 && m->mtype == MFS_READ)
+	memcpy(r->in, reply->buffer, m->nbytes);
+    if (r->done == NULL) {
+	r->finished = 1;
+	return;
+    }
+    // (r is free again by now, so done can start another call in it)
+    MFS_Done_t done = r->done;
+    done(m->seq, r->rc, r->arg);
+}
+
+static void receive() {
+    static message_t reply;
+    struct sockaddr_in from;
+    int n = UDP_Read(sd, &from, (char *) &reply, sizeof(reply)), i;
+    if (n < (int) MESSAGE_HEADER)
+	return;
+    req_t *r = NULL;
+    for (i = 0; i < MFS_WINDOW; i++)
+	if (reqs[i].busy && reqs[i].m.seq == reply.seq)
+	    r = &reqs[i];
+    if (r == NULL)
+	return;
+    int current = mcache_learn(&reply);
+    if (r->m.mtype != MFS_READ_BULK || reply.rc != 0) {
+	finish(r, &reply, current);
+	return;
+    }
+    message_t *m = &r->m;
+    if (reply.frag < 0 || reply.frag >= m->nfrags || n - (int) MESSAGE_HEADER < message_frag_len(m->nbytes, reply.frag))
+	return;
+    memcpy(r->in + reply.frag * MFS_BLOCK_SIZE, reply.buffer, message_frag_len(m->nbytes, reply.frag));
+    r->have |= 0x1u << reply.frag;
+    if (r->have == (0x1u << m->nfrags) - 1)
+	finish(r, &reply, current);
+}
+
+int MFS_Poll(int timeout_ms) {
+    long now = now_ms(), wait = -1;
+    int i, busy = 0;
+    for (i = 0; i < MFS_WINDOW; i++)
+	if (reqs[i].busy) {
+	    busy++;
+	    if (wait < 0 || reqs[i].deadline - now < wait)
+		wait = reqs[i].deadline - now;
+	}
+    if (busy == 0)
+	return 0;
+    if (wait < 0)
+	wait = 0;
+    if (timeout_ms >= 0 && timeout_ms < wait)
+	wait = timeout_ms;
+
+    while (1) {
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(sd, &fds);
+	struct timeval tv;
+	tv.tv_sec = wait / 1000;
+	tv.tv_usec = wait % 1000 * 1000;
+	if (select(sd + 1, &fds, NULL, NULL, &tv) <= 0)
+	    break;
+	receive();
+	wait = 0;       // and take in whatever else is there already
+    }
+
+    now = now_ms();
+    busy = 0;
+    for (i = 0; i < MFS_WINDOW; i++)
+	if (reqs[i].busy) {
+	    if (reqs[i].deadline <= now)
+		send_req(&reqs[i]);
+	    busy++;
+	}
+    return busy;
+}
+
+// sends the first len bytes of m (or, for a bulk write, nbytes of out in
+// fragments); see req_t for the rest
+static int start(message_t *m, int len, char *out, char *in, MFS_Stat_t *stat, MFS_Done_t done, void *arg) {
+    if (sd < 0)
+	return -1;
+    req_t *r;
+    while (1) {
+	int i, waiting = 0;
+	for (i = 0; i < MFS_WINDOW; i++) {
+	    if (!reqs[i].busy && !reqs[i].finished)
+		break;
+	    waiting += reqs[i].busy;
+	}
+	if (i < MFS_WINDOW) {
+	    r = &reqs[i];
+	    break;
+	}
+	// the window is full of results no one has waited for
+	if (waiting == 0)
+	    return -1;
+	MFS_Poll(-1);
+    }
+    memcpy(&r->m, m, len);
+    r->m.seq = next_seq;
+    next_seq = (next_seq + 1) & 0x7fffffff;     // (ids are never -1)
+    r->m.nfrags = out != NULL || m->mtype == MFS_READ_BULK ? message_frags(m->nbytes) : 1;
+    r->len = len;
+    r->out = out;
+    r->in = in;
+    r->stat = stat;
+    r->have = 0;
+    r->done = done;
+    r->arg = arg;
+    r->busy = 1;
+    send_req(r);
+    return r->m.seq;
+}
+
+// MFS_Wait(), also saying (in *current, if asked) whether the reply was
+// current: what came back may only be cached if it was
+static int wait_call(int id, int *current) {
+    int i;
+    for (i = 0; i < MFS_WINDOW; i++)
+	if ((reqs[i].busy || reqs[i].finished) && reqs[i].done == NULL && reqs[i].m.seq == id)
+	    break;
+    if (i == MFS_WINDOW)
+	return -1;
+    while (reqs[i].busy)
+	MFS_Poll(-1);
+    reqs[i].finished = 0;
+    if (current)
+	*current = reqs[i].current;
+    return reqs[i].rc;
+}
+
+int MFS_Wait(int id) {
+    return wait_call(id, NULL);
+}
+
+static int call(message_t *m, int len, char *out, char *in, MFS_Stat_t *stat) {
+    int id = start(m, len, out, in, stat, NULL, NULL);
+    return id == -1 ? -1 : MFS_Wait(id);
+}
+
+static int name_ok(char *name) {
+    return strnlen(name, sizeof(((message_t *) 0)->name)) < sizeof(((message_t *) 0)->name);
+}
+
+//
+// The requests themselves, each made up here and then either called
+// (and waited for) or started.
+//
+
+static int lookup_req(message_t *m, int pinum, char *name) {
+    if (!name_ok(name))
+	return -1;
+    m->mtype = MFS_LOOKUP;
+    m->inum = pinum;
+    strcpy(m->name, name);
+    return 0;
+}
+
+static void stat_req(message_t *m, int inum) {
+    m->mtype = MFS_STAT;
+    m->inum = inum;
+}
+
+static int write_req(message_t *m, int inum, char *buffer, int offset, int nbytes) {
+    if (nbytes < 0 || nbytes > MFS_BLOCK_SIZE)
+	return -1;
+    m->mtype = MFS_WRITE;
+    m->inum = inum;
+    m->offset = offset;
+    m->nbytes = nbytes;
+    memcpy(m->buffer, buffer, nbytes);
+    return 0;
+}
+
+static int read_req(message_t *m, int inum, int offset, int nbytes) {
+    if (nbytes < 0 || nbytes > MFS_BLOCK_SIZE)
+	return -1;
+    m->mtype = MFS_READ;
+    m->inum = inum;
+    m->offset = offset;
+    m->nbytes = nbytes;
+    return 0;
+}
+
+static int creat_req(message_t *m, int pinum, int type, char *name) {
+    if (!name_ok(name))
+	return -1;
+    m->mtype = MFS_CREAT;
+    m->inum = pinum;
+    m->type = type;
+    strcpy(m->name, name);
+    return 0;
+}
+
+static int unlink_req(message_t *m, int pinum, char *name) {
+    if (!name_ok(name))
+	return -1;
+    m->mtype = MFS_UNLINK;
+    m->inum = pinum;
+    strcpy(m->name, name);
+    return 0;
+}
+
+int MFS_Lookup(int pinum, char *name) {
+    message_t m;
+    int inum;
+    if (lookup_req(&m, pinum, name) < 0)
+	return -1;
+    if (mcache_lookup(pinum, name, &inum))
+	return inum;
+    return call(&m, MESSAGE_HEADER, NULL, NULL, NULL);
+}
+
+int MFS_Stat(int inum, MFS_Stat_t *stat) {
+    message_t m;
+    if (mcache_stat(inum, stat))
+	return 0;
+    stat_req(&m, inum);
+    return call(&m, MESSAGE_HEADER, NULL, NULL, stat);
+}
+
+int MFS_Write(int inum, char *buffer, int offset, int nbytes) {
+    message_t m;
+    if (write_req(&m, inum, buffer, offset, nbytes) < 0)
+	return -1;
+    return call(&m, MESSAGE_HEADER + nbytes, NULL, NULL, NULL);
+}
+
+static int read_rpc(int inum, char *buffer, int offset, int nbytes, int *current) {
+    message_t m;
+    if (read_req(&m, inum, offset, nbytes) < 0)
+	return -1;
+    int id = start(&m, MESSAGE_HEADER, NULL, buffer, NULL, NULL, NULL);
+    return id == -1 ? -1 : wait_call(id, current);
+}
+
+int MFS_Read(int inum, char *buffer, int offset, int nbytes) {
+    if (nbytes < 0 || nbytes > MFS_BLOCK_SIZE)
+	return -1;
+    if (!mcache_enabled())
+	return read_rpc(inum, buffer, offset, nbytes, NULL);
+    MFS_Stat_t stat;
+    if (MFS_Stat(inum, &stat) < 0 || offset < 0 || offset > stat.size - nbytes)
+	return -1;
+    int done = 0;
+    while (done < nbytes) {
+	int b = (offset + done) / MFS_BLOCK_SIZE, from = (offset + done) % MFS_BLOCK_SIZE;
+	int n = MFS_BLOCK_SIZE - from, len;
+	if (n > nbytes - done)
+	    n = nbytes - done;
+	char *data = mcache_block(inum, b, &len);
+	if (data == NULL || len < from + n) {
+	    char block[MFS_BLOCK_SIZE];
+	    int current;
+	    len = stat.size - b * MFS_BLOCK_SIZE;
+	    if (len > MFS_BLOCK_SIZE)
+		len = MFS_BLOCK_SIZE;
+	    if (read_rpc(inum, block, b * MFS_BLOCK_SIZE, len, &current) < 0)
+		return -1;
+	    // (a reply that came in behind a newer one is from before the
+	    // inode's latest change; caching it would tag it as after)
+	    if (current)
+		mcache_put_block(inum, b, block, len);
+	    memcpy(buffer + done, block + from, n);
+	} else {
+	    memcpy(buffer + done, data + from, n);
+	}
+	done += n;
+    }
+    return 0;
+}
+
+int MFS_WriteBulk(int inum, char *buffer, int offset, int nbytes) {
+    message_t m;
+    if (nbytes < 0 || nbytes > MFS_MAX_BULK)
+	return -1;
+    m.mtype = MFS_WRITE_BULK;
+    m.inum = inum;
+    m.offset = offset;
+    m.nbytes = nbytes;
+    return call(&m, MESSAGE_HEADER, buffer, NULL, NULL);
+}
+
+int MFS_ReadBulk(int inum, char *buffer, int offset, int nbytes) {
+    message_t m;
+    if (nbytes < 0 || nbytes > MFS_MAX_BULK)
+	return -1;
+    m.mtype = MFS_READ_BULK;
+    m.inum = inum;
+    m.offset = offset;
+    m.nbytes = nbytes;
+    return call(&m, MESSAGE_HEADER, NULL, buffer, NULL);
+}
+
+int MFS_Creat(int pinum, int type, char *name) {
+    message_t m;
+    if (creat_req(&m, pinum, type, name) < 0)
+	return -1;
+    return call(&m, MESSAGE_HEADER, NULL, NULL, NULL);
+}
+
+int MFS_Unlink(int pinum, char *name) {
+    message_t m;
+    if (unlink_req(&m, pinum, name) < 0)
+	return -1;
+    return call(&m, MESSAGE_HEADER, NULL, NULL, NULL);
+}
+
+int MFS_Shutdown() {
+    message_t m;
+    m.mtype = MFS_SHUTDOWN;
+    return call(&m, MESSAGE_HEADER, NULL, NULL, NULL);
+}
+
+int MFS_LookupAsync(int pinum, char *name, MFS_Done_t done, void *arg) {
+    message_t m;
+    if (lookup_req(&m, pinum, name) < 0)
+	return -1;
+    return start(&m, MESSAGE_HEADER, NULL, NULL, NULL, done, arg);
+}
+
+int MFS_StatAsync(int inum, MFS_Stat_t *stat, MFS_Done_t done, void *arg) {
+    message_t m;
+    stat_req(&m, inum);
+    return start(&m, MESSAGE_HEADER, NULL, NULL, stat, done, arg);
+}
+
+int MFS_WriteAsync(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg) {
+    message_t m;
+    if (write_req(&m, inum, buffer, offset, nbytes) < 0)
+	return -1;
+    return start(&m, MESSAGE_HEADER + nbytes, NULL, NULL, NULL, done, arg);
+}
+
+int MFS_ReadAsync(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg) {
+    message_t m;
+    if (read_req(&m, inum, offset, nbytes) < 0)
+	return -1;
+    return start(&m, MESSAGE_HEADER, NULL, buffer, NULL, done, arg);
+}
+
+int MFS_CreatAsync(int pinum, int type, char *name, MFS_Done_t done, void *arg) {
+    message_t m;
+    if (creat_req(&m, pinum, type, name) < 0)
+	return -1;
+    return start(&m, MESSAGE_HEADER, NULL, NULL, NULL, done, arg);
+}
+
+int MFS_UnlinkAsync(int pinum, char *name, MFS_Done_t done, void *arg) {
+    message_t m;
+    if (unlink_req(&m, pinum, name) < 0)
+	return -1;
+    return start(&m, MESSAGE_HEADER, NULL, NULL, NULL, done, arg);
+}
@@ -5,6 +5,7 @@
 #define MFS_REGULAR_FILE (1)
 
 #define MFS_BLOCK_SIZE   (4096)
+#define MFS_MAX_BULK     (30 * MFS_BLOCK_SIZE) // a whole file
 
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
@@ -23,8 +24,38 @@ int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int offset, int nbytes);
 int MFS_Read(int inum, char *buffer, int offset, int nbytes);
+// as above, but nbytes can be up to MFS_MAX_BULK
+int MFS_WriteBulk(int inum, char *buffer, int offset, int nbytes);
+int MFS_ReadBulk(int inum, char *buffer, int offset, int nbytes);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
 int MFS_Shutdown();
 
+//
+// Asynchronous versions of the above: each starts its call, and returns
+// an id for it (or -1). Up to MFS_WINDOW calls can be going at once;
+// starting one more waits for one of those to finish. A call is done
+// when MFS_Poll() (or MFS_Wait()) takes in its reply: then what it reads
+// is where it would be for the synchronous call, and done(id, rc, arg)
+// is called with what that would have returned. A call started with no
+// done keeps its result until MFS_Wait() is called for it.
+//
+// MFS_Poll() waits no longer than timeout_ms (-1: until something
+// happens), and returns how many calls are still going. Calls going at
+// the same time may be carried out in any order.
+//
+
+#define MFS_WINDOW (32)
+
+typedef void (*MFS_Done_t)(int id, int rc, void *arg);
+
+int MFS_LookupAsync(int pinum, char *name, MFS_Done_t done, void *arg);
+int MFS_StatAsync(int inum, MFS_Stat_t *m, MFS_Done_t done, void *arg);
+int MFS_WriteAsync(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg);
+int MFS_ReadAsync(int inum, char *buffer, int offset, int nbytes, MFS_Done_t done, void *arg);
+int MFS_CreatAsync(int pinum, int type, char *name, MFS_Done_t done, void *arg);
+int MFS_UnlinkAsync(int pinum, char *name, MFS_Done_t done, void *arg);
+int MFS_Poll(int timeout_ms);
+int MFS_Wait(int id);
+
 #endif // __MFS_h__
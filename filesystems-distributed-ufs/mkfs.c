@@ -3,10 +3,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "ufs.h"
 
+//
+// The image is made at its full size with ftruncate(), so it is all
+// zeroes to begin with, and the data region is left sparse: only the
+// blocks from the super block through the root directory's one are
+// written, in order, with a pwritev() of up to WRITE_RUN blocks at a
+// time (each block a pointer to a buffer, most of them the same empty
+// one).
+//
+
+#define WRITE_RUN (1024)    // blocks in one pwritev, at most (IOV_MAX)
+
 void usage() {
     fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
     exit(1);
@@ -43,14 +55,7 @@ int main(int argc, char *argv[]) {
     if (image_file == NULL)
 	usage();
 
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
-    }
-
-    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    int fd = open(image_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0) {
 	perror("open");
 	exit(1);
@@ -93,13 +98,6 @@ int main(int argc, char *argv[]) {
 
     int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
 
-    // super block is the first block
-    int rc = pwrite(fd, &s, sizeof(super_t), 0);
-    if (rc != sizeof(super_t)) {
-	perror("write");
-	exit(1);
-    }
-
     printf("total blocks        %d\n", total_blocks);
     printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
     printf("  data blocks       %d\n", num_data);
@@ -107,81 +105,80 @@ int main(int argc, char *argv[]) {
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
 
-    // first, zero out all the blocks
-    int i;
-    for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
-	    perror("write");
-	    exit(1);
-	}
+    // first, the whole image, as zeroes
+    if (ftruncate(fd, (off_t) total_blocks * UFS_BLOCK_SIZE) < 0) {
+	perror("ftruncate");
+	exit(1);
     }
 
     //
-    // need to allocate first inode in inode bitmap
+    // the blocks that have anything in them: the super block, the first
+    // block of each bitmap (with the root's inode and data block allocated),
+    // the first block of the inode table, and the root directory
     //
     typedef struct {
-	unsigned int bits[UFS_BLOCK_SIZE / sizeof(unsigned int)];
-    } bitmap_t;
-    assert(sizeof(bitmap_t) == UFS_BLOCK_SIZE);
-
-    bitmap_t b;
-    for (i = 0; i < 1024; i++)
-	b.bits[i] = 0;
-    b.bits[0] = 0x1 << 31; // first entry is allocated
-    
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+	char data[UFS_BLOCK_SIZE];
+    } block_t;
+    block_t *empty, *super, *bitmap, *inode_blk, *root;
+    empty = calloc(5, sizeof(block_t));
+    if (empty == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    super = empty + 1;
+    bitmap = empty + 2;
+    inode_blk = empty + 3;
+    root = empty + 4;
 
-    //
-    // need to allocate first data block in data bitmap
-    // (can just reuse this to write out data bitmap too)
-    //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    memcpy(super, &s, sizeof(super_t));
 
-    //
-    // need to write out inode
-    //
-    typedef struct {
-	inode_t inodes[UFS_BLOCK_SIZE / sizeof(inode_t)];
-    } inode_block;
+    // first entry is allocated
+    ((unsigned int *) bitmap)[0] = 0x1 << 31;
 
-    inode_block itable;
-    itable.inodes[0].type = UFS_DIRECTORY;
-    itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
-    itable.inodes[0].direct[0] = s.data_region_addr;
+    inode_t *in = (inode_t *) inode_blk;
+    in[0].type = UFS_DIRECTORY;
+    in[0].size = 2 * sizeof(dir_ent_t); // in bytes
+    in[0].direct[0] = s.data_region_addr;
+    int i;
     for (i = 1; i < DIRECT_PTRS; i++)
-	itable.inodes[0].direct[i] = -1;
-
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+	in[0].direct[i] = -1;
 
-    // 
-    // need to write out root directory contents to first data block
-    // create a root directory, with nothing in it
-    // 
-    typedef struct {
-	dir_ent_t entries[128];
-    } dir_block_t;
     // xxx assumes 4096 block, 32 byte entries
     assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
-
-    dir_block_t parent;
-    strcpy(parent.entries[0].name, ".");
-    parent.entries[0].inum = 0;
-
-    strcpy(parent.entries[1].name, "..");
-    parent.entries[1].inum = 0;
-
+    dir_ent_t *entries = (dir_ent_t *) root;
+    strcpy(entries[0].name, ".");
+    entries[0].inum = 0;
+    strcpy(entries[1].name, "..");
+    entries[1].inum = 0;
     for (i = 2; i < 128; i++)
-	parent.entries[i].inum = -1;
-
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+	entries[i].inum = -1;
+
+    // then all of those, and the zeroes in between
+    int last = s.data_region_addr;
+    for (i = 0; i <= last; ) {
+	struct iovec iov[WRITE_RUN];
+	int first = i, n;
+	for (n = 0; n < WRITE_RUN && i <= last; n++, i++) {
+	    block_t *b = empty;
+	    if (i == 0)
+		b = super;
+	    else if (i == s.inode_bitmap_addr || i == s.data_bitmap_addr)
+		b = bitmap;
+	    else if (i == s.inode_region_addr)
+		b = inode_blk;
+	    else if (i == s.data_region_addr)
+		b = root;
+	    iov[n].iov_base = b;
+	    iov[n].iov_len = UFS_BLOCK_SIZE;
+	}
+	ssize_t rc = pwritev(fd, iov, n, (off_t) first * UFS_BLOCK_SIZE);
+	if (rc != (ssize_t) n * UFS_BLOCK_SIZE) {
+	    perror("write");
+	    exit(1);
+	}
+    }
 
     if (visual) {
-	int i;
 	printf("\nVisualization of layout\n\n");
 	printf("S");
 	for (i = 0; i < s.inode_bitmap_len; i++)
@@ -0,0 +1,228 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ufs.h"
+
+//
+// Makes a UFS image with a tree of files already in it, in the layout
+// mkfs gives, for trying the server on at some scale:
+//
+// prompt> mkimg -f image [-i inodes] [-d data blocks] [-t depth]
+//               [-w fanout] [-n files] [-s blocks] [-r seed]
+//
+// Every directory has fanout subdirectories (d0, d1, ...), down to depth
+// levels below the root, and files (f0, f1, ...) in every one of them;
+// how many blocks a file has is drawn at random, exponentially, with the
+// mean given, up to DIRECT_PTRS. How many inodes and data blocks there
+// are is, unless given, enough for the tree with some to spare.
+//
+// How it works: the image is made at full size with ftruncate(), mapped,
+// and built in place, everything allocated in order; the files' blocks
+// are allocated but left as zeroes (so the image stays sparse).
+//
+
+#define ENTRIES_PER_BLOCK (UFS_BLOCK_SIZE / sizeof(dir_ent_t))
+
+static char *img;
+static super_t s;
+static int next_inum, next_block;
+static int depth = 2, fanout = 4, nfiles = 8;
+static double mean_blocks = 4;
+
+void usage() {
+    fprintf(stderr, "usage: mkimg -f <image_file> [-i <num_inodes>] [-d <num_data_blocks>]\n"
+	    "             [-t <depth>] [-w <fanout>] [-n <files>] [-s <mean_blocks>] [-r <seed>]\n");
+    exit(1);
+}
+
+static void bit_set(int addr, int n) {
+    unsigned int *bits = (unsigned int *) (img + addr * UFS_BLOCK_SIZE);
+    bits[n / 32] |= 0x1u << (31 - n % 32);
+}
+
+static inode_t *inode(int inum) {
+    return (inode_t *) (img + s.inode_region_addr * UFS_BLOCK_SIZE) + inum;
+}
+
+static int inode_alloc(int type) {
+    if (next_inum == s.num_inodes) {
+	fprintf(stderr, "mkimg: out of inodes (try -i)\n");
+	exit(1);
+    }
+    inode_t *in = inode(next_inum);
+    in->type = type;
+    in->size = 0;
+    int i;
+    for (i = 0; i < DIRECT_PTRS; i++)
+	in->direct[i] = -1;
+    bit_set(s.inode_bitmap_addr, next_inum);
+    return next_inum++;
+}
+
+static unsigned int block_alloc() {
+    if (next_block == s.num_data) {
+	fprintf(stderr, "mkimg: out of data blocks (try -d)\n");
+	exit(1);
+    }
+    bit_set(s.data_bitmap_addr, next_block);
+    return s.data_region_addr + next_block++;
+}
+
+static void dir_add(int dir, char *name, int inum) {
+    inode_t *in = inode(dir);
+    int n = in->size / sizeof(dir_ent_t);
+    if (n == DIRECT_PTRS * ENTRIES_PER_BLOCK) {
+	fprintf(stderr, "mkimg: directory too big (try less -n or -w)\n");
+	exit(1);
+    }
+    if (n % ENTRIES_PER_BLOCK == 0) {
+	in->direct[n / ENTRIES_PER_BLOCK] = block_alloc();
+	dir_ent_t *e = (dir_ent_t *) (img + (size_t) in->direct[n / ENTRIES_PER_BLOCK] * UFS_BLOCK_SIZE);
+	int i;
+	for (i = 0; i < ENTRIES_PER_BLOCK; i++)
+	    e[i].inum = -1;
+    }
+    dir_ent_t *e = (dir_ent_t *) (img + (size_t) in->direct[n / ENTRIES_PER_BLOCK] * UFS_BLOCK_SIZE) + n % ENTRIES_PER_BLOCK;
+    strncpy(e->name, name, sizeof(e->name) - 1);
+    e->inum = inum;
+    in->size += sizeof(dir_ent_t);
+}
+
+static int make_dir(int parent) {
+    int inum = inode_alloc(UFS_DIRECTORY);
+    dir_add(inum, ".", inum);
+    dir_add(inum, "..", parent < 0 ? inum : parent);
+    return inum;
+}
+
+static int make_file() {
+    int inum = inode_alloc(UFS_REGULAR_FILE);
+    // how many blocks: exponential, with the mean asked for
+    double u = (random() + 1.0) / ((double) RAND_MAX + 2.0);
+    int n = (int) (-log(u) * mean_blocks), i;
+    if (n > DIRECT_PTRS)
+	n = DIRECT_PTRS;
+    inode_t *in = inode(inum);
+    for (i = 0; i < n; i++)
+	in->direct[i] = block_alloc();
+    in->size = n * UFS_BLOCK_SIZE - (n ? random() % UFS_BLOCK_SIZE : 0);
+    return inum;
+}
+
+static void make_tree(int dir, int level) {
+    char name[28];
+    int i;
+    for (i = 0; i < nfiles; i++) {
+	sprintf(name, "f%d", i);
+	dir_add(dir, name, make_file());
+    }
+    if (level == depth)
+	return;
+    for (i = 0; i < fanout; i++) {
+	int sub = make_dir(dir);
+	sprintf(name, "d%d", i);
+	dir_add(dir, name, sub);
+	make_tree(sub, level + 1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int ch;
+    char *image_file = NULL;
+    int num_inodes = 0;
+    int num_data = 0;
+    int seed = 1;
+
+    while ((ch = getopt(argc, argv, "i:d:f:t:w:n:s:r:")) != -1) {
+	switch (ch) {
+	case 'i':
+	    num_inodes = atoi(optarg);
+	    break;
+	case 'd':
+	    num_data = atoi(optarg);
+	    break;
+	case 'f':
+	    image_file = optarg;
+	    break;
+	case 't':
+	    depth = atoi(optarg);
+	    break;
+	case 'w':
+	    fanout = atoi(optarg);
+	    break;
+	case 'n':
+	    nfiles = atoi(optarg);
+	    break;
+	case 's':
+	    mean_blocks = atof(optarg);
+	    break;
+	case 'r':
+	    seed = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (image_file == NULL)
+	usage();
+    srandom(seed);
+
+    // unless told, enough for the tree, with some to spare
+    long dirs = 1, level = 1;
+    int i;
+    for (i = 0; i < depth; i++) {
+	level *= fanout;
+	dirs += level;
+    }
+    if (num_inodes == 0)
+	num_inodes = (dirs * (nfiles + 1) + 1) * 5 / 4 + 32;
+    if (num_data == 0)
+	num_data = num_inodes * (mean_blocks + 2) * 2 + 32;
+    if (num_inodes < 32 || num_data < 32)
+	usage();
+
+    // the same layout mkfs makes
+    int bits_per_block = 8 * UFS_BLOCK_SIZE;
+    s.num_inodes = num_inodes;
+    s.num_data = num_data;
+    s.inode_bitmap_addr = 1;
+    s.inode_bitmap_len = (num_inodes + bits_per_block - 1) / bits_per_block;
+    s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
+    s.data_bitmap_len = (num_data + bits_per_block - 1) / bits_per_block;
+    s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
+    s.inode_region_len = (num_inodes * sizeof(inode_t) + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+    s.data_region_addr = s.inode_region_addr + s.inode_region_len;
+    s.data_region_len = num_data;
+    size_t total = (size_t) (s.data_region_addr + s.data_region_len) * UFS_BLOCK_SIZE;
+
+    int fd = open(image_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+	perror("open");
+	exit(1);
+    }
+    if (ftruncate(fd, total) < 0) {
+	perror("ftruncate");
+	exit(1);
+    }
+    img = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (img == MAP_FAILED) {
+	perror("mmap");
+	exit(1);
+    }
+    memcpy(img, &s, sizeof(s));
+
+    make_tree(make_dir(-1), 0);
+
+    printf("inodes %d of %d, data blocks %d of %d\n", next_inum, num_inodes, next_block, num_data);
+    if (munmap(img, total) < 0 || fsync(fd) < 0) {
+	perror("write");
+	exit(1);
+    }
+    (void) close(fd);
+    return 0;
+}
@@ -0,0 +1,306 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcache.h"
+#include "fs.h"
+#include "message.h"
+#include "udp.h"
+
+//
+// The server: the main thread takes in requests, and a pool of workers
+// (UFS_THREADS of them, 4 if not set) carries them out, each request
+// answered with a reply. Whatever a request changed is committed
+// (written out, and the image fsynced) before the reply goes back, so a
+// client that never saw the reply can just send the request again.
+//
+// How it works:
+// - Requests go from the main thread to the workers through a bounded
+//   queue, with a lock and two condition variables.
+// - The file system is under a rwlock: lookups, stats and reads share
+//   it, anything that changes the file system has it to itself.
+// - Commits are shared (a group commit): every change gets a number,
+//   and a worker that has made one waits its turn at commit_lock; by
+//   then, whoever went before may have fsynced its change already. If
+//   not, it writes out all the dirty blocks there are (under the rwlock,
+//   so nothing changes under it) and fsyncs them (not under it, so the
+//   others can get on), for its own change and any made since.
+// - Bulk writes come in as fragments, which are gathered in one of a few
+//   partial_t's (one per write in progress, picked by client address and
+//   seq) until the last is in; then the write is queued like any other,
+//   with its own copy of the data. A bulk read is done into a buffer of
+//   the worker's, and sent back a fragment at a time.
+//
+// Each reply carries the version of the inode it was about, and a lease
+// on it of UFS_LEASE_MS milliseconds (from the environment; 1000 if not
+// set), which is how long a client may trust its cache of that inode.
+//
+// With UFS_STATS set in the environment, what the block cache did is
+// printed (to stderr) on the way out.
+//
+
+#define PARTIALS (8)
+#define QUEUE_SIZE (64)
+
+typedef struct {
+    struct sockaddr_in addr;
+    int seq;
+    unsigned int have;  // fragments in so far, a bit each
+    long used;          // when last added to, to pick one to reuse
+    char data[MFS_MAX_BULK];
+} partial_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    message_t m;
+    char *data;         // of a bulk write
+} job_t;
+
+static int sd;
+static partial_t partials[PARTIALS];
+static long clock_now;
+
+static job_t *queue[QUEUE_SIZE];
+static int queue_head, queue_count;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_fill = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_empty = PTHREAD_COND_INITIALIZER;
+
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static long changes;            // made so far (under fs_lock)
+static long durable;            // ...of which are on disk (under commit_lock)
+
+static unsigned int epoch;
+static int lease_ms = 1000;
+
+static long requests;
+
+static void print_stats() {
+    bcache_stats_t st;
+    bcache_stats(&st);
+    fprintf(stderr, "requests %ld: cache hits %ld misses %ld, reads %ld writes %ld fsyncs %ld\n",
+	    requests, st.hits, st.misses, st.reads, st.writes, st.syncs);
+}
+
+static int same_client(struct sockaddr_in *a, struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// takes in one fragment (len bytes) of a bulk write; gives back the whole
+// of the write once it is all there
+static partial_t *reassemble(message_t *m, int len, struct sockaddr_in *addr) {
+    if (m->nbytes < 0 || m->nbytes > MFS_MAX_BULK || m->nfrags != message_frags(m->nbytes))
+	return NULL;
+    if (m->frag < 0 || m->frag >= m->nfrags || len - (int) MESSAGE_HEADER < message_frag_len(m->nbytes, m->frag))
+	return NULL;
+    partial_t *p = NULL;
+    int i;
+    for (i = 0; i < PARTIALS; i++)
+	if (partials[i].have != 0 && partials[i].seq == m->seq && same_client(&partials[i].addr, addr))
+	    p = &partials[i];
+    if (p == NULL) {
+	p = &partials[0];
+	for (i = 1; i < PARTIALS; i++)
+	    if (partials[i].used < p->used)
+		p = &partials[i];
+	p->addr = *addr;
+	p->seq = m->seq;
+	p->have = 0;
+    }
+    p->used = ++clock_now;
+    memcpy(p->data + m->frag * MFS_BLOCK_SIZE, m->buffer, message_frag_len(m->nbytes, m->frag));
+    p->have |= 0x1u << m->frag;
+    if (p->have != (0x1u << m->nfrags) - 1)
+	return NULL;
+    p->have = 0;
+    return p;
+}
+
+static void reply(struct sockaddr_in *addr, message_t *m, char *bulk) {
+    int len = MESSAGE_HEADER;
+    if (m->mtype == MFS_READ && m->rc == 0)
+	len += m->nbytes;
+    if (m->mtype != MFS_READ_BULK || m->rc != 0) {
+	m->nfrags = 1;
+	UDP_Write(sd, addr, (char *) m, len);
+	return;
+    }
+    m->nfrags = message_frags(m->nbytes);
+    for (m->frag = 0; m->frag < m->nfrags; m->frag++) {
+	int n = message_frag_len(m->nbytes, m->frag);
+	memcpy(m->buffer, bulk + m->frag * MFS_BLOCK_SIZE, n);
+	UDP_Write(sd, addr, (char *) m, MESSAGE_HEADER + n);
+    }
+}
+
+static int changes_fs(int mtype) {
+    return mtype == MFS_WRITE || mtype == MFS_WRITE_BULK || mtype == MFS_CREAT || mtype == MFS_UNLINK;
+}
+
+static int handle(message_t *m, char *data, char *bulk) {
+    m->name[sizeof(m->name) - 1] = '\0';
+    switch (m->mtype) {
+    case MFS_LOOKUP:
+	return fs_lookup(m->inum, m->name);
+    case MFS_STAT:
+	return fs_stat(m->inum, &m->stat);
+    case MFS_WRITE:
+	return fs_write(m->inum, m->buffer, m->offset, m->nbytes);
+    case MFS_READ:
+	return fs_read(m->inum, m->buffer, m->offset, m->nbytes);
+    case MFS_CREAT:
+	return fs_creat(m->inum, m->type, m->name, &m->child);
+    case MFS_UNLINK:
+	return fs_unlink(m->inum, m->name, &m->child);
+    case MFS_WRITE_BULK:
+	return fs_write_bulk(m->inum, data, m->offset, m->nbytes);
+    case MFS_READ_BULK:
+	return fs_read_bulk(m->inum, bulk, m->offset, m->nbytes);
+    case MFS_SHUTDOWN:
+	return 0;
+    }
+    return -1;
+}
+
+// makes change number (and those before it) durable
+static int commit(long change) {
+    int rc = 0;
+    pthread_mutex_lock(&commit_lock);
+    if (durable < change) {
+	pthread_rwlock_wrlock(&fs_lock);
+	long upto = changes;
+	rc = fs_write_back();
+	pthread_rwlock_unlock(&fs_lock);
+	if (fs_sync() < 0)
+	    rc = -1;
+	durable = upto;
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return rc;
+}
+
+static void run(job_t *job, char *bulk) {
+    message_t *m = &job->m;
+    long change = 0;
+    __sync_fetch_and_add(&requests, 1);
+    m->child = -1;
+    if (changes_fs(m->mtype) || m->mtype == MFS_SHUTDOWN) {
+	pthread_rwlock_wrlock(&fs_lock);
+	m->rc = handle(m, job->data, bulk);
+	// (an operation that fails has changed nothing)
+	if (m->rc == 0 || m->mtype == MFS_SHUTDOWN)
+	    change = ++changes;
+    } else {
+	pthread_rwlock_rdlock(&fs_lock);
+	m->rc = handle(m, job->data, bulk);
+    }
+    m->epoch = epoch;
+    m->version = fs_version(m->inum);
+    m->lease_ms = lease_ms;
+    m->child_version = fs_version(m->child);
+    pthread_rwlock_unlock(&fs_lock);
+    if (change > 0 && commit(change) < 0)
+	m->rc = -1;
+    reply(&job->addr, m, bulk);
+    if (m->mtype == MFS_SHUTDOWN) {
+	if (getenv("UFS_STATS"))
+	    print_stats();
+	exit(0);
+    }
+}
+
+static void *worker(void *arg) {
+    char *bulk = malloc(MFS_MAX_BULK);
+    if (bulk == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    while (1) {
+	pthread_mutex_lock(&queue_lock);
+	while (queue_count == 0)
+	    pthread_cond_wait(&queue_fill, &queue_lock);
+	job_t *job = queue[queue_head];
+	queue_head = (queue_head + 1) % QUEUE_SIZE;
+	queue_count--;
+	pthread_cond_signal(&queue_empty);
+	pthread_mutex_unlock(&queue_lock);
+
+	run(job, bulk);
+	free(job->data);
+	free(job);
+    }
+    return NULL;
+}
+
+static void put(job_t *job) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count == QUEUE_SIZE)
+	pthread_cond_wait(&queue_empty, &queue_lock);
+    queue[(queue_head + queue_count) % QUEUE_SIZE] = job;
+    queue_count++;
+    pthread_cond_signal(&queue_fill);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+	fprintf(stderr, "usage: server [portnum] [file-system-image]\n");
+	exit(1);
+    }
+    int threads = getenv("UFS_THREADS") ? atoi(getenv("UFS_THREADS")) : 4;
+    if (threads < 1)
+	threads = 1;
+    if (fs_init(argv[2]) < 0) {
+	printf("image does not exist\n");
+	exit(1);
+    }
+    epoch = time(NULL) ^ (getpid() << 16);
+    if (getenv("UFS_LEASE_MS"))
+	lease_ms = atoi(getenv("UFS_LEASE_MS"));
+    sd = UDP_Open(atoi(argv[1]));
+    if (sd < 0)
+	exit(1);
+
+    int i;
+    for (i = 0; i < threads; i++) {
+	pthread_t t;
+	if (pthread_create(&t, NULL, worker, NULL) != 0) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+
+    message_t m;
+    while (1) {
+	struct sockaddr_in addr;
+	int n = UDP_Read(sd, &addr, (char *) &m, sizeof(m));
+	if (n < (int) MESSAGE_HEADER)
+	    continue;
+	// a short write request is one whose buffer was not all there
+	if (m.mtype == MFS_WRITE && (m.nbytes < 0 || m.nbytes > n - (int) MESSAGE_HEADER))
+	    m.nbytes = -1;
+	char *data = NULL;
+	if (m.mtype == MFS_WRITE_BULK) {
+	    partial_t *p = reassemble(&m, n, &addr);
+	    if (p == NULL)
+		continue;
+	    if ((data = malloc(m.nbytes ? m.nbytes : 1)) == NULL)
+		continue;
+	    memcpy(data, p->data, m.nbytes);
+	}
+	job_t *job = malloc(sizeof(job_t));
+	if (job == NULL) {
+	    free(data);
+	    continue;
+	}
+	job->addr = addr;
+	memcpy(&job->m, &m, n < (int) sizeof(m) ? n : (int) sizeof(m));
+	job->data = data;
+	put(job);
+    }
+    return 0;
+}
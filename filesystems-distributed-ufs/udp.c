@@ -0,0 +1,61 @@
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "udp.h"
+
+#define UDP_BUFFER_SIZE (1 << 20)
+
+int UDP_Open(int port) {
+    int fd;
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+	perror("socket");
+	return -1;
+    }
+
+    struct sockaddr_in my_addr;
+    memset(&my_addr, 0, sizeof(my_addr));
+    my_addr.sin_family = AF_INET;
+    my_addr.sin_port = htons(port);
+    my_addr.sin_addr.s_addr = INADDR_ANY;
+
+    int on = 1;
+    (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    // room for a whole bulk transfer's fragments arriving back to back
+    int size = UDP_BUFFER_SIZE;
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    (void) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (bind(fd, (struct sockaddr *) &my_addr, sizeof(my_addr)) == -1) {
+	perror("bind");
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+
+    struct hostent *host = gethostbyname(hostname);
+    if (host == NULL)
+	return -1;
+    addr->sin_addr = *(struct in_addr *) host->h_addr;
+    return 0;
+}
+
+int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n) {
+    return sendto(fd, buffer, n, 0, (struct sockaddr *) addr, sizeof(*addr));
+}
+
+int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n) {
+    socklen_t len = sizeof(*addr);
+    return recvfrom(fd, buffer, n, 0, (struct sockaddr *) addr, &len);
+}
+
+int UDP_Close(int fd) {
+    return close(fd);
+}
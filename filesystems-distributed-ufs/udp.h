@@ -0,0 +1,19 @@
+#ifndef __UDP_H__
+#define __UDP_H__
+
+#include <netinet/in.h>
+
+//
+// The bare UDP helpers the server and the client library share (after
+// the ones in ostep-code/dist-intro). UDP_Open() binds to the given port
+// (0: any), UDP_FillSockAddr() resolves a host, and UDP_Read/Write move
+// one datagram, returning its length (or -1).
+//
+
+int UDP_Open(int port);
+int UDP_FillSockAddr(struct sockaddr_in *addr, char *hostname, int port);
+int UDP_Write(int fd, struct sockaddr_in *addr, char *buffer, int n);
+int UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n);
+int UDP_Close(int fd);
+
+#endif // __UDP_H__
@@ -0,0 +1,649 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+//
+// How it works:
+//
+// - The database is a log, kv.log: a header, then one record per put,
+//   delete or clear, only ever appended to. A record is a small header
+//   (a checksum, the type, the key, the value's length) followed by the
+//   value. A put or delete costs one append, however big the database.
+//
+// - What is in the database is found through an index: an open
+//   addressing hash table from key to the offset of the key's latest
+//   put in the log. It is saved in kv.idx, along with how much of the
+//   log it covers; at startup it is read back and brought up to date by
+//   replaying only the records appended since. It is saved again on the
+//   way out once that tail has grown past INDEX_LAG bytes, so startup
+//   never replays much. If kv.idx is missing, or is for another log
+//   (see compaction), it is rebuilt from the whole log. So the index
+//   need not be durable; the log is (see below). kv.idx is laid out
+//   just as the table is in memory, so loading it is an mmap(): only
+//   the pages a run actually touches are read in, and only those it
+//   changes are ever copied (the mapping is private).
+//
+// - All the commands on the command line are one batch: the records
+//   they append are gathered in memory (gets and deletes later in the
+//   batch read them from there), and written to the log with a single
+//   write() and a single fdatasync() once all have been done.
+//
+// - A record that is cut short or fails its checksum (a crash in the
+//   middle of an append) ends the log: it is truncated away.
+//
+// - Overwritten and deleted values stay in the log as dead bytes. Once
+//   there are more dead bytes than live ones (and at least COMPACT_MIN
+//   of them), the kv process forks a child to compact the log in the
+//   background and exits. The child copies the live records, as of the
+//   fork, to kv.log.new, without holding the lock, as that part of the
+//   old log cannot change. Then it takes the lock, copies whatever was
+//   appended in the meantime, writes the new log's index, and renames
+//   both into place. Each log has a generation number in its header
+//   (and its index, in its own), so an index never gets used with the
+//   wrong log.
+//
+// - Every kv process holds an exclusive flock() on kv.lock while it
+//   uses the files, so runs never interleave; kv.compact keeps more
+//   than one compaction from running at once.
+//
+
+#define LOG_NAME "kv.log"
+#define INDEX_NAME "kv.idx"
+#define LOCK_NAME "kv.lock"
+#define COMPACT_NAME "kv.compact"
+
+#define LOG_MAGIC (0x676f6c766bULL)     // "kvlog"
+#define INDEX_MAGIC (0x786469766bULL)   // "kvidx"
+#define INDEX_LAG (64 << 10)
+#define COMPACT_MIN (1 << 20)
+#define SCAN_BUFFER (1 << 20)
+
+enum { PUT = 1, DELETE = 2, CLEAR = 3 };
+
+typedef struct {
+    uint64_t magic;
+    uint64_t generation;
+} log_header_t;
+
+typedef struct {
+    uint32_t checksum;          // of everything after it, value included
+    uint8_t type;
+    uint8_t unused[3];
+    int32_t key;
+    uint32_t len;               // of the value that follows
+} record_t;
+
+typedef struct {
+    uint64_t offset;            // of the key's put in the log; 0 if free
+    int32_t key;
+    uint32_t len;
+} slot_t;
+
+typedef struct {
+    uint64_t magic;
+    uint64_t generation;        // of the log it is for
+    uint64_t covered;           // how much of the log it has seen
+    uint64_t live;              // bytes of records still in use
+    uint64_t count;             // keys
+    uint64_t capacity;          // slots (a power of two)
+} index_header_t;
+
+typedef struct {
+    index_header_t h;
+    slot_t *slots;
+    void *map;                  // if the slots are in kv.idx, mapped...
+    size_t map_size;            // ...this much of it
+} index_t;
+
+static int lock_fd = -1;
+static int log_fd = -1;
+static uint64_t log_end;        // with the batch...
+static uint64_t log_durable;    // ...and without
+static char *batch;             // what is to be appended
+static size_t batch_len, batch_room;
+static uint64_t generation;
+static index_t idx;
+static uint64_t saved;          // how much of the log kv.idx covers
+
+static void die(char *what) {
+    perror(what);
+    exit(1);
+}
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+	die("malloc");
+    return p;
+}
+
+static void write_all(int fd, void *buf, size_t len, off_t offset, char *name) {
+    char *p = buf;
+    while (len > 0) {
+	ssize_t rc = pwrite(fd, p, len, offset);
+	if (rc < 0)
+	    die(name);
+	p += rc;
+	offset += rc;
+	len -= rc;
+    }
+}
+
+// FNV-1a
+static uint32_t checksum(record_t *r, char *value) {
+    uint32_t h = 2166136261u;
+    unsigned char *p = (unsigned char *) r + sizeof(r->checksum);
+    size_t i;
+    for (i = 0; i < sizeof(record_t) - sizeof(r->checksum); i++)
+	h = (h ^ p[i]) * 16777619u;
+    for (i = 0; i < r->len; i++)
+	h = (h ^ (unsigned char) value[i]) * 16777619u;
+    return h;
+}
+
+static uint64_t record_size(uint32_t len) {
+    return sizeof(record_t) + len;
+}
+
+//
+// The index
+//
+
+static uint32_t hash(int32_t key) {
+    uint32_t x = key;
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static void index_init(index_t *ix, uint64_t capacity) {
+    memset(&ix->h, 0, sizeof(ix->h));
+    ix->h.magic = INDEX_MAGIC;
+    ix->h.generation = generation;
+    ix->h.covered = sizeof(log_header_t);
+    ix->h.capacity = capacity;
+    ix->slots = xmalloc(capacity * sizeof(slot_t));
+    ix->map = NULL;
+    memset(ix->slots, 0, capacity * sizeof(slot_t));
+}
+
+static void index_free(index_t *ix) {
+    if (ix->map)
+	munmap(ix->map, ix->map_size);
+    else
+	free(ix->slots);
+}
+
+static slot_t *index_find(index_t *ix, int32_t key) {
+    uint64_t mask = ix->h.capacity - 1, i = hash(key) & mask;
+    while (ix->slots[i].offset != 0) {
+	if (ix->slots[i].key == key)
+	    return &ix->slots[i];
+	i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void index_insert(index_t *ix, int32_t key, uint64_t offset, uint32_t len);
+
+static void index_grow(index_t *ix) {
+    index_t bigger;
+    index_init(&bigger, ix->h.capacity * 2);
+    bigger.h.generation = ix->h.generation;
+    bigger.h.covered = ix->h.covered;
+    uint64_t i;
+    for (i = 0; i < ix->h.capacity; i++)
+	if (ix->slots[i].offset != 0)
+	    index_insert(&bigger, ix->slots[i].key, ix->slots[i].offset, ix->slots[i].len);
+    index_free(ix);
+    *ix = bigger;
+}
+
+static void index_insert(index_t *ix, int32_t key, uint64_t offset, uint32_t len) {
+    if ((ix->h.count + 1) * 2 > ix->h.capacity)
+	index_grow(ix);
+    uint64_t mask = ix->h.capacity - 1, i = hash(key) & mask;
+    while (ix->slots[i].offset != 0 && ix->slots[i].key != key)
+	i = (i + 1) & mask;
+    if (ix->slots[i].offset != 0)
+	ix->h.live -= record_size(ix->slots[i].len);
+    else
+	ix->h.count++;
+    ix->slots[i].offset = offset;
+    ix->slots[i].key = key;
+    ix->slots[i].len = len;
+    ix->h.live += record_size(len);
+}
+
+// removes s, moving up any later entries of its probe run that would
+// otherwise no longer be found
+static void index_remove(index_t *ix, slot_t *s) {
+    uint64_t mask = ix->h.capacity - 1, hole = s - ix->slots, i = hole;
+    ix->h.live -= record_size(s->len);
+    ix->h.count--;
+    while (1) {
+	ix->slots[hole].offset = 0;
+	do {
+	    i = (i + 1) & mask;
+	    if (ix->slots[i].offset == 0)
+		return;
+	    // can it stay where it is: is its home in (hole, i]?
+	} while (((i - (hash(ix->slots[i].key) & mask)) & mask) < ((i - hole) & mask));
+	ix->slots[hole] = ix->slots[i];
+	hole = i;
+    }
+}
+
+static void index_clear(index_t *ix) {
+    memset(ix->slots, 0, ix->h.capacity * sizeof(slot_t));
+    ix->h.count = 0;
+    ix->h.live = 0;
+}
+
+static void index_apply(index_t *ix, record_t *r, uint64_t offset) {
+    slot_t *s;
+    switch (r->type) {
+    case PUT:
+	index_insert(ix, r->key, offset, r->len);
+	break;
+    case DELETE:
+	if ((s = index_find(ix, r->key)) != NULL)
+	    index_remove(ix, s);
+	break;
+    case CLEAR:
+	index_clear(ix);
+	break;
+    }
+}
+
+static int index_read(index_t *ix) {
+    int fd = open(INDEX_NAME, O_RDONLY);
+    if (fd < 0)
+	return 0;
+    struct stat sbuf;
+    int ok = fstat(fd, &sbuf) == 0 &&
+	pread(fd, &ix->h, sizeof(ix->h), 0) == sizeof(ix->h) &&
+	ix->h.magic == INDEX_MAGIC && ix->h.generation == generation &&
+	ix->h.covered <= log_end && ix->h.capacity > 0 &&
+	(ix->h.capacity & (ix->h.capacity - 1)) == 0 &&
+	sbuf.st_size == (off_t) (sizeof(ix->h) + ix->h.capacity * sizeof(slot_t));
+    if (ok) {
+	ix->map_size = sbuf.st_size;
+	ix->map = mmap(NULL, ix->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	ok = ix->map != MAP_FAILED;
+	ix->slots = (slot_t *) ((char *) ix->map + sizeof(ix->h));
+    }
+    close(fd);
+    return ok;
+}
+
+// via a temporary file, so that a reader never sees half of one
+static void index_write(index_t *ix, char *name) {
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+	die(tmp);
+    write_all(fd, &ix->h, sizeof(ix->h), 0, tmp);
+    write_all(fd, ix->slots, ix->h.capacity * sizeof(slot_t), sizeof(ix->h), tmp);
+    close(fd);
+    if (rename(tmp, name) < 0)
+	die(name);
+}
+
+//
+// The log
+//
+
+//
+// Calls apply on each good record of fd from offset from up to end, and
+// returns where they stop (where a record is cut short or corrupt, or
+// at end).
+//
+static uint64_t log_scan(int fd, uint64_t from, uint64_t end,
+			 void (*apply)(record_t *r, char *value, uint64_t offset)) {
+    size_t room = SCAN_BUFFER, have = 0, at = 0;
+    char *buf = xmalloc(room);
+    uint64_t base = from;       // where buf starts in the file
+    while (1) {
+	uint64_t pos = base + at;
+	record_t r;
+	size_t need = sizeof(record_t);
+	if (pos + need > end)
+	    break;
+	if (have - at >= need) {
+	    memcpy(&r, buf + at, sizeof(r));
+	    need = record_size(r.len);
+	    if (pos + need > end)
+		break;
+	}
+	if (have - at < need) {
+	    // move what is left to the front, and read more
+	    memmove(buf, buf + at, have - at);
+	    base = pos;
+	    have -= at;
+	    at = 0;
+	    if (need > room) {
+		room = need;
+		buf = realloc(buf, room);
+		if (buf == NULL)
+		    die("realloc");
+	    }
+	    ssize_t rc = pread(fd, buf + have, room - have, base + have);
+	    if (rc < 0)
+		die(LOG_NAME);
+	    if (rc == 0)
+		break;
+	    have += rc;
+	    continue;
+	}
+	char *value = buf + at + sizeof(record_t);
+	if (r.type < PUT || r.type > CLEAR || checksum(&r, value) != r.checksum)
+	    break;
+	apply(&r, value, pos);
+	at += need;
+    }
+    free(buf);
+    return base + at;
+}
+
+static void replay_apply(record_t *r, char *value, uint64_t offset) {
+    index_apply(&idx, r, offset);
+}
+
+static void log_open() {
+    log_fd = open(LOG_NAME, O_RDWR | O_CREAT, 0644);
+    if (log_fd < 0)
+	die(LOG_NAME);
+    log_header_t h;
+    ssize_t rc = pread(log_fd, &h, sizeof(h), 0);
+    if (rc == 0) {
+	// a new database
+	h.magic = LOG_MAGIC;
+	h.generation = ((uint64_t) time(NULL) << 20) ^ getpid();
+	write_all(log_fd, &h, sizeof(h), 0, LOG_NAME);
+	if (fdatasync(log_fd) < 0)
+	    die(LOG_NAME);
+    } else if (rc != sizeof(h) || h.magic != LOG_MAGIC) {
+	fprintf(stderr, "kv: %s is not a kv log\n", LOG_NAME);
+	exit(1);
+    }
+    generation = h.generation;
+    struct stat sbuf;
+    if (fstat(log_fd, &sbuf) < 0)
+	die(LOG_NAME);
+    log_end = log_durable = sbuf.st_size;
+
+    if (index_read(&idx)) {
+	saved = idx.h.covered;
+    } else {
+	index_init(&idx, 1024);
+	saved = 0;
+    }
+    uint64_t end = log_scan(log_fd, idx.h.covered, log_end, replay_apply);
+    if (end < log_end) {
+	// the rest is what is left of an append that did not finish
+	if (ftruncate(log_fd, end) < 0)
+	    die(LOG_NAME);
+	log_end = log_durable = end;
+    }
+    idx.h.covered = log_end;
+}
+
+static void log_append(int type, int32_t key, char *value, uint32_t len) {
+    uint64_t size = record_size(len);
+    if (batch_len + size > batch_room) {
+	while (batch_len + size > batch_room)
+	    batch_room = batch_room ? 2 * batch_room : SCAN_BUFFER;
+	batch = realloc(batch, batch_room);
+	if (batch == NULL)
+	    die("realloc");
+    }
+    record_t *r = (record_t *) (batch + batch_len);
+    memset(r, 0, sizeof(record_t));
+    r->type = type;
+    r->key = key;
+    r->len = len;
+    memcpy(batch + batch_len + sizeof(record_t), value, len);
+    r->checksum = checksum(r, batch + batch_len + sizeof(record_t));
+    index_apply(&idx, r, log_end);
+    batch_len += size;
+    log_end += size;
+    idx.h.covered = log_end;
+}
+
+// makes the batch durable
+static void log_commit() {
+    if (batch_len == 0)
+	return;
+    write_all(log_fd, batch, batch_len, log_durable, LOG_NAME);
+    if (fdatasync(log_fd) < 0)
+	die(LOG_NAME);
+    log_durable = log_end;
+    batch_len = 0;
+}
+
+// the value of s, as a malloc()'d string
+static char *log_value(slot_t *s) {
+    char *value = xmalloc(s->len + 1);
+    uint64_t at = s->offset + sizeof(record_t);
+    if (s->offset >= log_durable) {
+	memcpy(value, batch + (at - log_durable), s->len);
+    } else if (pread(log_fd, value, s->len, at) != (ssize_t) s->len) {
+	die(LOG_NAME);
+    }
+    value[s->len] = '\0';
+    return value;
+}
+
+//
+// Compaction
+//
+
+static int new_fd;
+static char *new_buf;
+static size_t new_buffered;
+static uint64_t new_end;
+static index_t new_idx;
+
+static void new_flush() {
+    write_all(new_fd, new_buf, new_buffered, new_end - new_buffered, LOG_NAME ".new");
+    new_buffered = 0;
+}
+
+static void new_append(record_t *r, char *value, uint64_t offset) {
+    size_t size = record_size(r->len);
+    if (new_buffered + size > SCAN_BUFFER) {
+	new_flush();
+	if (size > SCAN_BUFFER) {
+	    write_all(new_fd, r, sizeof(record_t), new_end, LOG_NAME ".new");
+	    write_all(new_fd, value, r->len, new_end + sizeof(record_t), LOG_NAME ".new");
+	    index_apply(&new_idx, r, new_end);
+	    new_end += size;
+	    return;
+	}
+    }
+    memcpy(new_buf + new_buffered, r, sizeof(record_t));
+    memcpy(new_buf + new_buffered + sizeof(record_t), value, r->len);
+    new_buffered += size;
+    index_apply(&new_idx, r, new_end);
+    new_end += size;
+}
+
+static void compact() {
+    // the child of a kv process, which has exited: idx is as of then
+    int fd = open(COMPACT_NAME, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) < 0)
+	exit(0);                // someone else is at it
+
+    new_fd = open(LOG_NAME ".new", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (new_fd < 0)
+	die(LOG_NAME ".new");
+    uint64_t old_generation = generation;
+    log_header_t h = { LOG_MAGIC, generation + 1 };
+    generation = h.generation;
+    write_all(new_fd, &h, sizeof(h), 0, LOG_NAME ".new");
+    new_end = sizeof(h);
+    new_buf = xmalloc(SCAN_BUFFER);
+    new_buffered = 0;
+    index_init(&new_idx, idx.h.capacity);
+
+    // the live records, as of the fork
+    uint64_t i;
+    for (i = 0; i < idx.h.capacity; i++) {
+	slot_t *s = &idx.slots[i];
+	if (s->offset == 0)
+	    continue;
+	char *buf = xmalloc(record_size(s->len));
+	ssize_t rc = pread(log_fd, buf, record_size(s->len), s->offset);
+	if (rc != (ssize_t) record_size(s->len))
+	    die(LOG_NAME);
+	new_append((record_t *) buf, buf + sizeof(record_t), s->offset);
+	free(buf);
+    }
+
+    // (deletes and clears since then have to be copied too, as what
+    // they delete may be in the new log by now)
+
+    // and then everything since
+    int lock = open(LOCK_NAME, O_RDWR | O_CREAT, 0644);
+    if (lock < 0 || flock(lock, LOCK_EX) < 0)
+	die(LOCK_NAME);
+    int fd_now = open(LOG_NAME, O_RDONLY);
+    log_header_t now;
+    struct stat sbuf;
+    if (fd_now < 0 || pread(fd_now, &now, sizeof(now), 0) != sizeof(now) ||
+	now.generation != old_generation || fstat(fd_now, &sbuf) < 0) {
+	unlink(LOG_NAME ".new");
+	exit(0);
+    }
+    log_scan(fd_now, idx.h.covered, sbuf.st_size, new_append);
+    new_flush();
+    if (fsync(new_fd) < 0)
+	die(LOG_NAME ".new");
+    new_idx.h.covered = new_end;
+    index_write(&new_idx, INDEX_NAME ".new");
+    if (rename(LOG_NAME ".new", LOG_NAME) < 0 || rename(INDEX_NAME ".new", INDEX_NAME) < 0)
+	die("rename");
+    exit(0);
+}
+
+static void maybe_compact() {
+    uint64_t dead = log_end - sizeof(log_header_t) - idx.h.live;
+    if (dead < COMPACT_MIN || dead < idx.h.live)
+	return;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0)
+	return;                 // (if fork() failed, there is always next time)
+    // the lock goes with the parent, and whoever ran kv should see it
+    // finish, not wait on this
+    close(lock_fd);
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, 0);
+    dup2(null, 1);
+    dup2(null, 2);
+    setsid();
+    compact();
+}
+
+//
+// Commands
+//
+
+static void open_db() {
+    if (log_fd >= 0)
+	return;
+    lock_fd = open(LOCK_NAME, O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0)
+	die(LOCK_NAME);
+    log_open();
+}
+
+// splits off the next field of *s; NULL if there is none
+static char *field(char **s) {
+    return *s ? strsep(s, ",") : NULL;
+}
+
+static void command(char *arg) {
+    char *rest = arg, *cmd = field(&rest), *key_s = field(&rest), *value = field(&rest);
+    slot_t *s;
+    if (cmd == NULL || strlen(cmd) != 1 || rest != NULL)
+	goto bad;
+    switch (cmd[0]) {
+    case 'p':
+	if (key_s == NULL || value == NULL)
+	    goto bad;
+	open_db();
+	log_append(PUT, atoi(key_s), value, strlen(value));
+	return;
+    case 'g':
+	if (key_s == NULL || value != NULL)
+	    goto bad;
+	open_db();
+	if ((s = index_find(&idx, atoi(key_s))) == NULL) {
+	    printf("%d not found\n", atoi(key_s));
+	} else {
+	    char *v = log_value(s);
+	    printf("%d,%s\n", s->key, v);
+	    free(v);
+	}
+	return;
+    case 'd':
+	if (key_s == NULL || value != NULL)
+	    goto bad;
+	open_db();
+	if (index_find(&idx, atoi(key_s)) == NULL)
+	    printf("%d not found\n", atoi(key_s));
+	else
+	    log_append(DELETE, atoi(key_s), "", 0);
+	return;
+    case 'c':
+	if (key_s != NULL)
+	    goto bad;
+	open_db();
+	if (idx.h.count > 0)
+	    log_append(CLEAR, 0, "", 0);
+	return;
+    case 'a':
+	if (key_s != NULL)
+	    goto bad;
+	open_db();
+	uint64_t i;
+	for (i = 0; i < idx.h.capacity; i++) {
+	    if ((s = &idx.slots[i])->offset == 0)
+		continue;
+	    char *v = log_value(s);
+	    printf("%d,%s\n", s->key, v);
+	    free(v);
+	}
+	return;
+    }
+ bad:
+    printf("bad command\n");
+}
+
+int main(int argc, char *argv[]) {
+    int i;
+    for (i = 1; i < argc; i++)
+	command(argv[i]);
+    if (log_fd < 0)
+	return 0;
+    log_commit();
+    if (log_end - saved > INDEX_LAG)
+	index_write(&idx, INDEX_NAME);
+    maybe_compact();
+    return 0;
+}
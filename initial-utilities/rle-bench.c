@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "rle.h"
+
+//
+// Times the kernels in rle.h against each other:
+//
+// prompt> gcc -O -Wall -Werror -o rle-bench rle-bench.c
+// prompt> ./rle-bench [file ...]
+//
+// Each input (three synthetic ones, then any files given) is cut into
+// runs by every run kernel, which must agree on how many runs there
+// are; then those runs are expanded again by both expanders, which must
+// give back the input. Each is done a few times, and the best time is
+// reported, in MB (of uncompressed data) per second.
+//
+
+#define SYNTHETIC_SIZE (16 << 20)
+#define REPEATS (5)
+
+typedef struct {
+    char *name;
+    unsigned char *data;
+    size_t len;
+} input_t;
+
+typedef struct {
+    uint32_t count;
+    char c;
+} run_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+	fprintf(stderr, "rle-bench: out of memory\n");
+	exit(1);
+    }
+    return p;
+}
+
+// runs of random characters, with lengths up to max_run
+static input_t synthetic(char *name, size_t max_run) {
+    input_t in = { name, xmalloc(SYNTHETIC_SIZE), SYNTHETIC_SIZE };
+    size_t at = 0;
+    srandom(1);
+    while (at < in.len) {
+	size_t n = 1 + random() % max_run;
+	if (n > in.len - at)
+	    n = in.len - at;
+	memset(in.data + at, 'a' + random() % 26, n);
+	at += n;
+    }
+    return in;
+}
+
+static input_t from_file(char *name) {
+    input_t in = { name, NULL, 0 };
+    FILE *fp = fopen(name, "r");
+    if (fp == NULL) {
+	fprintf(stderr, "rle-bench: cannot open %s\n", name);
+	exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    in.len = ftell(fp);
+    rewind(fp);
+    in.data = xmalloc(in.len);
+    if (fread(in.data, 1, in.len, fp) != in.len) {
+	fprintf(stderr, "rle-bench: cannot read %s\n", name);
+	exit(1);
+    }
+    fclose(fp);
+    return in;
+}
+
+static size_t cut(input_t *in, rle_run_t run, run_t *runs) {
+    size_t at = 0, n = 0;
+    while (at < in->len) {
+	size_t len = run(in->data + at, in->len - at);
+	runs[n].count = len;
+	runs[n].c = in->data[at];
+	n++;
+	at += len;
+    }
+    return n;
+}
+
+static void report(char *what, size_t len, double best) {
+    printf("  %-14s %10.1f MB/s\n", what, len / best / 1e6);
+}
+
+static void bench(input_t *in) {
+    struct {
+	char *name;
+	rle_run_t run;
+    } kernels[] = {
+	{ "scalar", rle_run_scalar },
+#ifdef __SSE2__
+	{ "sse2", rle_run_sse2 },
+#endif
+#ifdef RLE_HAVE_AVX2
+	{ "avx2", rle_run_avx2 },
+#endif
+    };
+    int num_kernels = sizeof(kernels) / sizeof(kernels[0]), k, r;
+#ifdef RLE_HAVE_AVX2
+    if (!__builtin_cpu_supports("avx2"))
+	num_kernels--;
+#endif
+    run_t *runs = xmalloc(in->len * sizeof(run_t));
+    size_t num_runs = 0;
+
+    printf("%s: %zu bytes\n", in->name, in->len);
+    for (k = 0; k < num_kernels; k++) {
+	double best = 1e9;
+	for (r = 0; r < REPEATS; r++) {
+	    double start = now();
+	    size_t n = cut(in, kernels[k].run, runs);
+	    double took = now() - start;
+	    if (took < best)
+		best = took;
+	    if (k > 0 && n != num_runs) {
+		fprintf(stderr, "rle-bench: %s found %zu runs, not %zu\n", kernels[k].name, n, num_runs);
+		exit(1);
+	    }
+	    num_runs = n;
+	}
+	report(kernels[k].name, in->len, best);
+    }
+    printf("  (%zu runs, %.1f bytes each)\n", num_runs, num_runs ? (double) in->len / num_runs : 0.0);
+
+    char *out = xmalloc(in->len);
+    for (k = 0; k < 2; k++) {
+	double best = 1e9;
+	for (r = 0; r < REPEATS; r++) {
+	    double start = now();
+	    char *o = out;
+	    size_t i;
+	    for (i = 0; i < num_runs; i++)
+		o = k == 0 ? rle_expand_loop(o, runs[i].c, runs[i].count) : rle_expand(o, runs[i].c, runs[i].count);
+	    double took = now() - start;
+	    if (took < best)
+		best = took;
+	}
+	if (memcmp(out, in->data, in->len) != 0) {
+	    fprintf(stderr, "rle-bench: expanding did not give back the input\n");
+	    exit(1);
+	}
+	report(k == 0 ? "expand loop" : "expand memset", in->len, best);
+    }
+    free(out);
+    free(runs);
+}
+
+int main(int argc, char *argv[]) {
+    input_t synthetics[] = {
+	synthetic("short runs (1-4)", 4),
+	synthetic("mixed runs (1-64)", 64),
+	synthetic("long runs (1-4096)", 4096),
+    };
+    int i;
+    for (i = 0; i < 3; i++) {
+	bench(&synthetics[i]);
+	free(synthetics[i].data);
+    }
+    for (i = 1; i < argc; i++) {
+	input_t in = from_file(argv[i]);
+	bench(&in);
+	free(in.data);
+    }
+    return 0;
+}
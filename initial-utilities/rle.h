@@ -0,0 +1,90 @@
+#ifndef __RLE_H__
+#define __RLE_H__
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//
+// The inner loops of wzip and wunzip (and rle-bench, which times them).
+//
+// A run kernel returns how long the run of p[0] is, within the n (> 0)
+// bytes at p. The scalar one looks at a byte at a time. The SSE2 and
+// AVX2 ones compare 16 or 32 bytes at once against the run's byte and
+// find the first one that differs from the comparison's mask; the tail
+// of fewer than that many bytes is done a byte at a time. rle_pick_run()
+// gives the best one this processor has.
+//
+// An expander writes count copies of c at out, and returns where they
+// end: a byte at a time, or with one memset().
+//
+
+typedef size_t (*rle_run_t)(const unsigned char *p, size_t n);
+
+static inline size_t rle_run_scalar(const unsigned char *p, size_t n) {
+    unsigned char c = p[0];
+    size_t i = 1;
+    while (i < n && p[i] == c)
+	i++;
+    return i;
+}
+
+#ifdef __SSE2__
+static inline size_t rle_run_sse2(const unsigned char *p, size_t n) {
+    __m128i c = _mm_set1_epi8(p[0]);
+    size_t i = 1;
+    while (i + 16 <= n) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+	unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(v, c));
+	if (same != 0xffff)
+	    return i + __builtin_ctz(~same);
+	i += 16;
+    }
+    return i + rle_run_scalar(p + i - 1, n - i + 1) - 1;
+}
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RLE_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline size_t rle_run_avx2(const unsigned char *p, size_t n) {
+    __m256i c = _mm256_set1_epi8(p[0]);
+    size_t i = 1;
+    while (i + 32 <= n) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+	unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, c));
+	if (same != 0xffffffffu)
+	    return i + __builtin_ctz(~same);
+	i += 32;
+    }
+    return i + rle_run_scalar(p + i - 1, n - i + 1) - 1;
+}
+#endif
+
+static inline rle_run_t rle_pick_run() {
+#ifdef RLE_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return rle_run_avx2;
+#endif
+#ifdef __SSE2__
+    return rle_run_sse2;
+#else
+    return rle_run_scalar;
+#endif
+}
+
+static inline char *rle_expand_loop(char *out, char c, size_t count) {
+    while (count-- > 0)
+	*out++ = c;
+    return out;
+}
+
+static inline char *rle_expand(char *out, char c, size_t count) {
+    memset(out, c, count);
+    return out + count;
+}
+
+#endif // __RLE_H__
@@ -0,0 +1,81 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../rle.h"
+
+//
+// The compressed files are read a buffer at a time, and each run is
+// expanded with a memset() (see rle.h) into the output buffer, which is
+// written out whenever it fills; a run longer than what is left of it
+// is expanded a piece at a time. As with wzip, the files are one
+// stream, so an entry may start in one buffer (or file) and end in the
+// next; the bytes of it seen so far are kept until it is whole.
+//
+
+#define BUFFER_SIZE (1 << 20)
+#define RUN_SIZE (5)
+
+static char in[BUFFER_SIZE];
+static char out[BUFFER_SIZE];
+static size_t out_len = 0;
+
+static void expand(uint32_t count, char c) {
+    while (count > 0) {
+	if (out_len == sizeof(out)) {
+	    fwrite(out, 1, out_len, stdout);
+	    out_len = 0;
+	}
+	size_t n = sizeof(out) - out_len;
+	if (n > count)
+	    n = count;
+	rle_expand(out + out_len, c, n);
+	out_len += n;
+	count -= n;
+    }
+}
+
+static void expand_entry(char *entry) {
+    uint32_t count;
+    memcpy(&count, entry, sizeof(count));
+    expand(count, entry[sizeof(count)]);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+	printf("wunzip: file1 [file2 ...]\n");
+	exit(1);
+    }
+    char partial[RUN_SIZE];     // an entry cut short by the end of a buffer
+    size_t partial_len = 0;
+    int i;
+    for (i = 1; i < argc; i++) {
+	FILE *fp = fopen(argv[i], "r");
+	if (fp == NULL) {
+	    printf("wunzip: cannot open file\n");
+	    exit(1);
+	}
+	size_t len;
+	while ((len = fread(in, 1, sizeof(in), fp)) > 0) {
+	    size_t at = 0;
+	    if (partial_len > 0) {
+		size_t n = RUN_SIZE - partial_len;
+		if (n > len)
+		    n = len;
+		memcpy(partial + partial_len, in, n);
+		partial_len += n;
+		at = n;
+		if (partial_len < RUN_SIZE)
+		    continue;
+		expand_entry(partial);
+		partial_len = 0;
+	    }
+	    for (; at + RUN_SIZE <= len; at += RUN_SIZE)
+		expand_entry(in + at);
+	    memcpy(partial, in + at, len - at);
+	    partial_len = len - at;
+	}
+	fclose(fp);
+    }
+    fwrite(out, 1, out_len, stdout);
+    return 0;
+}
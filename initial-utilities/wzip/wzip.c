@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../rle.h"
+
+//
+// The files are read a buffer at a time, and each buffer is cut into
+// runs with the fastest run kernel there is (see rle.h). The current
+// run is carried over from one buffer (and file) to the next, as the
+// files are compressed as one stream. Output goes through a buffer of
+// its own too, written out whenever it fills.
+//
+
+#define BUFFER_SIZE (1 << 20)
+#define RUN_SIZE (5)
+
+static unsigned char in[BUFFER_SIZE];
+static char out[BUFFER_SIZE];
+static size_t out_len = 0;
+
+static void put_run(uint32_t count, char c) {
+    if (out_len + RUN_SIZE > sizeof(out)) {
+	fwrite(out, 1, out_len, stdout);
+	out_len = 0;
+    }
+    memcpy(out + out_len, &count, sizeof(count));
+    out[out_len + sizeof(count)] = c;
+    out_len += RUN_SIZE;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+	printf("wzip: file1 [file2 ...]\n");
+	exit(1);
+    }
+    rle_run_t run = rle_pick_run();
+    uint32_t count = 0;         // the run so far...
+    char c = 0;                 // ...of this
+    int i;
+    for (i = 1; i < argc; i++) {
+	FILE *fp = fopen(argv[i], "r");
+	if (fp == NULL) {
+	    printf("wzip: cannot open file\n");
+	    exit(1);
+	}
+	size_t len;
+	while ((len = fread(in, 1, sizeof(in), fp)) > 0) {
+	    size_t at = 0;
+	    while (at < len) {
+		size_t n = run(in + at, len - at);
+		if (count > 0 && in[at] == (unsigned char) c) {
+		    count += n;
+		} else {
+		    if (count > 0)
+			put_run(count, c);
+		    count = n;
+		    c = in[at];
+		}
+		at += n;
+	    }
+	}
+	fclose(fp);
+    }
+    if (count > 0)
+	put_run(count, c);
+    fwrite(out, 1, out_len, stdout);
+    return 0;
+}